@@ -4,6 +4,13 @@
 #include <iomanip>
 #include <unordered_map>
 #include <stdexcept>
+#include <vector>
+#include <array>
+#include <memory>
+#include <algorithm>
+#include <map>
+#include <optional>
+#include <string>
 
 using size_t = std::size_t;
 
@@ -16,16 +23,101 @@ enum intcode
     halt = 99
 };
 
-using memory_t = std::unordered_map<size_t, size_t>;
+// Program memory as a page table over 4 KiB pages. A page is allocated by the
+// first write that lands on it, reads of anything never written return 0, so a
+// program only costs the memory it touches.
+//
+// Copies share every page. Both sides lose write access to them, and the first
+// write to a page that is still shared copies it.
+struct memory_t {
+    constexpr const static size_t page_bits = 9;
+    constexpr const static size_t page_size = size_t(1) << page_bits; // In words
+    constexpr const static size_t page_mask = page_size - 1;
+    constexpr const static size_t max_pages = size_t(1) << 20; // 4 GiB worth of words
+
+    using page_t = std::array<size_t, page_size>;
+
+    memory_t() = default;
+    memory_t(size_t const* image, size_t size);
+
+    memory_t(memory_t const& other) { *this = other; }
+    memory_t& operator = (memory_t const& other);
+    memory_t(memory_t&&) = default;
+    memory_t& operator = (memory_t&&) = default;
+
+    size_t read(size_t address) const {
+        size_t index = address >> page_bits;
+        if (index >= table.size() || table[index] == nullptr)
+            return 0;
+
+        return (*table[index])[address & page_mask];
+    }
+
+    void write(size_t address, size_t value) {
+        size_t index = address >> page_bits;
+        page_t* page = index < writable.size() ? writable[index] : nullptr;
+        if (page == nullptr)
+            page = &make_writable(index);
+
+        (*page)[address & page_mask] = value;
+    }
+
+    page_t& make_writable(size_t index);
+
+    std::vector<page_t*> table; // By page index, nullptr if never written
+    mutable std::vector<page_t*> writable; // Same, but only pages nobody else shares
+    std::vector<std::shared_ptr<page_t>> pages;
+};
+
+memory_t::memory_t(size_t const* image, size_t size) {
+    for (size_t address = 0; address < size; address += page_size) {
+        page_t& page = make_writable(address >> page_bits);
+        std::copy(image + address, image + std::min(size, address + page_size), page.begin());
+    }
+}
+
+memory_t& memory_t::operator = (memory_t const& other) {
+    if (this != &other) {
+        table = other.table;
+        pages = other.pages;
+        writable.assign(table.size(), nullptr);
+        std::fill(other.writable.begin(), other.writable.end(), nullptr);
+    }
+
+    return *this;
+}
+
+memory_t::page_t& memory_t::make_writable(size_t index) {
+    if (index >= max_pages)
+        throw std::runtime_error("address out of range");
+
+    if (index >= table.size()) {
+        table.resize(index + 1);
+        writable.resize(index + 1);
+        pages.resize(index + 1);
+    }
+
+    std::shared_ptr<page_t>& page = pages[index];
+    if (page == nullptr) {
+        page = std::make_shared<page_t>();
+        page->fill(0);
+    }
+    else if (page.use_count() > 1) {
+        page = std::make_shared<page_t>(*page);
+    }
+
+    table[index] = writable[index] = page.get();
+    return *page;
+}
 
 struct rocket {
     size_t handle_opcode(intcode code, size_t l, size_t r, size_t o) {
         switch (code) {
             case add:
-                ram[o] = ram[l] + ram[r];
+                ram.write(o, ram.read(l) + ram.read(r));
                 return 4;
             case multiply:
-                ram[o] = ram[l] * ram[r];
+                ram.write(o, ram.read(l) * ram.read(r));
                 return 4;
             case halt:
                 return 1;
@@ -35,41 +127,468 @@ struct rocket {
     }
 
     template <size_t N>
-    rocket(const size_t (&state)[N]) {
-        for (size_t i = 0; i < N; ++i)
-            ram[i] = state[i];
+    rocket(const size_t (&state)[N]) : ram(state, N) {
     }
 
     void patch(size_t ofs, size_t v) {
-        ram[ofs] = v;
+        ram.write(ofs, v);
     }
 
     void run() {
         size_t position = 0;
         while (true) {
-            intcode op = (intcode) ram[position];
+            intcode op = (intcode) ram.read(position);
             if (op == halt)
                 break;
 
-            size_t l = ram[position + 1];
-            size_t r = ram[position + 2];
-            size_t o = ram[position + 3];
+            size_t l = ram.read(position + 1);
+            size_t r = ram.read(position + 2);
+            size_t o = ram.read(position + 3);
 
             position += handle_opcode(op, l, r, o);
         }
     }
 
-    size_t read_memory(size_t position) { return ram[position]; }
+    size_t read_memory(size_t position) { return ram.read(position); }
 
 private:
     memory_t ram;
 };
 
+// Runs lanes copies of the same image in lockstep. Memory is laid out by
+// address with every lane's copy of a word next to each other (structure of
+// arrays), so an add or a multiply is one pass over contiguous lanes, which
+// the compiler turns into vector instructions.
+//
+// Lanes share a single position for as long as they agree on the opcode. Lanes
+// pointing at different addresses just gather and scatter their own words, but
+// the first time they disagree on the opcode every lane finishes on its own.
+template <size_t lanes>
+struct rocket_batch {
+    using word_t = std::array<size_t, lanes>;
+
+    template <size_t N>
+    rocket_batch(const size_t (&state)[N]) : ram(N) {
+        for (size_t i = 0; i < N; ++i)
+            ram[i].fill(state[i]);
+    }
+
+    void patch(size_t lane, size_t ofs, size_t v) {
+        at(ofs)[lane] = v;
+    }
+
+    void run() {
+        size_t position = 0;
+        while (true) {
+            word_t const& op = read(position);
+            if (!uniform(op))
+                break;
+
+            if (op[0] == halt)
+                return;
+
+            if (op[0] != add && op[0] != multiply)
+                throw std::runtime_error("unhandled opc");
+
+            bool is_add = op[0] == add;
+            word_t lhs = gather(read(position + 1));
+            word_t rhs = gather(read(position + 2));
+            word_t o = read(position + 3);
+
+            word_t value;
+            if (is_add) {
+                for (size_t i = 0; i < lanes; ++i)
+                    value[i] = lhs[i] + rhs[i];
+            }
+            else {
+                for (size_t i = 0; i < lanes; ++i)
+                    value[i] = lhs[i] * rhs[i];
+            }
+
+            if (uniform(o)) {
+                at(o[0]) = value;
+            }
+            else {
+                for (size_t i = 0; i < lanes; ++i)
+                    at(o[i])[i] = value[i];
+            }
+
+            position += 4;
+        }
+
+        for (size_t lane = 0; lane < lanes; ++lane)
+            run_lane(lane, position);
+    }
+
+    size_t read_memory(size_t lane, size_t position) const { return read(position)[lane]; }
+
+private:
+    static bool uniform(word_t const& word) {
+        bool same = true;
+        for (size_t i = 1; i < lanes; ++i)
+            same &= word[i] == word[0];
+        return same;
+    }
+
+    // Each lane's word at that lane's address
+    word_t gather(word_t const& addresses) const {
+        if (uniform(addresses))
+            return read(addresses[0]);
+
+        word_t words;
+        for (size_t i = 0; i < lanes; ++i)
+            words[i] = read(addresses[i])[i];
+        return words;
+    }
+
+    word_t const& read(size_t address) const {
+        static const word_t zero{};
+        return address < ram.size() ? ram[address] : zero;
+    }
+
+    word_t& at(size_t address) {
+        if (address >= memory_t::max_pages * memory_t::page_size)
+            throw std::runtime_error("address out of range");
+
+        if (address >= ram.size())
+            ram.resize(address + 1);
+        return ram[address];
+    }
+
+    // Same as rocket::run, on one lane
+    void run_lane(size_t lane, size_t position) {
+        while (true) {
+            intcode op = (intcode) read(position)[lane];
+            if (op == halt)
+                break;
+
+            size_t l = read(position + 1)[lane];
+            size_t r = read(position + 2)[lane];
+            size_t o = read(position + 3)[lane];
+
+            switch (op) {
+                case add:
+                    at(o)[lane] = read(l)[lane] + read(r)[lane];
+                    break;
+                case multiply:
+                    at(o)[lane] = read(l)[lane] * read(r)[lane];
+                    break;
+                default:
+                    throw std::runtime_error("unhandled opc");
+            }
+
+            position += 4;
+        }
+    }
+
+    std::vector<word_t> ram;
+};
+
+// Polynomial over the symbols with wrapping size_t coefficients, keyed by the
+// exponent of every symbol in the term.
+struct polynomial_t {
+    using monomial_t = std::vector<size_t>;
+
+    static polynomial_t constant(size_t value) {
+        polynomial_t p;
+        if (value != 0)
+            p.terms[{}] = value;
+        return p;
+    }
+
+    static polynomial_t symbol(size_t index) {
+        polynomial_t p;
+        monomial_t monomial(index + 1, 0);
+        monomial[index] = 1;
+        p.terms[monomial] = 1;
+        return p;
+    }
+
+    polynomial_t operator + (polynomial_t const& other) const {
+        polynomial_t p = *this;
+        for (auto&& [monomial, coefficient] : other.terms)
+            p.accumulate(monomial, coefficient);
+        return p;
+    }
+
+    polynomial_t operator * (polynomial_t const& other) const {
+        polynomial_t p;
+        for (auto&& [lm, lc] : terms) {
+            for (auto&& [rm, rc] : other.terms) {
+                monomial_t monomial(std::max(lm.size(), rm.size()), 0);
+                for (size_t i = 0; i < lm.size(); ++i) monomial[i] += lm[i];
+                for (size_t i = 0; i < rm.size(); ++i) monomial[i] += rm[i];
+                p.accumulate(monomial, lc * rc);
+            }
+        }
+        return p;
+    }
+
+    size_t evaluate(std::vector<size_t> const& values) const {
+        size_t sum = 0;
+        for (auto&& [monomial, coefficient] : terms) {
+            size_t term = coefficient;
+            for (size_t i = 0; i < monomial.size(); ++i)
+                for (size_t e = 0; e < monomial[i]; ++e)
+                    term *= values[i];
+            sum += term;
+        }
+        return sum;
+    }
+
+    // Coefficients of the polynomial in symbol index, once every symbol before it has a value
+    std::vector<size_t> collect(size_t index, std::vector<size_t> const& values) const {
+        std::vector<size_t> coefficients(1, 0);
+        for (auto&& [monomial, coefficient] : terms) {
+            size_t term = coefficient;
+            for (size_t i = 0; i < monomial.size() && i < index; ++i)
+                for (size_t e = 0; e < monomial[i]; ++e)
+                    term *= values[i];
+
+            size_t degree = index < monomial.size() ? monomial[index] : 0;
+            if (degree >= coefficients.size())
+                coefficients.resize(degree + 1, 0);
+            coefficients[degree] += term;
+        }
+
+        while (coefficients.size() > 1 && coefficients.back() == 0)
+            coefficients.pop_back();
+        return coefficients;
+    }
+
+    std::string to_string(std::vector<std::string> const& names) const {
+        std::string text;
+        for (auto it = terms.rbegin(); it != terms.rend(); ++it) {
+            auto&& [monomial, coefficient] = *it;
+            std::string term = coefficient != 1 || std::count(monomial.begin(), monomial.end(), 0) == ptrdiff_t(monomial.size()) ? std::to_string(coefficient) : "";
+            for (size_t i = 0; i < monomial.size(); ++i) {
+                for (size_t e = 0; e < monomial[i]; ++e)
+                    term += (term.empty() ? "" : " * ") + names[i];
+            }
+            text += (text.empty() ? "" : " + ") + term;
+        }
+        return text.empty() ? "0" : text;
+    }
+
+    std::map<monomial_t, size_t> terms; // Never holds a zero coefficient or trailing zero exponents
+
+private:
+    void accumulate(monomial_t monomial, size_t coefficient) {
+        while (!monomial.empty() && monomial.back() == 0)
+            monomial.pop_back();
+
+        size_t& slot = terms[monomial];
+        slot += coefficient;
+        if (slot == 0)
+            terms.erase(monomial);
+    }
+};
+
+// Runs the program with some cells standing for unknowns. Every cell holds a node
+// of an expression DAG instead of a number, constants fold as they go.
+//
+// The opcode and the three addresses of every instruction have to come out
+// constant, otherwise run() gives up and the caller has to go concrete. A load
+// through a symbolic address just yields an opaque value, which only poisons
+// whatever ends up depending on it.
+struct symbolic_rocket {
+    struct node_t {
+        enum kind_t { constant, symbol, sum, product, opaque };
+
+        kind_t kind;
+        size_t value; // constant: the value, symbol: its index
+        size_t lhs;
+        size_t rhs;
+    };
+
+    template <size_t N>
+    symbolic_rocket(const size_t (&state)[N]) : ram(N) {
+        make({ node_t::constant, 0, 0, 0 }); // Node 0, whatever was never written
+        for (size_t i = 0; i < N; ++i)
+            ram[i] = make({ node_t::constant, state[i], 0, 0 });
+    }
+
+    // The cell now holds a new unknown, returns its index
+    size_t make_symbol(size_t ofs) {
+        at(ofs) = make({ node_t::symbol, symbol_count, 0, 0 });
+        return symbol_count++;
+    }
+
+    void patch(size_t ofs, size_t v) {
+        at(ofs) = make({ node_t::constant, v, 0, 0 });
+    }
+
+    bool run() {
+        size_t position = 0;
+        while (true) {
+            std::optional<size_t> op = constant(read(position));
+            if (!op)
+                return false;
+
+            if (*op == halt)
+                return true;
+
+            if (*op != add && *op != multiply)
+                throw std::runtime_error("unhandled opc");
+
+            size_t l = read(position + 1);
+            size_t r = read(position + 2);
+            std::optional<size_t> o = constant(read(position + 3));
+            if (!o)
+                return false;
+
+            size_t lhs = load(l);
+            size_t rhs = load(r);
+            at(*o) = make({ *op == add ? node_t::sum : node_t::product, 0, lhs, rhs });
+            position += 4;
+        }
+    }
+
+    // What the cell holds in terms of the symbols, nullopt if it went through an opaque load
+    std::optional<polynomial_t> read_memory(size_t position) {
+        std::vector<std::optional<polynomial_t>> memo(nodes.size());
+        return expand(read(position), memo);
+    }
+
+private:
+    size_t make(node_t node) {
+        if (node.kind == node_t::sum || node.kind == node_t::product) {
+            node_t const& lhs = nodes[node.lhs];
+            node_t const& rhs = nodes[node.rhs];
+
+            if (lhs.kind == node_t::opaque || rhs.kind == node_t::opaque)
+                return make({ node_t::opaque, 0, 0, 0 });
+
+            if (lhs.kind == node_t::constant && rhs.kind == node_t::constant)
+                return make({ node_t::constant, node.kind == node_t::sum ? lhs.value + rhs.value : lhs.value * rhs.value, 0, 0 });
+        }
+
+        nodes.push_back(node);
+        return nodes.size() - 1;
+    }
+
+    std::optional<size_t> constant(size_t id) const {
+        if (nodes[id].kind != node_t::constant)
+            return std::nullopt;
+        return nodes[id].value;
+    }
+
+    // Value at the address held by node id
+    size_t load(size_t id) {
+        if (std::optional<size_t> address = constant(id))
+            return read(*address);
+        return make({ node_t::opaque, 0, 0, 0 });
+    }
+
+    size_t read(size_t address) {
+        return address < ram.size() ? ram[address] : 0;
+    }
+
+    size_t& at(size_t address) {
+        if (address >= memory_t::max_pages * memory_t::page_size)
+            throw std::runtime_error("address out of range");
+
+        if (address >= ram.size())
+            ram.resize(address + 1, 0);
+        return ram[address];
+    }
+
+    std::optional<polynomial_t> expand(size_t id, std::vector<std::optional<polynomial_t>>& memo) {
+        if (memo[id])
+            return memo[id];
+
+        node_t const& node = nodes[id];
+        switch (node.kind) {
+            case node_t::constant:
+                memo[id] = polynomial_t::constant(node.value);
+                break;
+            case node_t::symbol:
+                memo[id] = polynomial_t::symbol(node.value);
+                break;
+            case node_t::sum:
+            case node_t::product: {
+                std::optional<polynomial_t> lhs = expand(node.lhs, memo);
+                std::optional<polynomial_t> rhs = expand(node.rhs, memo);
+                if (!lhs || !rhs)
+                    return std::nullopt;
+                memo[id] = node.kind == node_t::sum ? *lhs + *rhs : *lhs * *rhs;
+                break;
+            }
+            case node_t::opaque:
+                return std::nullopt;
+        }
+
+        return memo[id];
+    }
+
+    std::vector<node_t> nodes;
+    std::vector<size_t> ram; // Node id held by every cell
+    size_t symbol_count = 0;
+};
+
+// Finds values, each within its [low, high] range, for which the polynomial
+// equals target. Every symbol but the last is enumerated; the last one is
+// solved for directly when it appears linearly, and bisected otherwise, which
+// holds because nothing but adds and multiplies of non-negative numbers built
+// the polynomial, so it only grows with each symbol.
+std::optional<std::vector<size_t>> solve(polynomial_t const& p, size_t target, std::vector<std::pair<size_t, size_t>> const& ranges) {
+    size_t last = ranges.size() - 1;
+    std::vector<size_t> values(ranges.size());
+    for (size_t i = 0; i < last; ++i)
+        values[i] = ranges[i].first;
+
+    while (true) {
+        std::vector<size_t> coefficients = p.collect(last, values);
+        auto [low, high] = ranges[last];
+
+        if (coefficients.size() == 1) {
+            values[last] = low;
+            if (coefficients[0] == target)
+                return values;
+        }
+        else if (coefficients.size() == 2) {
+            size_t remainder = target - coefficients[0];
+            if (coefficients[0] <= target && remainder % coefficients[1] == 0) {
+                values[last] = remainder / coefficients[1];
+                if (values[last] >= low && values[last] <= high)
+                    return values;
+            }
+        }
+        else {
+            while (low < high) {
+                values[last] = low + (high - low) / 2;
+                if (p.evaluate(values) < target)
+                    low = values[last] + 1;
+                else
+                    high = values[last];
+            }
+
+            values[last] = low;
+            if (p.evaluate(values) == target)
+                return values;
+        }
+
+        // Next combination of the enumerated symbols
+        size_t i = 0;
+        for (; i < last; ++i) {
+            if (values[i]++ < ranges[i].second)
+                break;
+            values[i] = ranges[i].first;
+        }
+
+        if (i == last)
+            return std::nullopt;
+    }
+}
+
 const size_t state[] = {
     // copy paste input here
 };
 
 
+// Prints what ram[0] came out as in terms of the noun and verb, when it did
+// #define ENABLE_DUMP_POLYNOMIAL
+
 int main() {
 #if STEP == 1
     rocket rocket(state);
@@ -79,14 +598,40 @@ int main() {
     std::cout << rocket.read_memory(0);
 #elif STEP == 2
     constexpr const static size_t target = 19690720;
-    for (size_t noun = 1; noun <= 99; ++noun) {
-        for (size_t verb = 1; verb <= 99; ++verb) {
-            rocket rocket(state);
-            rocket.patch(1, noun);
-            rocket.patch(2, verb);
-            rocket.run();
-            if (rocket.read_memory(0) == target) {
-                std::cout << 100 * noun + verb << std::endl;
+    constexpr const static size_t lanes = 8;
+
+    // ram[0] usually comes out as a plain polynomial in the noun and verb, solve that
+    symbolic_rocket symbolic(state);
+    symbolic.make_symbol(1);
+    symbolic.make_symbol(2);
+    if (symbolic.run()) {
+        if (std::optional<polynomial_t> output = symbolic.read_memory(0)) {
+#ifdef ENABLE_DUMP_POLYNOMIAL
+            std::cerr << "ram[0] = " << output->to_string({ "noun", "verb" }) << std::endl;
+#endif
+            if (std::optional<std::vector<size_t>> solution = solve(*output, target, { { 1, 99 }, { 1, 99 } }))
+                std::cout << 100 * (*solution)[0] + (*solution)[1] << std::endl;
+            return 0;
+        }
+    }
+
+    // Control flow or an address depends on the noun or verb, try them all
+
+    // Every noun/verb pair, lanes at a time. The last batch pads with the last pair.
+    const rocket_batch<lanes> image(state);
+    for (size_t first = 0; first < 99 * 99; first += lanes) {
+        rocket_batch<lanes> batch = image;
+        for (size_t lane = 0; lane < lanes; ++lane) {
+            size_t pair = std::min(first + lane, size_t(99 * 99 - 1));
+            batch.patch(lane, 1, 1 + pair / 99);
+            batch.patch(lane, 2, 1 + pair % 99);
+        }
+
+        batch.run();
+        for (size_t lane = 0; lane < lanes && first + lane < 99 * 99; ++lane) {
+            if (batch.read_memory(lane, 0) == target) {
+                size_t pair = first + lane;
+                std::cout << 100 * (1 + pair / 99) + (1 + pair % 99) << std::endl;
                 return 0;
             }
         }
@@ -4,6 +4,11 @@
 #include <iomanip>
 #include <unordered_map>
 #include <stdexcept>
+#include <optional>
+#include <vector>
+#include <array>
+#include <memory>
+#include <algorithm>
 
 using size_t = std::size_t;
 
@@ -27,11 +32,73 @@ enum operation_mode {
     immediate = 1
 };
 
+// Program memory as a page table over 4 KiB pages. A page is allocated by the
+// first write that lands on it, reads of anything never written return 0, so a
+// program only costs the memory it touches.
+struct memory_t {
+    constexpr const static size_t page_bits = 10; // 32-bit words here
+    constexpr const static size_t page_size = size_t(1) << page_bits; // In words
+    constexpr const static size_t page_mask = page_size - 1;
+    constexpr const static size_t max_pages = size_t(1) << 20; // 4 GiB worth of words
+
+    using page_t = std::array<int32_t, page_size>;
+
+    memory_t() = default;
+    memory_t(int32_t const* image, size_t size);
+
+    int32_t read(size_t address) const {
+        size_t index = address >> page_bits;
+        if (index >= table.size() || table[index] == nullptr)
+            return 0;
+
+        return (*table[index])[address & page_mask];
+    }
+
+    void write(size_t address, int32_t value) {
+        size_t index = address >> page_bits;
+        page_t* page = index < table.size() ? table[index] : nullptr;
+        if (page == nullptr)
+            page = &allocate(index);
+
+        (*page)[address & page_mask] = value;
+    }
+
+    page_t& allocate(size_t index);
+    size_t page_count() const { return pages.size(); }
+
+    std::vector<page_t*> table; // By page index, nullptr if never written
+    std::vector<std::unique_ptr<page_t>> pages;
+};
+
+memory_t::memory_t(int32_t const* image, size_t size) {
+    for (size_t address = 0; address < size; address += page_size) {
+        page_t& page = allocate(address >> page_bits);
+        std::copy(image + address, image + std::min(size, address + page_size), page.begin());
+    }
+}
+
+memory_t::page_t& memory_t::allocate(size_t index) {
+    if (index >= max_pages)
+        throw std::runtime_error("address out of range");
+
+    if (index >= table.size())
+        table.resize(index + 1);
+
+    if (table[index] == nullptr) {
+        pages.push_back(std::make_unique<page_t>());
+        pages.back()->fill(0);
+        table[index] = pages.back().get();
+    }
+
+    return *table[index];
+}
+
 struct opcode_t {
-    opcode_t(int32_t input, int32_t output, int32_t* eip, int32_t* ram) : eip(eip), ram(ram), input(input), output(output) {
-        code = intcode(*eip - (*eip / 100) * 100);
+    opcode_t(int32_t input, int32_t output, size_t eip, memory_t* ram) : eip(eip), ram(ram), input(input), output(output) {
+        int32_t word = ram->read(eip);
+        code = intcode(word - (word / 100) * 100);
 
-        int32_t parameter_modes = *eip / 100;
+        int32_t parameter_modes = word / 100;
         for (int32_t i = 0; i < get_parameter_count(); ++i) {
             parameter_mode[i] = operation_mode(parameter_modes - (parameter_modes / 10) * 10);
 
@@ -43,21 +110,29 @@ struct opcode_t {
     intcode code;
     int32_t output;
     int32_t input;
-    int32_t* eip;
-    int32_t* ram;
+    size_t eip;
+    memory_t* ram;
 
 
-    int32_t& get_parameter(int32_t index) {
+    size_t get_address(int32_t index) {
         switch (parameter_mode[index]) {
         case position:
-            return ram[eip[index + 1]];
+            return ram->read(eip + index + 1);
         case immediate:
-            return eip[index + 1];
+            return eip + index + 1;
         }
 
         throw std::runtime_error("unknown mode");
     }
 
+    int32_t get_parameter(int32_t index) {
+        return ram->read(get_address(index));
+    }
+
+    void set_parameter(int32_t index, int32_t value) {
+        ram->write(get_address(index), value);
+    }
+
     size_t get_parameter_count() {
         switch (code) {
             case add:
@@ -76,45 +151,64 @@ struct opcode_t {
         }
     }
 
-    int32_t exec() {
+    // Executes this instruction and returns the next one, or nothing if the program halted.
+    std::optional<opcode_t> step() {
         switch (code) {
         case add:
             if (parameter_mode[2] != position)
                 throw std::runtime_error("target must be position mode");
-            get_parameter(2) = get_parameter(1) + get_parameter(0);
+            set_parameter(2, get_parameter(1) + get_parameter(0));
             break;
         case multiply:
             if (parameter_mode[2] != position)
                 throw std::runtime_error("target must be position mode");
-            get_parameter(2) = get_parameter(1) * get_parameter(0);
+            set_parameter(2, get_parameter(1) * get_parameter(0));
             break;
         case load_input:
             if (parameter_mode[0] != position)
                 throw std::runtime_error("target must be position mode");
-            get_parameter(0) = input;
+            set_parameter(0, input);
             break;
         case write_output:
             output = get_parameter(0);
             break;
         case less_than:
-            get_parameter(2) = get_parameter(0) < get_parameter(1);
+            set_parameter(2, get_parameter(0) < get_parameter(1));
             break;
         case equals:
-            get_parameter(2) = get_parameter(0) == get_parameter(1);
+            set_parameter(2, get_parameter(0) == get_parameter(1));
             break;
         case jump_if_true:
             if (get_parameter(0) != 0)
-                return opcode_t{ input, output, ram + get_parameter(1), ram }.exec();
+                return opcode_t{ input, output, size_t(get_parameter(1)), ram };
             break;
         case jump_if_false:
             if (get_parameter(0) == 0)
-                return opcode_t{ input, output, ram + get_parameter(1), ram }.exec();
+                return opcode_t{ input, output, size_t(get_parameter(1)), ram };
             break;
         case halt:
-            return output;
+            return std::nullopt;
         }
 
-        return next().exec();
+        return next();
+    }
+
+    // Executes at most count instructions and returns the one to resume at, or nothing if the program halted.
+    std::optional<opcode_t> step(size_t count) {
+        std::optional<opcode_t> instr = *this;
+        for (; instr && count > 0; --count)
+            instr = instr->step();
+
+        return instr;
+    }
+
+    // Runs until the program halts and returns the last value it wrote.
+    int32_t exec() {
+        opcode_t instr = *this;
+        while (std::optional<opcode_t> next_instr = instr.step())
+            instr = std::move(*next_instr);
+
+        return instr.output;
     }
 
     opcode_t next() {
@@ -122,8 +216,8 @@ struct opcode_t {
     }
 };
 
-opcode_t make_program(int32_t* program, int32_t input) {
-    return opcode_t{ input, 0, program, program };
+opcode_t make_program(memory_t& ram, int32_t input) {
+    return opcode_t{ input, 0, 0, &ram };
 };
 
 int32_t state[] = {
@@ -132,7 +226,8 @@ int32_t state[] = {
 
 
 int main() {
-    auto program = make_program(state, 
+    memory_t ram(state, sizeof(state) / sizeof(state[0]));
+    auto program = make_program(ram, 
 #if STEP == 1
         1
 #elif STEP == 2
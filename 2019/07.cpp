@@ -9,6 +9,24 @@
 #include <deque>
 #include <algorithm>
 #include <optional>
+#include <limits>
+#include <array>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <exception>
+#include <utility>
+
+// Counts instructions per opcode and eip and time spent waiting on input into
+// program_t::profile, see profile_t. Compiles to nothing when left undefined.
+// #define ENABLE_PROFILER
+
+#ifdef ENABLE_PROFILER
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+#endif
 
 using size_t = std::size_t;
 
@@ -39,15 +57,361 @@ using value_t = int64_t;
 struct program_t;
 struct opcode_t;
 
+size_t get_parameter_count(intcode code) {
+    switch (code) {
+    case add:
+    case multiply:
+    case less_than:
+    case equals:
+        return 3;
+    case load_input:
+    case write_output:
+        return 1;
+    case jump_if_false:
+    case jump_if_true:
+        return 2;
+    case mod_rel_base:
+        return 1;
+    case halt:
+        return 0;
+    }
+
+    throw std::runtime_error("not implemented");
+}
+
+// An instruction as decoded from the program image. Decoded once per address
+// and cached by program_t until a write lands on one of its words.
+struct instruction_t {
+    intcode code;
+    std::array<operation_mode, 3> parameter_mode;
+    std::array<value_t, 3> operands;
+    size_t length = 0; // 0 if not decoded
+};
+
+// Program memory as a page table over 4 KiB pages. A page is allocated by the
+// first write that lands on it, reads of anything never written return 0, so a
+// program only costs the memory it touches.
+//
+// Copies share every page. Both sides lose write access to them, and the first
+// write to a page that is still shared copies it.
+struct memory_t {
+    constexpr const static size_t page_bits = 9;
+    constexpr const static size_t page_size = size_t(1) << page_bits; // In words
+    constexpr const static size_t page_mask = page_size - 1;
+    constexpr const static size_t max_pages = size_t(1) << 20; // 4 GiB worth of words
+
+    using page_t = std::array<value_t, page_size>;
+
+    memory_t() = default;
+    memory_t(value_t const* image, size_t size);
+
+    memory_t(memory_t const& other) { *this = other; }
+    memory_t& operator = (memory_t const& other);
+    memory_t(memory_t&&) = default;
+    memory_t& operator = (memory_t&&) = default;
+
+    value_t read(size_t address) const {
+        size_t index = address >> page_bits;
+        if (index >= table.size() || table[index] == nullptr)
+            return 0;
+
+        return (*table[index])[address & page_mask];
+    }
+
+    void write(size_t address, value_t value) {
+        size_t index = address >> page_bits;
+        page_t* page = index < writable.size() ? writable[index] : nullptr;
+        if (page == nullptr)
+            page = &make_writable(index);
+
+        (*page)[address & page_mask] = value;
+    }
+
+    page_t& make_writable(size_t index);
+
+    std::vector<page_t*> table; // By page index, nullptr if never written
+    mutable std::vector<page_t*> writable; // Same, but only pages nobody else shares
+    std::vector<std::shared_ptr<page_t>> pages;
+};
+
+memory_t::memory_t(value_t const* image, size_t size) {
+    for (size_t address = 0; address < size; address += page_size) {
+        page_t& page = make_writable(address >> page_bits);
+        std::copy(image + address, image + std::min(size, address + page_size), page.begin());
+    }
+}
+
+memory_t& memory_t::operator = (memory_t const& other) {
+    if (this != &other) {
+        table = other.table;
+        pages = other.pages;
+        writable.assign(table.size(), nullptr);
+        std::fill(other.writable.begin(), other.writable.end(), nullptr);
+    }
+
+    return *this;
+}
+
+memory_t::page_t& memory_t::make_writable(size_t index) {
+    if (index >= max_pages)
+        throw std::runtime_error("address out of range");
+
+    if (index >= table.size()) {
+        table.resize(index + 1);
+        writable.resize(index + 1);
+        pages.resize(index + 1);
+    }
+
+    std::shared_ptr<page_t>& page = pages[index];
+    if (page == nullptr) {
+        page = std::make_shared<page_t>();
+        page->fill(0);
+    }
+    else if (page.use_count() > 1) {
+        page = std::make_shared<page_t>(*page);
+    }
+
+    table[index] = writable[index] = page.get();
+    return *page;
+}
+
+#ifdef ENABLE_PROFILER
+// What the amplifiers did, see program_t::profile: where the instructions
+// went and how long each one sat waiting for the previous amplifier.
+struct profile_t {
+    using steady_clock = std::chrono::steady_clock;
+
+    // Names a stretch of host code, e.g. a worker. The time spent in it shows
+    // up in the report. Scopes nest per thread.
+    struct scope_t {
+        explicit scope_t(const char* name) : parent(current), start(steady_clock::now()) {
+            current = host().intern(parent, name);
+        }
+
+        ~scope_t() {
+            host().add_time(current, steady_clock::now() - start);
+            current = parent;
+        }
+
+        size_t parent;
+        steady_clock::time_point start;
+    };
+
+    void count(size_t eip, intcode code) {
+        ++opcodes[code];
+        ++eips[eip];
+    }
+
+    void begin_wait() {
+        if (!waiting) {
+            waiting = true;
+            wait_start = steady_clock::now();
+        }
+    }
+
+    void end_wait() {
+        if (waiting) {
+            waiting = false;
+            input_wait += steady_clock::now() - wait_start;
+            ++waits;
+        }
+    }
+
+    profile_t& operator += (profile_t const& other);
+    void report(std::ostream& out, size_t top = 10) const;
+
+    std::array<size_t, 100> opcodes{}; // By intcode
+    std::unordered_map<size_t, size_t> eips;
+    steady_clock::duration input_wait{ 0 };
+    size_t waits = 0;
+
+    bool waiting = false;
+    steady_clock::time_point wait_start;
+
+private:
+    // Scope stacks are interned so nesting only costs a lookup per scope
+    struct host_t {
+        size_t intern(size_t parent, const char* name) {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto [it, added] = ids.try_emplace({ parent, name }, names.size());
+            if (added) {
+                names.push_back(parent == 0 ? name : names[parent] + ";" + name);
+                time.emplace_back(0);
+            }
+            return it->second;
+        }
+
+        void add_time(size_t scope, steady_clock::duration elapsed) {
+            std::lock_guard<std::mutex> lock(mutex);
+            time[scope] += elapsed;
+        }
+
+        std::mutex mutex;
+        std::map<std::pair<size_t, std::string>, size_t> ids;
+        std::vector<std::string> names{ "" };
+        std::vector<steady_clock::duration> time{ steady_clock::duration(0) };
+    };
+
+    static host_t& host() {
+        static host_t instance;
+        return instance;
+    }
+
+    static inline thread_local size_t current = 0;
+};
+
+profile_t& profile_t::operator += (profile_t const& other) {
+    for (size_t i = 0; i < opcodes.size(); ++i)
+        opcodes[i] += other.opcodes[i];
+    for (auto&& [eip, count] : other.eips)
+        eips[eip] += count;
+    input_wait += other.input_wait;
+    waits += other.waits;
+    return *this;
+}
+
+void profile_t::report(std::ostream& out, size_t top) const {
+    const char* names[100] = {};
+    names[add] = "add";
+    names[multiply] = "multiply";
+    names[load_input] = "load_input";
+    names[write_output] = "write_output";
+    names[jump_if_true] = "jump_if_true";
+    names[jump_if_false] = "jump_if_false";
+    names[less_than] = "less_than";
+    names[equals] = "equals";
+    names[mod_rel_base] = "mod_rel_base";
+    names[halt] = "halt";
+
+    size_t total = 0;
+    std::vector<std::pair<size_t, size_t>> by_opcode;
+    for (size_t i = 0; i < opcodes.size(); ++i) {
+        total += opcodes[i];
+        if (opcodes[i] != 0)
+            by_opcode.emplace_back(i, opcodes[i]);
+    }
+
+    std::vector<std::pair<size_t, size_t>> by_eip(eips.begin(), eips.end());
+    for (auto* entries : { &by_opcode, &by_eip })
+        std::sort(entries->begin(), entries->end(), [](auto const& l, auto const& r) {
+            return l.second != r.second ? l.second > r.second : l.first < r.first;
+        });
+
+    auto print = [&](const char* title, std::vector<std::pair<size_t, size_t>> const& entries, auto label) {
+        out << title << std::endl;
+        for (size_t i = 0; i < entries.size() && i < top; ++i)
+            out << "  " << std::setw(14) << label(entries[i].first) << std::setw(14) << entries[i].second
+                << std::setw(8) << std::fixed << std::setprecision(2) << 100.0 * entries[i].second / std::max<size_t>(total, 1) << "%" << std::endl;
+    };
+
+    out << total << " instructions" << std::endl;
+    print("By opcode:", by_opcode, [&](size_t code) { return std::string(names[code] ? names[code] : "?"); });
+    print("Hottest eips:", by_eip, [](size_t eip) { return std::to_string(eip); });
+    out << "Waited on input " << waits << " times, "
+        << std::chrono::duration<double, std::milli>(input_wait).count() << " ms" << std::endl;
+
+    host_t& scopes = host();
+    std::lock_guard<std::mutex> lock(scopes.mutex);
+    if (scopes.names.size() > 1) {
+        out << "Host scopes:" << std::endl;
+        for (size_t i = 1; i < scopes.names.size(); ++i)
+            out << "  " << scopes.names[i] << ": " << std::chrono::duration<double, std::milli>(scopes.time[i]).count() << " ms" << std::endl;
+    }
+}
+
+#define PROFILE(...) __VA_ARGS__
+#else
+#define PROFILE(...)
+#endif
+
+// Spins for a while before handing the core back, a stage on the other end of
+// a channel usually answers within a few hundred cycles.
+void backoff(size_t& spins) {
+    if (++spins < 1024) {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    }
+    else {
+        std::this_thread::yield();
+    }
+}
+
+// Bounded single-producer/single-consumer ring. The producer only writes tail
+// and the consumer only head, so neither side needs a lock. Both are cached on
+// the other side to avoid bouncing their cache lines on every value.
+struct channel_t {
+    constexpr const static size_t capacity = 1024; // Power of two
+    constexpr const static size_t mask = capacity - 1;
+
+    bool try_push(value_t value) {
+        size_t position = tail.load(std::memory_order_relaxed);
+        if (position - head_cache == capacity) {
+            head_cache = head.load(std::memory_order_acquire);
+            if (position - head_cache == capacity)
+                return false;
+        }
+
+        buffer[position & mask] = value;
+        tail.store(position + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool try_pop(value_t& value) {
+        size_t position = head.load(std::memory_order_relaxed);
+        if (position == tail_cache) {
+            tail_cache = tail.load(std::memory_order_acquire);
+            if (position == tail_cache)
+                return false;
+        }
+
+        value = buffer[position & mask];
+        head.store(position + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool empty() const { return head.load(std::memory_order_relaxed) == tail.load(std::memory_order_acquire); }
+    bool full() const { return tail.load(std::memory_order_relaxed) - head.load(std::memory_order_acquire) == capacity; }
+
+    // Blocking variants, for hosts only: a program_t never waits inside an instruction
+    void push(value_t value) {
+        for (size_t spins = 0; !try_push(value); backoff(spins))
+            ;
+    }
+
+    // Set by the producer once it has nothing more to say
+    void close() { closed.store(true, std::memory_order_release); }
+    bool is_closed() const { return closed.load(std::memory_order_acquire); }
+
+    // Empties and reopens the channel, nobody may be using it at the time
+    void reset() {
+        head.store(0, std::memory_order_relaxed);
+        tail.store(0, std::memory_order_relaxed);
+        tail_cache = head_cache = 0;
+        closed.store(false, std::memory_order_relaxed);
+    }
+
+    std::array<value_t, capacity> buffer;
+
+    alignas(64) std::atomic<size_t> head{ 0 };
+    size_t tail_cache = 0; // Consumer's last look at tail
+
+    alignas(64) std::atomic<size_t> tail{ 0 };
+    size_t head_cache = 0; // Producer's last look at head
+
+    alignas(64) std::atomic<bool> closed{ false };
+};
+
 struct opcode_t {
     opcode_t(program_t& program, size_t eip);
-    std::optional<opcode_t> exec(std::deque<value_t>& inputs, std::vector<value_t>& outputs);
-    value_t& get_parameter(int32_t index);
+    std::optional<opcode_t> exec(channel_t& inputs, channel_t& outputs);
+    value_t get_parameter(int32_t index);
+    void set_parameter(int32_t index, value_t value);
+    size_t get_address(int32_t index);
     size_t get_parameter_count();
 
     void swap(opcode_t& other) {
-        parameter_mode.swap(other.parameter_mode);
-        code = other.code;
+        std::swap(instr, other.instr);
         eip = other.eip;
         std::swap(program, other.program);
     }
@@ -59,118 +423,128 @@ struct opcode_t {
 
     std::reference_wrapper<program_t> program;
 
-    std::unordered_map<size_t, operation_mode> parameter_mode;
-    intcode code;
+    instruction_t instr;
+    size_t eip;
+};
+
+// Everything needed to bring a program_t back to where it was, see program_t::snapshot.
+struct snapshot_t {
+    channel_t* inputs; // Only the wiring, values in flight belong to the channels
+    channel_t* outputs;
+    memory_t ram;
+    std::vector<instruction_t> decoded;
+    size_t rel_base;
     size_t eip;
+    bool halted;
 };
 
 struct program_t {
     program_t(value_t* program, size_t program_size);
+    program_t(snapshot_t snapshot);
+    snapshot_t snapshot() const;
+    void restore(snapshot_t const& snapshot);
+    program_t fork() const;
+    size_t step(size_t count);
     void exec();
+    void run();
+    bool needs_input() const;
+    bool blocked() const;
 
-    std::deque<value_t> inputs;
-    std::vector<value_t> outputs;
-    std::vector<value_t> ram;
+    instruction_t const& decode(size_t eip);
+    void write(size_t address, value_t value);
+
+    // Not owned, whoever wires programs together keeps the channels alive
+    channel_t* inputs = nullptr;
+    channel_t* outputs = nullptr;
+    memory_t ram; // Writes must go through write() to keep the decoded cache coherent
+    std::vector<instruction_t> decoded;
     size_t rel_base = 0;
 
     opcode_t opc;
     bool halted = false;
+
+#ifdef ENABLE_PROFILER
+    profile_t profile; // Not part of snapshots, keeps adding up across restore()
+#endif
 };
 
 opcode_t::opcode_t(program_t& program, size_t eip)
-    : eip(eip), program(program)
+    : program(program), instr(program.decode(eip)), eip(eip)
 {
-    value_t eip_instr = program.ram[eip];
-    code = intcode(eip_instr - (eip_instr / 100) * 100);
-
-    value_t parameter_modes = eip_instr / 100;
-    for (int32_t i = 0; i < get_parameter_count(); ++i) {
-        parameter_mode[i] = operation_mode(parameter_modes - (parameter_modes / 10) * 10);
-
-        parameter_modes /= 10;
-    }
 }
 
 size_t opcode_t::get_parameter_count() {
-    switch (code) {
-    case add:
-    case multiply:
-    case less_than:
-    case equals:
-        return 3;
-    case load_input:
-    case write_output:
-        return 1;
-    case jump_if_false:
-    case jump_if_true:
-        return 2;
-    case mod_rel_base:
-        return 1;
-    case halt:
-        return 0;
-    }
-
-    throw std::runtime_error("not implemented");
+    return instr.length - 1;
 }
 
-value_t& opcode_t::get_parameter(int32_t index) {
-    switch (parameter_mode[index]) {
+size_t opcode_t::get_address(int32_t index) {
+    switch (instr.parameter_mode[index]) {
     case position:
-        return program.get().ram[program.get().ram[eip + 1 + index]];
+        return instr.operands[index];
     case immediate:
-        return program.get().ram[eip + 1 + index];
-        break;
+        return eip + 1 + index;
     case relative:
-        return program.get().ram[program.get().rel_base + program.get().ram[eip + 1 + index]];
-        break;
+        return program.get().rel_base + instr.operands[index];
     default:
         throw std::runtime_error("not implemented");
     }
 }
 
-std::optional<opcode_t> opcode_t::exec(std::deque<value_t>& inputs, std::vector<value_t>& outputs) {
+value_t opcode_t::get_parameter(int32_t index) {
+    if (instr.parameter_mode[index] == immediate)
+        return instr.operands[index];
 
-    switch (code) {
+    return program.get().ram.read(get_address(index));
+}
+
+void opcode_t::set_parameter(int32_t index, value_t value) {
+    program.get().write(get_address(index), value);
+}
+
+std::optional<opcode_t> opcode_t::exec(channel_t& inputs, channel_t& outputs) {
+    PROFILE(program.get().profile.count(eip, instr.code));
+
+    switch (instr.code) {
     case add:
         //std::cout << "Executing opcode add " << eip << " { @" << get_parameter(2) << " = " << get_parameter(1) << " + " << get_parameter(0) << "}" << std::endl;
-        get_parameter(2) = get_parameter(1) + get_parameter(0);
+        set_parameter(2, get_parameter(1) + get_parameter(0));
         break;
     case multiply:
         //std::cout << "Executing opcode multiply " << eip << " { @" << get_parameter(2) << " = " << get_parameter(1) << " + " << get_parameter(0) << "}" << std::endl;
-        get_parameter(2) = get_parameter(1) * get_parameter(0);
+        set_parameter(2, get_parameter(1) * get_parameter(0));
         break;
     case load_input:
     {
-        if (inputs.empty())
+        value_t input;
+        if (!inputs.try_pop(input))
             return *this;
 
-        //std::cout << "Executing opcode load_input " << eip << " { @" << get_parameter(0) << " = " << inputs.front() << "}" << std::endl;
-        auto input = inputs.front();
-        inputs.pop_front();
-        get_parameter(0) = input;
+        //std::cout << "Executing opcode load_input " << eip << " { @" << get_parameter(0) << " = " << input << "}" << std::endl;
+        set_parameter(0, input);
         break;
     }
     case write_output:
         //std::cout << "Executing opcode write_output " << eip << " { " << get_parameter(0) << "}" << std::endl;
-        outputs.push_back(get_parameter(0));
+        if (!outputs.try_push(get_parameter(0)))
+            return *this;
         break;
     case less_than:
         //std::cout << "Executing opcode less_than " << eip << " { @" << get_parameter(2) << " = " << get_parameter(1) << " < " << get_parameter(0) << "}" << std::endl;
-        get_parameter(2) = get_parameter(0) < get_parameter(1);
+        set_parameter(2, get_parameter(0) < get_parameter(1));
         break;
     case equals:
         //std::cout << "Executing opcode equals " << eip << " { @" << get_parameter(2) << " = " << get_parameter(1) << " == " << get_parameter(0) << "}" << std::endl;
-        get_parameter(2) = get_parameter(0) == get_parameter(1);
+        set_parameter(2, get_parameter(0) == get_parameter(1));
         break;
     case jump_if_true:
         //std::cout << "Executing opcode jump_if_true " << eip << " { " << get_parameter(0) << "; @" << get_parameter(1) << "}" << std::endl;
         if (get_parameter(0) != 0)
-            return jump_to(get_parameter(1)).exec(inputs, outputs);
+            return jump_to(get_parameter(1));
         break;
     case jump_if_false:
         //std::cout << "Executing opcode jump_if_false " << eip << " { " << get_parameter(0) << "; @" << get_parameter(1) << "}" << std::endl;
         if (get_parameter(0) == 0)
-            return jump_to(get_parameter(1)).exec(inputs, outputs);
+            return jump_to(get_parameter(1));
         break;
     case mod_rel_base:
         //std::cout << "Executing opcode mod_rel_base " << eip << " { " << get_parameter(0) << "}" << std::endl;
@@ -185,7 +559,7 @@ std::optional<opcode_t> opcode_t::exec(std::deque<value_t>& inputs, std::vector<
 }
 
 opcode_t opcode_t::next() {
-    return opcode_t{ program, eip + 1 + get_parameter_count() };
+    return opcode_t{ program, eip + instr.length };
 }
 
 opcode_t opcode_t::jump_to(size_t abs_ofs) {
@@ -195,27 +569,119 @@ opcode_t opcode_t::jump_to(size_t abs_ofs) {
 // program_t
 
 program_t::program_t(value_t* program, size_t program_size)
-    : opc(*this, 0), ram(program, program + program_size)
+    : ram(program, program_size), decoded(program_size), opc(*this, 0)
 {
-    ram.resize(std::max<size_t>(ram.size(), 0x8000u));
 }
 
-void program_t::exec() {
-    opcode_t curr_instr = opc;
+instruction_t const& program_t::decode(size_t eip) {
+    // A jump to -1 or far past memory must not wrap or blow up the cache
+    if (eip >= memory_t::max_pages * memory_t::page_size)
+        throw std::runtime_error("address out of range");
+
+    if (eip >= decoded.size())
+        decoded.resize(eip + 1);
+
+    instruction_t& instr = decoded[eip];
+    if (instr.length != 0)
+        return instr;
 
-    std::optional<opcode_t> next_instr = curr_instr.exec(inputs, outputs);
-    while (next_instr) {
-        // Stalled for an input read, break out
-        if (curr_instr == *next_instr)
-            break;
+    value_t eip_instr = ram.read(eip);
+    instr.code = intcode(eip_instr - (eip_instr / 100) * 100);
+
+    size_t parameter_count = get_parameter_count(instr.code);
+    value_t parameter_modes = eip_instr / 100;
+    for (size_t i = 0; i < parameter_count; ++i) {
+        instr.parameter_mode[i] = operation_mode(parameter_modes - (parameter_modes / 10) * 10);
+        instr.operands[i] = ram.read(eip + 1 + i);
 
-        curr_instr = *next_instr;
-        next_instr = curr_instr.exec(inputs, outputs);
+        parameter_modes /= 10;
     }
 
-    // Not halted, set eip correctly
+    instr.length = parameter_count + 1;
+    return instr;
+}
+
+void program_t::write(size_t address, value_t value) {
+    ram.write(address, value);
+
+    // Self-modifying code: drop every cached instruction that covers this address.
+    for (size_t i = address < 3 ? 0 : address - 3; i <= address && i < decoded.size(); ++i)
+        if (decoded[i].length != 0 && i + decoded[i].length > address)
+            decoded[i].length = 0;
+}
+
+program_t::program_t(snapshot_t snapshot)
+    : inputs(std::move(snapshot.inputs)),
+    outputs(std::move(snapshot.outputs)),
+    ram(std::move(snapshot.ram)),
+    decoded(std::move(snapshot.decoded)),
+    rel_base(snapshot.rel_base),
+    opc(*this, snapshot.eip),
+    halted(snapshot.halted)
+{
+}
+
+// Captures the program as it stands. Memory pages are shared with the snapshot
+// until one side writes to them, so this costs the decode cache plus a pointer per page.
+snapshot_t program_t::snapshot() const {
+    return snapshot_t{ inputs, outputs, ram, decoded, rel_base, opc.eip, halted };
+}
+
+void program_t::restore(snapshot_t const& snapshot) {
+    inputs = snapshot.inputs;
+    outputs = snapshot.outputs;
+    ram = snapshot.ram;
+    decoded = snapshot.decoded;
+    rel_base = snapshot.rel_base;
+    halted = snapshot.halted;
+    opc = opcode_t(*this, snapshot.eip);
+}
+
+// A second program that carries on independently from this one's current state.
+program_t program_t::fork() const {
+    return program_t{ snapshot() };
+}
+
+bool program_t::needs_input() const {
+    return !halted && opc.instr.code == load_input && inputs->empty();
+}
+
+// Waiting on either channel
+bool program_t::blocked() const {
+    return needs_input() || (!halted && opc.instr.code == write_output && outputs->full());
+}
+
+// Executes at most count instructions, stopping early if the program halts or
+// blocks on an empty input or full output channel. Returns the number of
+// instructions executed.
+size_t program_t::step(size_t count) {
+    // Decode again, the host may have patched memory since we last stopped
+    opc = opcode_t(*this, opc.eip);
+    PROFILE(if (!needs_input()) profile.end_wait());
+
+    size_t executed = 0;
+    while (executed < count && !halted && !blocked()) {
+        std::optional<opcode_t> next_instr = opc.exec(*inputs, *outputs);
+        ++executed;
+
+        if (next_instr)
+            opc = *next_instr;
+    }
+
+    PROFILE(if (needs_input()) profile.begin_wait());
+    return executed;
+}
+
+// Runs until the program halts or blocks on one of its channels.
+void program_t::exec() {
+    step(std::numeric_limits<size_t>::max());
+}
+
+// Runs until the program halts, running out of inputs is an error.
+void program_t::run() {
+    exec();
     if (!halted)
-        opc = curr_instr;
+        throw std::runtime_error("program is waiting for input");
 }
 
 program_t make_program(value_t* program, size_t count) {
@@ -231,86 +697,396 @@ value_t state[] = {
    // copy intcode here
 };
 
+// Runs a loop of amplifiers as a pipeline, one thread per stage, each stage's
+// output channel being the next one's input and the last one feeding back into
+// the first. The stage threads live as long as the loop and sleep in between,
+// so running the same amplifiers again, rewound and fed, doesn't start any.
 struct amp_loop {
-    program_t a;
-    program_t b;
-    program_t c;
-    program_t d;
-    program_t e;
-
-    value_t thrust;
-
-    amp_loop(value_t pa, value_t pb, value_t pc, value_t pd, value_t pe)
-        : a(make_program(state)),
-        b(make_program(state)),
-        c(make_program(state)),
-        d(make_program(state)),
-        e(make_program(state))
+    explicit amp_loop(std::vector<std::unique_ptr<program_t>> const& amps)
+        : amps(amps), errors(amps.size())
     {
-        value_t feedback = 0;
+        for (size_t i = 0; i < amps.size(); ++i)
+            stages.emplace_back([this, i]() { stage(i); });
+    }
 
-        a.inputs.push_back(pa);
-        b.inputs.push_back(pb);
-        c.inputs.push_back(pc);
-        d.inputs.push_back(pd);
-        e.inputs.push_back(pe);
+    ~amp_loop() {
+        stopping.store(true, std::memory_order_relaxed);
+        generation.fetch_add(1, std::memory_order_release);
+        generation.notify_all();
+        for (auto&& stage : stages)
+            stage.join();
+    }
 
-        size_t cnt = 2;
+    amp_loop(amp_loop const&) = delete;
+    amp_loop& operator = (amp_loop const&) = delete;
 
-        while (!e.halted) {
-            a.inputs.push_back(feedback);
-            a.exec();
+    // Runs every amplifier until it halts. They must be wired up and fed
+    // already, and their channels open.
+    void run() {
+        finished.store(0, std::memory_order_relaxed);
+        idle.store(0, std::memory_order_relaxed);
+        generation.fetch_add(1, std::memory_order_release);
+        generation.notify_all();
 
-            b.inputs.push_back(a.outputs.back());
-            b.exec();
+        for (size_t done; (done = finished.load(std::memory_order_acquire)) < stages.size(); )
+            finished.wait(done);
 
-            c.inputs.push_back(b.outputs.back());
-            c.exec();
+        for (auto&& error : errors)
+            if (error)
+                std::rethrow_exception(std::exchange(error, nullptr));
+    }
 
-            d.inputs.push_back(c.outputs.back());
-            d.exec();
+private:
+    void run_stage(program_t& amp) {
+        PROFILE(profile_t::scope_t scope("amp_loop"));
+        size_t spins = 0;
+        bool waiting = false; // Counted in idle, and then never runs anything
+        while (!amp.halted) {
+            if (waiting && !amp.inputs->empty()) {
+                waiting = false;
+                ++wakeups;
+                --idle;
+            }
+
+            if (!waiting && amp.step(std::numeric_limits<size_t>::max()) != 0) {
+                spins = 0;
+                continue;
+            }
+
+            if (amp.needs_input() && amp.inputs->is_closed() && amp.inputs->empty())
+                throw std::runtime_error("program is waiting for input");
+
+            if (amp.needs_input() && !waiting) {
+                waiting = true;
+                ++idle;
+            }
 
-            e.inputs.push_back(d.outputs.back());
-            e.exec();
+            if (waiting && spins >= 1024 && deadlocked())
+                throw std::runtime_error("program is waiting for input");
 
-            feedback = e.outputs.back();
+            backoff(spins);
         }
 
-        thrust = feedback;
+        if (waiting)
+            --idle;
+    }
+
+    // Every stage still running waits on input and nothing is on its way. Nobody
+    // woke up while the channels were looked at, or some value may have been taken.
+    bool deadlocked() const {
+        size_t before = wakeups;
+        if (idle != stages.size() - finished)
+            return false;
+
+        for (auto&& amp : amps)
+            if (!amp->inputs->empty())
+                return false;
+
+        return wakeups == before;
+    }
+
+    void stage(size_t i) {
+        for (size_t seen = 0; ; ) {
+            generation.wait(seen, std::memory_order_acquire);
+            seen = generation.load(std::memory_order_acquire);
+            if (stopping.load(std::memory_order_relaxed))
+                return;
+
+            try {
+                run_stage(*amps[i]);
+            }
+            catch (...) {
+                errors[i] = std::current_exception();
+            }
+
+            // Unblock the next stage whether we halted or blew up
+            amps[i]->outputs->close();
+
+            finished.fetch_add(1, std::memory_order_release);
+            finished.notify_one();
+        }
     }
+
+    std::vector<std::unique_ptr<program_t>> const& amps;
+    std::vector<std::exception_ptr> errors; // By stage, from the last run()
+    std::vector<std::thread> stages;
+
+    std::atomic<size_t> generation{ 0 }; // Bumped to start every stage on another run
+    std::atomic<size_t> finished{ 0 }; // Stages done with this run
+    std::atomic<size_t> idle{ 0 }; // Stages waiting on an empty input
+    std::atomic<size_t> wakeups{ 0 }; // Times one stopped waiting
+    std::atomic<bool> stopping{ false };
 };
 
+// Tries every ordering of the phases and keeps the best thrust.
+//
+// Orderings are walked as a trie of phase prefixes. How an amplifier's first
+// turn goes, up to where it waits for the last one to come back round, only
+// depends on its phase and those before it, so each worker keeps the state of
+// every amplifier after its first turn per depth of the trie and only the
+// rounds after that run once per ordering. Prefixes a few phases deep are
+// handed out to a pool of workers, each owning one loop worth of amplifiers
+// and channels. With a core per amplifier to spare, threads is split into
+// workers running their rounds on an amp_loop, otherwise every worker steps
+// its amplifiers round-robin on its own thread.
+struct phase_search {
+    value_t thrust = std::numeric_limits<value_t>::min();
 
-int main() {
-    size_t phases[] = { 5, 6, 7, 8, 9 };
+#ifdef ENABLE_PROFILER
+    profile_t profile; // Every amplifier of every worker
+    std::mutex profile_mutex;
+#endif
 
-    value_t thrust = 0;
+    phase_search(std::vector<value_t> const& phases, size_t threads = std::thread::hardware_concurrency())
+        : phases(phases)
+    {
+        if (phases.empty() || phases.size() > 20)
+            throw std::runtime_error("can't search that many amplifiers");
 
-    for (auto pa : phases) {
-        for (auto pb : phases) {
-            if (pb == pa)
-                continue;
+        threaded = threads >= phases.size();
+        size_t worker_count = std::max<size_t>(1, threaded ? threads / phases.size() : threads);
 
-            for (auto pc : phases) {
-                if (pc == pa || pc == pb)
+        // Deep enough for a few prefixes per worker
+        prefix_count = 1;
+        while (prefix_length < phases.size() && prefix_count < 4 * worker_count)
+            prefix_count *= phases.size() - prefix_length++;
+
+        worker_count = std::min(worker_count, prefix_count);
+
+        // Every worker gets its own copy of the boot image, copying one shares its pages
+        // but also touches it, so that has to happen before anyone starts
+        program_t boot(state, sizeof(state) / sizeof(value_t));
+        std::vector<snapshot_t> boots(worker_count, boot.snapshot());
+
+        std::vector<value_t> best(worker_count, std::numeric_limits<value_t>::min());
+        std::vector<std::exception_ptr> errors(worker_count);
+        std::vector<std::thread> workers;
+        for (size_t i = 0; i < worker_count; ++i)
+            workers.emplace_back([this, i, &boots, &best, &errors]() {
+                try {
+                    best[i] = run_worker(boots[i]);
+                }
+                catch (...) {
+                    errors[i] = std::current_exception();
+                    next.store(prefix_count, std::memory_order_relaxed); // Make the others give up too
+                }
+            });
+
+        for (auto&& worker : workers)
+            worker.join();
+
+        for (auto&& error : errors)
+            if (error)
+                std::rethrow_exception(error);
+
+        for (value_t value : best)
+            thrust = std::max(thrust, value);
+    }
+
+private:
+    // One worker's amplifiers and the trie path it is on.
+    struct walker_t {
+        // How amplifier depth was left after its first turn
+        struct stage_t {
+            snapshot_t snapshot;
+            std::vector<value_t> said; // For the next amplifier
+        };
+
+        walker_t(snapshot_t const& boot, std::vector<value_t> const& phases, bool threaded)
+            : boot(boot), phases(phases), used(phases.size()), stages(phases.size())
+        {
+            for (size_t i = 0; i < phases.size(); ++i) {
+                amps.push_back(std::make_unique<program_t>(boot));
+                channels.push_back(std::make_unique<channel_t>());
+            }
+
+            if (threaded)
+                pipeline.emplace(amps);
+        }
+
+        // Every ordering starting with prefix, given as positions in phases
+        void walk(std::vector<size_t> const& prefix) {
+            for (size_t depth = 0; depth < prefix.size(); ++depth) {
+                used[prefix[depth]] = true;
+                if (depth + 1 < phases.size())
+                    first_turn(depth, phases[prefix[depth]]);
+                else
+                    finish(phases[prefix[depth]]);
+            }
+
+            walk(prefix.size());
+
+            for (size_t position : prefix)
+                used[position] = false;
+        }
+
+        void walk(size_t depth) {
+            if (depth == phases.size())
+                return;
+
+            for (size_t position = 0; position < phases.size(); ++position) {
+                if (used[position])
                     continue;
 
-                for (auto pd : phases) {
-                    if (pd == pa || pd == pb || pd == pc)
-                        continue;
+                used[position] = true;
+                if (depth + 1 < phases.size()) {
+                    first_turn(depth, phases[position]);
+                    walk(depth + 1);
+                }
+                else {
+                    finish(phases[position]);
+                }
+                used[position] = false;
+            }
+        }
+
+        // Boots amplifier depth on its phase and what the previous one said,
+        // runs it until it waits for more and keeps it that way for the subtree
+        void first_turn(size_t depth, value_t phase) {
+            program_t& amp = *amps[depth];
+            channel_t& input = wire(depth);
+            channel_t& output = *channels[depth + 1];
 
-                    for (auto pe : phases) {
-                        if (pe == pa || pe == pb || pe == pc || pe == pd)
-                            continue;
+            input.reset();
+            output.reset();
+            feed(input, phase, depth == 0 ? std::vector<value_t>{ 0 } : stages[depth - 1].said);
+            amp.exec();
 
-                        amp_loop loop(pa, pb, pc, pd, pe);
-                        thrust = std::max(thrust, loop.thrust);
+            if (!amp.halted && !amp.needs_input())
+                throw std::runtime_error("amplifier said too much");
+
+            stage_t& stage = stages[depth];
+            stage.said.clear();
+            for (value_t value; output.try_pop(value); )
+                stage.said.push_back(value);
+            stage.snapshot = amp.snapshot();
+        }
+
+        // Last amplifier of an ordering: rewinds the others to the end of their
+        // first turn and runs the whole loop from there
+        void finish(value_t phase) {
+            size_t last = phases.size() - 1;
+            for (size_t i = 0; i < last; ++i) {
+                channels[i]->reset();
+
+                // Without a feedback loop they're done after their first turn, and still as they were left
+                if (!stages[i].snapshot.halted)
+                    amps[i]->restore(stages[i].snapshot);
+            }
+
+            channel_t& input = wire(last);
+            input.reset();
+            feed(input, phase, last == 0 ? std::vector<value_t>{ 0 } : stages[last - 1].said);
+
+            if (pipeline) {
+                pipeline->run();
+            }
+            else {
+                for (;;) {
+                    size_t executed = 0;
+                    bool halted = true;
+                    for (size_t i = 0; i <= last; ++i) {
+                        program_t& amp = *amps[(last + i) % amps.size()]; // Last one goes first, it's the only one with anything to do
+                        executed += amp.step(std::numeric_limits<size_t>::max());
+                        halted = halted && amp.halted;
                     }
+
+                    if (halted)
+                        break;
+
+                    if (executed == 0)
+                        throw std::runtime_error("program is waiting for input");
                 }
             }
+
+            // Last word the final amplifier sent round the loop
+            std::optional<value_t> said;
+            for (value_t value; channels[0]->try_pop(value); )
+                said = value;
+
+            if (said)
+                best = std::max(best, *said);
+        }
+
+        // Rewinds amplifier depth to boot and plugs it in, returns its input
+        channel_t& wire(size_t depth) {
+            program_t& amp = *amps[depth];
+            amp.restore(boot);
+            amp.inputs = channels[depth].get();
+            amp.outputs = channels[(depth + 1) % channels.size()].get();
+            return *amp.inputs;
+        }
+
+        static void feed(channel_t& channel, value_t phase, std::vector<value_t> const& values) {
+            bool fits = channel.try_push(phase);
+            for (value_t value : values)
+                fits = fits && channel.try_push(value);
+
+            if (!fits)
+                throw std::runtime_error("amplifier said too much");
         }
+
+        snapshot_t const& boot;
+        std::vector<value_t> const& phases;
+        std::vector<bool> used; // By position in phases
+        std::vector<stage_t> stages; // By depth, for the trie path being walked
+
+        std::vector<std::unique_ptr<program_t>> amps;
+        std::vector<std::unique_ptr<channel_t>> channels; // channels[i] feeds amps[i]
+        std::optional<amp_loop> pipeline; // Runs the rounds when there are cores for it
+
+        value_t best = std::numeric_limits<value_t>::min();
+    };
+
+    value_t run_worker(snapshot_t const& boot) {
+        PROFILE(profile_t::scope_t scope("phase_search"));
+        walker_t walker(boot, phases, threaded);
+        std::vector<size_t> prefix(prefix_length);
+
+        for (size_t index; (index = next.fetch_add(1, std::memory_order_relaxed)) < prefix_count; ) {
+            unrank(index, prefix);
+            walker.walk(prefix);
+        }
+
+#ifdef ENABLE_PROFILER
+        std::lock_guard<std::mutex> lock(profile_mutex);
+        for (auto&& amp : walker.amps)
+            profile += amp->profile;
+#endif
+        return walker.best;
     }
 
-    std::cout << thrust;
+    // Writes the index-th prefix, as positions in phases in lexicographic order
+    void unrank(size_t index, std::vector<size_t>& prefix) const {
+        std::vector<size_t> remaining(phases.size());
+        for (size_t i = 0; i < remaining.size(); ++i)
+            remaining[i] = i;
+
+        size_t block = prefix_count;
+        for (size_t i = 0; i < prefix.size(); ++i) {
+            block /= remaining.size();
+            size_t pick = index / block;
+            index -= pick * block;
+
+            prefix[i] = remaining[pick];
+            remaining.erase(remaining.begin() + pick);
+        }
+    }
+
+    std::vector<value_t> phases;
+    bool threaded; // One amp_loop thread per amplifier per worker
+    size_t prefix_length = 0;
+    size_t prefix_count;
+    std::atomic<size_t> next{ 0 };
+};
+
+int main() {
+    phase_search search({ 5, 6, 7, 8, 9 });
+
+    std::cout << search.thrust;
+
+#ifdef ENABLE_PROFILER
+    search.profile.report(std::cerr);
+#endif
     return 0;
 }
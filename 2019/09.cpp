@@ -9,6 +9,55 @@
 #include <deque>
 #include <algorithm>
 #include <optional>
+#include <exception>
+#include <limits>
+#include <array>
+#include <chrono>
+#include <memory>
+#include <cstring>
+#include <cstddef>
+#include <string>
+#include <fstream>
+#include <map>
+#include <set>
+#include <functional>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+
+// The text loader scans 16 bytes at a time where there is SSE2, see csv_loader_t.
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// The JIT emits x86-64 and needs mmap/mprotect, elsewhere the jit engine
+// quietly runs on the threaded one.
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__))
+#define ENABLE_JIT
+#include <sys/mman.h>
+#endif
+
+// Counts instructions per opcode and eip, memory reads and writes, taken jumps
+// and time spent waiting on input into program_t::profile, see profile_t.
+// The interpreter and the threaded engine report, the jit can't and runs on
+// the threaded engine instead, with a warning. Compiles to nothing when left undefined.
+// #define ENABLE_PROFILER
+
+// Trace rings are memory-mapped files where there is mmap, see trace_ring_t.
+// So are program images, as long as their little-endian words can be used as is.
+#if defined(__unix__) || defined(__APPLE__)
+#define ENABLE_MAPPED_TRACE
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define ENABLE_MAPPED_IMAGE
+#endif
+#endif
 
 using size_t = std::size_t;
 
@@ -34,20 +83,572 @@ enum operation_mode {
     relative = 2
 };
 
+// Superinstructions built by program_t::fuse(). Values start past the last
+// intcode so both can share the threaded engine's dispatch table.
+enum fusion_t {
+    unfused = 0,
+    compare_jump = 100,     // less_than/equals, then a jump testing its result
+    add_compare_jump = 101, // add, then a compare_jump
+    rel_base_jump = 102,    // mod_rel_base, then a jump (calls and returns)
+};
+
+enum engine_t {
+    interpreter,
+    threaded,
+    jit
+};
+
 using value_t = int64_t;
 
 struct program_t;
 struct opcode_t;
 
+size_t get_parameter_count(intcode code) {
+    switch (code) {
+    case add:
+    case multiply:
+    case less_than:
+    case equals:
+        return 3;
+    case load_input:
+    case write_output:
+        return 1;
+    case jump_if_false:
+    case jump_if_true:
+        return 2;
+    case mod_rel_base:
+        return 1;
+    case halt:
+        return 0;
+    }
+
+    throw std::runtime_error("not implemented");
+}
+
+bool is_valid_instruction(value_t word) {
+    if (word <= 0)
+        return false;
+
+    intcode code = intcode(word - (word / 100) * 100);
+    switch (code) {
+    case add:
+    case multiply:
+    case load_input:
+    case write_output:
+    case jump_if_true:
+    case jump_if_false:
+    case less_than:
+    case equals:
+    case mod_rel_base:
+    case halt:
+        break;
+    default:
+        return false;
+    }
+
+    value_t parameter_modes = word / 100;
+    for (size_t i = 0; i < get_parameter_count(code); ++i) {
+        if (parameter_modes - (parameter_modes / 10) * 10 > relative)
+            return false;
+
+        parameter_modes /= 10;
+    }
+
+    return parameter_modes == 0;
+}
+
+// An instruction as decoded from the program image. Decoded once per address
+// and cached by program_t until a write lands on one of its words.
+struct instruction_t {
+    intcode code;
+    std::array<operation_mode, 3> parameter_mode;
+    std::array<value_t, 3> operands;
+    size_t length = 0; // 0 if not decoded
+
+    // Set when this instruction starts a fused sequence. The other instructions
+    // of the sequence keep their own records right after this one.
+    fusion_t fusion = unfused;
+    size_t fused_length = 0;
+};
+
+// Longest sequence fuse() can produce: add, less_than/equals, jump.
+constexpr const size_t max_fused_length = 4 + 4 + 3;
+
+// Program memory as a page table over 4 KiB pages. A page is allocated by the
+// first write that lands on it, reads of anything never written return 0, so a
+// program only costs the memory it touches.
+//
+// Copies share every page. Both sides lose write access to them, and the first
+// write to a page that is still shared copies it.
+struct memory_t {
+    constexpr const static size_t page_bits = 9;
+    constexpr const static size_t page_size = size_t(1) << page_bits; // In words
+    constexpr const static size_t page_mask = page_size - 1;
+    constexpr const static size_t max_pages = size_t(1) << 20; // 4 GiB worth of words
+
+    using page_t = std::array<value_t, page_size>;
+
+    memory_t() = default;
+    memory_t(value_t const* image, size_t size);
+    memory_t(std::shared_ptr<void const> owner, value_t const* words, size_t size);
+
+    memory_t(memory_t const& other) { *this = other; }
+    memory_t& operator = (memory_t const& other);
+    memory_t(memory_t&&) = default;
+    memory_t& operator = (memory_t&&) = default;
+
+    value_t read(size_t address) const {
+        size_t index = address >> page_bits;
+        if (index >= table.size() || table[index] == nullptr)
+            return 0;
+
+        return (*table[index])[address & page_mask];
+    }
+
+    void write(size_t address, value_t value) {
+        size_t index = address >> page_bits;
+        page_t* page = index < writable.size() ? writable[index] : nullptr;
+        if (page == nullptr)
+            page = &make_writable(index);
+
+        (*page)[address & page_mask] = value;
+    }
+
+    page_t& make_writable(size_t index);
+
+    std::vector<page_t*> table; // By page index, nullptr if never written
+    mutable std::vector<page_t*> writable; // Same, but only pages nobody else shares
+    std::vector<std::shared_ptr<page_t>> pages;
+};
+
+memory_t::memory_t(value_t const* image, size_t size) {
+    for (size_t address = 0; address < size; address += page_size) {
+        page_t& page = make_writable(address >> page_bits);
+        std::copy(image + address, image + std::min(size, address + page_size), page.begin());
+    }
+}
+
+// Whole pages of words are used where they are, kept alive by owner, and copied
+// by the first write like any other shared page. Only the last, partial one is
+// copied right away.
+memory_t::memory_t(std::shared_ptr<void const> owner, value_t const* words, size_t size) {
+    size_t whole = size / page_size;
+    table.resize(whole);
+    writable.resize(whole);
+    pages.resize(whole);
+    for (size_t index = 0; index < whole; ++index) {
+        auto page = reinterpret_cast<page_t const*>(words + index * page_size);
+        pages[index] = std::shared_ptr<page_t>(owner, const_cast<page_t*>(page));
+        table[index] = pages[index].get();
+    }
+
+    if (size % page_size != 0) {
+        page_t& page = make_writable(whole);
+        std::copy(words + whole * page_size, words + size, page.begin());
+    }
+}
+
+memory_t& memory_t::operator = (memory_t const& other) {
+    if (this != &other) {
+        table = other.table;
+        pages = other.pages;
+        writable.assign(table.size(), nullptr);
+        std::fill(other.writable.begin(), other.writable.end(), nullptr);
+    }
+
+    return *this;
+}
+
+memory_t::page_t& memory_t::make_writable(size_t index) {
+    if (index >= max_pages)
+        throw std::runtime_error("address out of range");
+
+    if (index >= table.size()) {
+        table.resize(index + 1);
+        writable.resize(index + 1);
+        pages.resize(index + 1);
+    }
+
+    std::shared_ptr<page_t>& page = pages[index];
+    if (page == nullptr) {
+        page = std::make_shared<page_t>();
+        page->fill(0);
+    }
+    else if (page.use_count() > 1) {
+        page = std::make_shared<page_t>(*page);
+    }
+
+    table[index] = writable[index] = page.get();
+    return *page;
+}
+
+// A program in the binary format written by 09_pack: a header_t, then the
+// words, then optionally the same program as rewritten by optimize(). Both
+// sections start on a 4 KiB boundary and hold little-endian int64 words, so
+// where there is mmap a little-endian host maps the file and hands its pages
+// straight to memory_t. Loading only costs the page faults.
+struct image_t {
+    struct header_t {
+        char magic[8]; // "ICIMAGE1"
+        uint64_t word_count;
+        uint64_t optimized_count; // 0 if there's no optimized form
+        uint64_t checksum; // image_t::checksum over both sections
+    };
+
+    constexpr const static size_t alignment = 4096;
+
+    static image_t load(const char* path);
+    static void save(const char* path, value_t const* words, size_t word_count, value_t const* optimized = nullptr, size_t optimized_count = 0);
+    static uint64_t checksum(value_t const* words, size_t count, uint64_t hash = 14695981039346656037ull);
+
+    static size_t padded(size_t bytes) { return (bytes + alignment - 1) / alignment * alignment; }
+
+    // Pages of the plain or optimized words, shared with the image until written to
+    memory_t memory(bool optimized = false) const;
+
+    std::shared_ptr<void const> data; // The mapping, or a buffer without mmap
+    value_t const* words = nullptr;
+    size_t word_count = 0;
+    value_t const* optimized = nullptr;
+    size_t optimized_count = 0;
+};
+
+// FNV-1a over the little-endian bytes of every word
+uint64_t image_t::checksum(value_t const* words, size_t count, uint64_t hash) {
+    for (size_t i = 0; i < count; ++i)
+        for (size_t byte = 0; byte < 8; ++byte)
+            hash = (hash ^ ((uint64_t(words[i]) >> (byte * 8)) & 0xff)) * 1099511628211ull;
+    return hash;
+}
+
+image_t image_t::load(const char* path) {
+    auto read_le = [](uint8_t const* bytes) {
+        uint64_t value = 0;
+        for (size_t i = 0; i < 8; ++i)
+            value |= uint64_t(bytes[i]) << (i * 8);
+        return value;
+    };
+
+    image_t image;
+    uint8_t* bytes = nullptr;
+    size_t size = 0;
+
+#if defined(ENABLE_MAPPED_IMAGE)
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0)
+        throw std::runtime_error("can't open image");
+
+    struct stat info;
+    void* mapping = MAP_FAILED;
+    if (::fstat(fd, &info) == 0 && info.st_size > 0) {
+        size = size_t(info.st_size);
+        // memory_t copies a page before writing to it, private keeps the file safe regardless
+        mapping = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    }
+    ::close(fd);
+
+    if (mapping == MAP_FAILED)
+        throw std::runtime_error("can't map image");
+
+    image.data = std::shared_ptr<void const>(mapping, [size](void const* mapping) { ::munmap(const_cast<void*>(mapping), size); });
+    bytes = static_cast<uint8_t*>(mapping);
+#else
+    std::ifstream in(path, std::ios::binary | std::ios::ate);
+    if (!in)
+        throw std::runtime_error("can't open image");
+
+    size = size_t(in.tellg());
+    auto buffer = std::make_shared<std::vector<value_t>>((size + sizeof(value_t) - 1) / sizeof(value_t));
+    bytes = reinterpret_cast<uint8_t*>(buffer->data());
+    in.seekg(0);
+    in.read(reinterpret_cast<char*>(bytes), std::streamsize(size));
+    image.data = buffer;
+#endif
+
+    if (size < sizeof(header_t) || std::memcmp(bytes, "ICIMAGE1", 8) != 0)
+        throw std::runtime_error("not an intcode image");
+
+    image.word_count = read_le(bytes + offsetof(header_t, word_count));
+    image.optimized_count = read_le(bytes + offsetof(header_t, optimized_count));
+    size_t words_offset = alignment;
+    size_t optimized_offset = words_offset + padded(image.word_count * sizeof(value_t));
+    if (image.word_count > size / sizeof(value_t) || image.optimized_count > size / sizeof(value_t)
+        || optimized_offset + image.optimized_count * sizeof(value_t) > size)
+        throw std::runtime_error("truncated intcode image");
+
+#if !defined(ENABLE_MAPPED_IMAGE)
+    // The buffer is ours, convert it in place for big-endian hosts
+    for (auto [offset, count] : { std::pair{ words_offset, image.word_count }, std::pair{ optimized_offset, image.optimized_count } })
+        for (size_t i = 0; i < count; ++i)
+            reinterpret_cast<value_t*>(bytes + offset)[i] = value_t(read_le(bytes + offset + i * sizeof(value_t)));
+#endif
+
+    image.words = reinterpret_cast<value_t const*>(bytes + words_offset);
+    image.optimized = image.optimized_count ? reinterpret_cast<value_t const*>(bytes + optimized_offset) : nullptr;
+
+    uint64_t hash = checksum(image.words, image.word_count);
+    if (checksum(image.optimized, image.optimized_count, hash) != read_le(bytes + offsetof(header_t, checksum)))
+        throw std::runtime_error("intcode image checksum mismatch");
+
+    return image;
+}
+
+// Written next to path and renamed over it, so a mapping of the old file stays valid
+void image_t::save(const char* path, value_t const* words, size_t word_count, value_t const* optimized, size_t optimized_count) {
+    std::vector<uint8_t> bytes(alignment + padded(word_count * sizeof(value_t)) + padded(optimized_count * sizeof(value_t)));
+
+    auto write_le = [&](size_t offset, uint64_t value) {
+        for (size_t i = 0; i < 8; ++i)
+            bytes[offset + i] = uint8_t(value >> (i * 8));
+    };
+
+    std::memcpy(bytes.data(), "ICIMAGE1", 8);
+    write_le(offsetof(header_t, word_count), word_count);
+    write_le(offsetof(header_t, optimized_count), optimized_count);
+    write_le(offsetof(header_t, checksum), checksum(optimized, optimized_count, checksum(words, word_count)));
+
+    for (size_t i = 0; i < word_count; ++i)
+        write_le(alignment + i * sizeof(value_t), uint64_t(words[i]));
+    size_t optimized_offset = alignment + padded(word_count * sizeof(value_t));
+    for (size_t i = 0; i < optimized_count; ++i)
+        write_le(optimized_offset + i * sizeof(value_t), uint64_t(optimized[i]));
+
+    std::string temporary = std::string(path) + ".tmp";
+    std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+    if (!out.write(reinterpret_cast<const char*>(bytes.data()), std::streamsize(bytes.size())))
+        throw std::runtime_error("can't write image");
+    out.close();
+
+    if (std::rename(temporary.c_str(), path) != 0)
+        throw std::runtime_error("can't write image");
+}
+
+memory_t image_t::memory(bool use_optimized) const {
+    if (use_optimized && optimized_count == 0)
+        throw std::runtime_error("image has no optimized form");
+
+    return use_optimized ? memory_t(data, optimized, optimized_count) : memory_t(data, words, word_count);
+}
+
+#ifdef ENABLE_PROFILER
+// Everything the interpreter or the threaded engine did for one program, see program_t::profile.
+struct profile_t {
+    using steady_clock = std::chrono::steady_clock;
+
+    // Names a stretch of host code, e.g. a game loop. Guest instructions run
+    // while it is alive are filed under it in the folded stacks, and the time
+    // spent in it shows up in the report. Scopes nest per thread and apply to
+    // every program running on that thread.
+    struct scope_t {
+        explicit scope_t(const char* name) : parent(current), start(steady_clock::now()) {
+            current = host().intern(parent, name);
+        }
+
+        ~scope_t() {
+            host().add_time(current, steady_clock::now() - start);
+            current = parent;
+        }
+
+        size_t parent;
+        steady_clock::time_point start;
+    };
+
+    // One instruction, where it ran from
+    struct frame_t {
+        size_t scope; // Host scope stack, 0 for none
+        size_t block; // Where the guest last jumped to, or fell through a jump
+        size_t eip;
+
+        bool operator == (frame_t const& o) const { return scope == o.scope && block == o.block && eip == o.eip; }
+    };
+
+    struct frame_hash {
+        size_t operator () (frame_t const& frame) const {
+            return std::hash<size_t>()(frame.eip) ^ (std::hash<size_t>()(frame.block) << 1) ^ (std::hash<size_t>()(frame.scope) << 2);
+        }
+    };
+
+    void count(size_t eip, intcode code) {
+        ++opcodes[code];
+        ++frames[{ current, block, eip }];
+    }
+
+    void read(size_t address) { ++reads[address]; }
+    void write(size_t address) { ++writes[address]; }
+
+    // Any jump ends the block, taken or not
+    void jump(size_t next, bool taken) {
+        if (taken)
+            ++jumps[next];
+        block = next;
+    }
+
+    void begin_wait() {
+        if (!waiting) {
+            waiting = true;
+            wait_start = steady_clock::now();
+        }
+    }
+
+    void end_wait() {
+        if (waiting) {
+            waiting = false;
+            input_wait += steady_clock::now() - wait_start;
+            ++waits;
+        }
+    }
+
+    profile_t& operator += (profile_t const& other);
+    void report(std::ostream& out, size_t top = 10) const;
+    void write_folded(std::ostream& out) const;
+
+    std::array<size_t, 100> opcodes{}; // By intcode
+    std::unordered_map<frame_t, size_t, frame_hash> frames;
+    std::unordered_map<size_t, size_t> reads; // By address
+    std::unordered_map<size_t, size_t> writes;
+    std::unordered_map<size_t, size_t> jumps; // By target, taken jumps only
+    steady_clock::duration input_wait{ 0 };
+    size_t waits = 0;
+
+    size_t block = 0;
+    bool waiting = false;
+    steady_clock::time_point wait_start;
+
+private:
+    // Scope stacks are interned so a frame only carries an index
+    struct host_t {
+        size_t intern(size_t parent, const char* name) {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto [it, added] = ids.try_emplace({ parent, name }, names.size());
+            if (added) {
+                names.push_back(parent == 0 ? name : names[parent] + ";" + name);
+                time.emplace_back(0);
+            }
+            return it->second;
+        }
+
+        void add_time(size_t scope, steady_clock::duration elapsed) {
+            std::lock_guard<std::mutex> lock(mutex);
+            time[scope] += elapsed;
+        }
+
+        std::mutex mutex;
+        std::map<std::pair<size_t, std::string>, size_t> ids;
+        std::vector<std::string> names{ "" };
+        std::vector<steady_clock::duration> time{ steady_clock::duration(0) };
+    };
+
+    static host_t& host() {
+        static host_t instance;
+        return instance;
+    }
+
+    static inline thread_local size_t current = 0;
+};
+
+profile_t& profile_t::operator += (profile_t const& other) {
+    for (size_t i = 0; i < opcodes.size(); ++i)
+        opcodes[i] += other.opcodes[i];
+    for (auto&& [frame, count] : other.frames)
+        frames[frame] += count;
+    for (auto&& [address, count] : other.reads)
+        reads[address] += count;
+    for (auto&& [address, count] : other.writes)
+        writes[address] += count;
+    for (auto&& [address, count] : other.jumps)
+        jumps[address] += count;
+    input_wait += other.input_wait;
+    waits += other.waits;
+    return *this;
+}
+
+void profile_t::report(std::ostream& out, size_t top) const {
+    const char* names[100] = {};
+    names[add] = "add";
+    names[multiply] = "multiply";
+    names[load_input] = "load_input";
+    names[write_output] = "write_output";
+    names[jump_if_true] = "jump_if_true";
+    names[jump_if_false] = "jump_if_false";
+    names[less_than] = "less_than";
+    names[equals] = "equals";
+    names[mod_rel_base] = "mod_rel_base";
+    names[halt] = "halt";
+
+    auto sorted = [](auto const& counts) {
+        std::vector<std::pair<size_t, size_t>> entries(counts.begin(), counts.end());
+        std::sort(entries.begin(), entries.end(), [](auto const& l, auto const& r) {
+            return l.second != r.second ? l.second > r.second : l.first < r.first;
+        });
+        return entries;
+    };
+
+    size_t total = 0;
+    std::unordered_map<size_t, size_t> eips;
+    for (auto&& [frame, count] : frames) {
+        eips[frame.eip] += count;
+        total += count;
+    }
+
+    auto print = [&](const char* title, std::vector<std::pair<size_t, size_t>> const& entries, auto label) {
+        out << title << std::endl;
+        for (size_t i = 0; i < entries.size() && i < top; ++i)
+            out << "  " << std::setw(14) << label(entries[i].first) << std::setw(14) << entries[i].second
+                << std::setw(8) << std::fixed << std::setprecision(2) << 100.0 * entries[i].second / std::max<size_t>(total, 1) << "%" << std::endl;
+    };
+
+    auto address = [](size_t address) { return std::to_string(address); };
+
+    std::unordered_map<size_t, size_t> by_opcode;
+    for (size_t i = 0; i < opcodes.size(); ++i)
+        if (opcodes[i] != 0)
+            by_opcode[i] = opcodes[i];
+
+    out << total << " instructions" << std::endl;
+    print("By opcode:", sorted(by_opcode), [&](size_t code) { return std::string(names[code] ? names[code] : "?"); });
+    print("Hottest eips:", sorted(eips), address);
+    print("Most read addresses:", sorted(reads), address);
+    print("Most written addresses:", sorted(writes), address);
+    print("Most taken jump targets:", sorted(jumps), address);
+    out << "Waited on input " << waits << " times, "
+        << std::chrono::duration<double, std::milli>(input_wait).count() << " ms" << std::endl;
+
+    host_t& scopes = host();
+    std::lock_guard<std::mutex> lock(scopes.mutex);
+    if (scopes.names.size() > 1) {
+        out << "Host scopes:" << std::endl;
+        for (size_t i = 1; i < scopes.names.size(); ++i)
+            out << "  " << scopes.names[i] << ": " << std::chrono::duration<double, std::milli>(scopes.time[i]).count() << " ms" << std::endl;
+    }
+}
+
+// One "frame;frame;... count" line per frame, as read by flamegraph.pl and speedscope.
+// Stacks are the host scopes, then the guest block, then the instruction.
+void profile_t::write_folded(std::ostream& out) const {
+    host_t& scopes = host();
+    std::lock_guard<std::mutex> lock(scopes.mutex);
+    for (auto&& [frame, count] : frames) {
+        if (frame.scope != 0)
+            out << scopes.names[frame.scope] << ";";
+        out << "block_" << frame.block << ";eip_" << frame.eip << " " << count << "\n";
+    }
+}
+
+#define PROFILE(...) __VA_ARGS__
+#else
+#define PROFILE(...)
+#endif
+
 struct opcode_t {
     opcode_t(program_t& program, size_t eip);
     std::optional<opcode_t> exec(std::deque<value_t>& inputs, std::vector<value_t>& outputs);
-    value_t& get_parameter(int32_t index);
+    value_t get_parameter(int32_t index);
+    void set_parameter(int32_t index, value_t value);
+    size_t get_address(int32_t index);
     size_t get_parameter_count();
 
     void swap(opcode_t& other) {
-        parameter_mode.swap(other.parameter_mode);
-        code = other.code;
+        std::swap(instr, other.instr);
         eip = other.eip;
         std::swap(program, other.program);
     }
@@ -57,91 +658,209 @@ struct opcode_t {
 
     std::reference_wrapper<program_t> program;
 
-    std::unordered_map<size_t, operation_mode> parameter_mode;
-    intcode code;
+    instruction_t instr;
+    size_t eip;
+};
+
+// Everything translated code needs, passed in rdi.
+struct jit_state_t {
+    program_t* program;
+    memory_t::page_t* const* pages;
+    memory_t::page_t* const* writable;
+    size_t page_count; // Entries in pages and writable, not allocated pages
+    uint8_t const* code_words;
+    size_t code_word_count;
+    size_t rel_base;
+    size_t executed;
+    size_t stalled;
+    std::exception_ptr error; // Thrown by a helper, exceptions can't unwind through translated code
+};
+
+// Translates basic blocks of intcode to x86-64, see program_t::exec_jit.
+struct jit_t {
+    using entry_t = size_t(*)(jit_state_t*);
+
+    struct block_t {
+        entry_t entry = nullptr;
+        size_t end = 0;
+        size_t instruction_count = 0;
+    };
+
+    constexpr const static size_t max_block_length = 64; // In instructions
+    constexpr const static size_t code_size = 4 << 20;
+
+    jit_t();
+    ~jit_t();
+
+    block_t const* compile(program_t& program, size_t eip);
+    void invalidate(size_t address);
+
+    std::vector<block_t> blocks; // By entry eip
+    uint8_t* code = nullptr;
+    size_t code_used = 0;
+    bool dirty = false; // Set when invalidate() drops a block
+};
+
+// Everything needed to bring a program_t back to where it was, see program_t::snapshot.
+struct snapshot_t {
+    std::deque<value_t> inputs;
+    std::vector<value_t> outputs;
+    memory_t ram;
+    std::vector<instruction_t> decoded;
+    std::vector<uint8_t> code_words;
+    size_t rel_base;
     size_t eip;
+    size_t instruction_count;
+    engine_t engine;
+    bool halted;
+};
+
+// One executed instruction, as stored by trace_ring_t and read back by 09_trace.
+struct trace_record_t {
+    uint64_t eip;
+    int64_t instruction; // Opcode word, parameter modes included
+    int64_t operands[3]; // As encoded, zero past the first length - 1
+    int64_t result;      // Value stored or output, next eip for jumps, new base for mod_rel_base
+};
+
+// Trace policies for program_t::interpret. A policy has a constexpr enabled
+// flag, next() handing out the record to fill in place and commit() to keep
+// it. With enabled false the interpreter doesn't even look at the policy.
+struct no_trace_t {
+    constexpr const static bool enabled = false;
+    trace_record_t& next();
+    void commit() { }
+};
+
+// Keeps the last capacity records in a file laid out as a trace_header_t
+// followed by the ring. The file is mapped, so writing a record is a plain
+// store and whatever was traced survives the process dying.
+struct trace_ring_t {
+    struct header_t {
+        char magic[8]; // "ICTRACE1"
+        uint64_t record_size;
+        uint64_t capacity;
+        uint64_t count; // Records ever written, the oldest kept is at count % capacity once it wrapped
+    };
+
+    constexpr const static bool enabled = true;
+
+    trace_ring_t(const char* path, size_t capacity); // capacity must be a power of two
+    ~trace_ring_t();
+    trace_ring_t(trace_ring_t const&) = delete;
+    trace_ring_t& operator = (trace_ring_t const&) = delete;
+
+    // Filled straight in the ring, building it elsewhere and copying it over
+    // costs more than everything else tracing does
+    trace_record_t& next() { return records[header->count & mask]; }
+    void commit() { ++header->count; }
+
+    header_t* header = nullptr;
+    trace_record_t* records = nullptr;
+    size_t mask;
+
+    size_t mapped_size;
+    std::string path; // Where the buffer gets saved without mmap
 };
 
 struct program_t {
     program_t(value_t* program, size_t program_size);
+    program_t(memory_t ram, size_t program_size);
+    program_t(snapshot_t snapshot);
+    snapshot_t snapshot() const;
+    void restore(snapshot_t const& snapshot);
+    program_t fork() const;
+    size_t step(size_t count);
     void exec();
+    void run();
+    template <typename trace_t> size_t interpret(size_t count, trace_t& trace);
+    template <typename trace_t> void run(trace_t& trace);
+    size_t exec_threaded(size_t count);
+    size_t exec_jit(size_t count);
+    bool needs_input() const;
+
+    instruction_t read_instruction(size_t eip) const;
+    instruction_t const& decode(size_t eip);
+    void fuse();
+    void write(size_t address, value_t value);
 
     std::deque<value_t> inputs;
     std::vector<value_t> outputs;
-    std::vector<value_t> ram;
+    memory_t ram; // Writes must go through write() to keep the decoded cache coherent
+    std::vector<instruction_t> decoded;
+    std::vector<uint8_t> code_words; // Set for every word a cached record was decoded from
     size_t rel_base = 0;
 
+    engine_t engine = interpreter;
+    size_t instruction_count = 0;
+    std::unique_ptr<jit_t> compiled;
+
     opcode_t opc;
+    bool halted = false;
+
+#ifdef ENABLE_PROFILER
+    profile_t profile; // Not part of snapshots, keeps adding up across restore()
+#endif
 };
 
 opcode_t::opcode_t(program_t& program, size_t eip)
-    : eip(eip), program(program)
+    : program(program), instr(program.decode(eip)), eip(eip)
 {
-    value_t eip_instr = program.ram[eip];
-    code = intcode(eip_instr - (eip_instr / 100) * 100);
-
-    value_t parameter_modes = eip_instr / 100;
-    for (int32_t i = 0; i < get_parameter_count(); ++i) {
-        parameter_mode[i] = operation_mode(parameter_modes - (parameter_modes / 10) * 10);
-
-        parameter_modes /= 10;
-    }
 }
 
 size_t opcode_t::get_parameter_count() {
-    switch (code) {
-    case add:
-    case multiply:
-    case less_than:
-    case equals:
-        return 3;
-    case load_input:
-    case write_output:
-        return 1;
-    case jump_if_false:
-    case jump_if_true:
-        return 2;
-    case mod_rel_base:
-        return 1;
-    case halt:
-        return 0;
-    }
-
-    throw std::runtime_error("not implemented");
+    return instr.length - 1;
 }
 
-value_t& opcode_t::get_parameter(int32_t index) {
-    switch (parameter_mode[index]) {
+size_t opcode_t::get_address(int32_t index) {
+    switch (instr.parameter_mode[index]) {
         case position:
-            return program.get().ram[program.get().ram[eip + 1 + index]];
+            return instr.operands[index];
         case immediate:
-            return program.get().ram[eip + 1 + index];
-            break;
+            return eip + 1 + index;
         case relative:
-            return program.get().ram[program.get().rel_base + program.get().ram[eip + 1 + index]];
-            break;
+            return program.get().rel_base + instr.operands[index];
         default:
             throw std::runtime_error("not implemented");
     }
 }
 
+value_t opcode_t::get_parameter(int32_t index) {
+    if (instr.parameter_mode[index] == immediate)
+        return instr.operands[index];
+
+    size_t address = get_address(index);
+    PROFILE(program.get().profile.read(address));
+    return program.get().ram.read(address);
+}
+
+void opcode_t::set_parameter(int32_t index, value_t value) {
+    size_t address = get_address(index);
+    PROFILE(program.get().profile.write(address));
+    program.get().write(address, value);
+}
+
 std::optional<opcode_t> opcode_t::exec(std::deque<value_t>& inputs, std::vector<value_t>& outputs) {
+    PROFILE(program.get().profile.count(eip, instr.code));
 
-    switch (code) {
+    switch (instr.code) {
     case add:
         //std::cout << "Executing opcode add " << eip << " { @" << get_parameter(2) << " = " << get_parameter(1) << " + " << get_parameter(0) << "}" << std::endl;
-        get_parameter(2) = get_parameter(1) + get_parameter(0);
+        set_parameter(2, get_parameter(1) + get_parameter(0));
         break;
     case multiply:
         //std::cout << "Executing opcode multiply " << eip << " { @" << get_parameter(2) << " = " << get_parameter(1) << " + " << get_parameter(0) << "}" << std::endl;
-        get_parameter(2) = get_parameter(1) * get_parameter(0);
+        set_parameter(2, get_parameter(1) * get_parameter(0));
         break;
     case load_input:
     {
+        if (inputs.empty())
+            return *this;
+
         //std::cout << "Executing opcode load_input " << eip << " { @" << get_parameter(0) << " = " << inputs.front() << "}" << std::endl;
         auto input = inputs.front();
         inputs.pop_front();
-        get_parameter(0) = input;
+        set_parameter(0, input);
         break;
     }
     case write_output:
@@ -150,27 +869,36 @@ std::optional<opcode_t> opcode_t::exec(std::deque<value_t>& inputs, std::vector<
         break;
     case less_than:
         //std::cout << "Executing opcode less_than " << eip << " { @" << get_parameter(2) << " = " << get_parameter(1) << " < " << get_parameter(0) << "}" << std::endl;
-        get_parameter(2) = get_parameter(0) < get_parameter(1);
+        set_parameter(2, get_parameter(0) < get_parameter(1));
         break;
     case equals:
         //std::cout << "Executing opcode equals " << eip << " { @" << get_parameter(2) << " = " << get_parameter(1) << " == " << get_parameter(0) << "}" << std::endl;
-        get_parameter(2) = get_parameter(0) == get_parameter(1);
+        set_parameter(2, get_parameter(0) == get_parameter(1));
         break;
     case jump_if_true:
         //std::cout << "Executing opcode jump_if_true " << eip << " { " << get_parameter(0) << "; @" << get_parameter(1) << "}" << std::endl;
-        if (get_parameter(0) != 0)
-            return jump_to(get_parameter(1)).exec(inputs, outputs);
+        if (get_parameter(0) != 0) {
+            size_t target = get_parameter(1); // Read once, the profiler counts reads
+            PROFILE(program.get().profile.jump(target, true));
+            return jump_to(target);
+        }
+        PROFILE(program.get().profile.jump(eip + instr.length, false));
         break;
     case jump_if_false:
         //std::cout << "Executing opcode jump_if_false " << eip << " { " << get_parameter(0) << "; @" << get_parameter(1) << "}" << std::endl;
-        if (get_parameter(0) == 0)
-            return jump_to(get_parameter(1)).exec(inputs, outputs);
+        if (get_parameter(0) == 0) {
+            size_t target = get_parameter(1); // Read once, the profiler counts reads
+            PROFILE(program.get().profile.jump(target, true));
+            return jump_to(target);
+        }
+        PROFILE(program.get().profile.jump(eip + instr.length, false));
         break;
     case mod_rel_base:
         //std::cout << "Executing opcode mod_rel_base " << eip << " { " << get_parameter(0) << "}" << std::endl;
         program.get().rel_base += get_parameter(0);
         break;
     case halt:
+        program.get().halted = true;
         return std::nullopt;
     }
 
@@ -178,7 +906,7 @@ std::optional<opcode_t> opcode_t::exec(std::deque<value_t>& inputs, std::vector<
 }
 
 opcode_t opcode_t::next() {
-    return opcode_t{ program, eip + 1 + get_parameter_count() };
+    return opcode_t{ program, eip + instr.length };
 }
 
 opcode_t opcode_t::jump_to(size_t abs_ofs) {
@@ -188,41 +916,2392 @@ opcode_t opcode_t::jump_to(size_t abs_ofs) {
 // program_t
 
 program_t::program_t(value_t* program, size_t program_size)
-    : opc(*this, 0), ram(program, program + program_size)
+    : program_t(memory_t(program, program_size), program_size)
 {
-    ram.resize(std::max<size_t>(ram.size(), 0x8000u));
 }
 
-void program_t::exec() {
-    std::optional<opcode_t> opt = opc.exec(inputs, outputs);
-    while (opt) {
-        auto next = (*opt).exec(inputs, outputs);
-        if (!next)
-            break;
+program_t::program_t(memory_t ram, size_t program_size)
+    : ram(std::move(ram)), decoded(program_size), code_words(program_size), opc(*this, 0)
+{
+    fuse();
+}
 
-        opt.swap(next);
+instruction_t program_t::read_instruction(size_t eip) const {
+    instruction_t instr;
+
+    value_t eip_instr = ram.read(eip);
+    instr.code = intcode(eip_instr - (eip_instr / 100) * 100);
+
+    size_t parameter_count = get_parameter_count(instr.code);
+    value_t parameter_modes = eip_instr / 100;
+    for (size_t i = 0; i < parameter_count; ++i) {
+        instr.parameter_mode[i] = operation_mode(parameter_modes - (parameter_modes / 10) * 10);
+        instr.operands[i] = ram.read(eip + 1 + i);
+
+        parameter_modes /= 10;
     }
+
+    instr.length = parameter_count + 1;
+    return instr;
 }
 
-program_t make_program(value_t* program, size_t count) {
-    return program_t{ program, count };
-};
+instruction_t const& program_t::decode(size_t eip) {
+    // A jump to -1 or far past memory must not wrap or blow up the cache
+    if (eip >= memory_t::max_pages * memory_t::page_size)
+        throw std::runtime_error("address out of range");
 
-template <size_t N>
-program_t make_program(value_t(&program)[N]) {
-    return program_t{ program, N };
+    if (eip >= decoded.size())
+        decoded.resize(eip + 1);
+
+    instruction_t& instr = decoded[eip];
+    if (instr.length != 0)
+        return instr;
+
+    instr = read_instruction(eip);
+
+    if (code_words.size() < eip + instr.length)
+        code_words.resize(eip + instr.length);
+    std::fill_n(code_words.begin() + eip, instr.length, true);
+
+    return instr;
 }
 
-value_t state[] = {
-    // Copy intcode here
-};
+// Load-time pass over the image looking for the sequences listed in fusion_t.
+// Every address is tried since there is no telling code from data here, a
+// sequence that is never jumped to costs nothing. Only the threaded engine runs
+// fused records, the interpreter keeps executing their first instruction alone.
+void program_t::fuse() {
+    size_t image_size = decoded.size();
 
+    auto peek = [&](size_t eip) -> std::optional<instruction_t> {
+        if (eip >= image_size || !is_valid_instruction(ram.read(eip)))
+            return std::nullopt;
 
-int main() {
-    auto program = make_program(state);
-    program.inputs.push_back(STEP);
-    program.exec();
-    for (auto&& output : program.outputs)
-        std::cout << output << std::endl;
+        return read_instruction(eip);
+    };
+
+    auto is_jump = [](std::optional<instruction_t> const& instr) {
+        return instr && (instr->code == jump_if_true || instr->code == jump_if_false);
+    };
+
+    auto outside = [](size_t address, size_t eip, size_t length) {
+        return address < eip || address >= eip + length;
+    };
+
+    // The compare writes a flag the jump then tests. Both must use a fixed
+    // position outside the whole sequence, starting at first, so that the
+    // store can't rewrite it.
+    auto compare_jump_length = [&](size_t eip, size_t first) -> size_t {
+        auto compare = peek(eip);
+        if (!compare || (compare->code != less_than && compare->code != equals) || compare->parameter_mode[2] != position)
+            return 0;
+
+        auto jump = peek(eip + compare->length);
+        if (!is_jump(jump) || jump->parameter_mode[0] != position || jump->operands[0] != compare->operands[2])
+            return 0;
+
+        size_t length = compare->length + jump->length;
+        return outside(compare->operands[2], first, eip + length - first) ? length : 0;
+    };
+
+    auto commit = [&](size_t eip, fusion_t fusion, size_t length) {
+        for (size_t i = eip; i < eip + length; i += decode(i).length)
+            ;
+
+        decoded[eip].fusion = fusion;
+        decoded[eip].fused_length = length;
+    };
+
+    for (size_t eip = 0; eip < image_size; ++eip) {
+        auto instr = peek(eip);
+        if (!instr)
+            continue;
+
+        switch (instr->code) {
+        case less_than:
+        case equals:
+            if (size_t length = compare_jump_length(eip, eip))
+                commit(eip, compare_jump, length);
+            break;
+        case add:
+            if (instr->parameter_mode[2] != position)
+                break;
+
+            if (size_t length = compare_jump_length(eip + instr->length, eip)) {
+                length += instr->length;
+                if (outside(instr->operands[2], eip, length))
+                    commit(eip, add_compare_jump, length);
+            }
+            break;
+        case mod_rel_base:
+            if (auto jump = peek(eip + instr->length); is_jump(jump))
+                commit(eip, rel_base_jump, instr->length + jump->length);
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+void program_t::write(size_t address, value_t value) {
+    ram.write(address, value);
+
+    if (address >= code_words.size() || !code_words[address])
+        return;
+
+    if (compiled)
+        compiled->invalidate(address);
+
+    // Self-modifying code: drop every cached instruction that covers this address,
+    // and break up fused sequences that do.
+    size_t lookback = max_fused_length - 1;
+    for (size_t i = address < lookback ? 0 : address - lookback; i <= address && i < decoded.size(); ++i) {
+        instruction_t& instr = decoded[i];
+        if (instr.length == 0)
+            continue;
+
+        if (i + instr.length > address)
+            instr.length = 0;
+        else if (instr.fusion != unfused && i + instr.fused_length > address)
+            instr.fusion = unfused;
+    }
+}
+
+program_t::program_t(snapshot_t snapshot)
+    : inputs(std::move(snapshot.inputs)),
+    outputs(std::move(snapshot.outputs)),
+    ram(std::move(snapshot.ram)),
+    decoded(std::move(snapshot.decoded)),
+    code_words(std::move(snapshot.code_words)),
+    rel_base(snapshot.rel_base),
+    engine(snapshot.engine),
+    instruction_count(snapshot.instruction_count),
+    opc(*this, snapshot.eip),
+    halted(snapshot.halted)
+{
+}
+
+// Captures the program as it stands. Memory pages are shared with the snapshot
+// until one side writes to them, so this costs the decode cache plus a pointer
+// per page. The decode cache is copied rather than rebuilt to keep fused records.
+snapshot_t program_t::snapshot() const {
+    return snapshot_t{ inputs, outputs, ram, decoded, code_words, rel_base, opc.eip, instruction_count, engine, halted };
+}
+
+void program_t::restore(snapshot_t const& snapshot) {
+    inputs = snapshot.inputs;
+    outputs = snapshot.outputs;
+    ram = snapshot.ram;
+    decoded = snapshot.decoded;
+    code_words = snapshot.code_words;
+    rel_base = snapshot.rel_base;
+    engine = snapshot.engine;
+    instruction_count = snapshot.instruction_count;
+    halted = snapshot.halted;
+    compiled.reset(); // Blocks may have been translated from code the snapshot doesn't have
+    opc = opcode_t(*this, snapshot.eip);
+}
+
+// A second program that carries on independently from this one's current state.
+program_t program_t::fork() const {
+    return program_t{ snapshot() };
+}
+
+bool program_t::needs_input() const {
+    return !halted && opc.instr.code == load_input && inputs.empty();
+}
+
+// Executes at most count instructions, stopping early if the program halts or
+// blocks on an empty input queue. Returns the number of instructions executed.
+size_t program_t::step(size_t count) {
+    if (engine == threaded)
+        return exec_threaded(count);
+
+    if (engine == jit) {
+#ifdef ENABLE_PROFILER
+        // Translated blocks can't report to the profiler, say so and profile the threaded engine instead
+        static std::atomic<bool> warned{ false };
+        if (!warned.exchange(true))
+            std::cerr << "profiler: jit can't be profiled, running the threaded engine instead" << std::endl;
+        return exec_threaded(count);
+#else
+        return exec_jit(count);
+#endif
+    }
+
+    no_trace_t trace;
+    return interpret(count, trace);
+}
+
+// The interpreter behind step(), handing a record of every instruction to the
+// trace policy. Whatever the engine, tracing always interprets.
+template <typename trace_t>
+size_t program_t::interpret(size_t count, trace_t& trace) {
+    // Decode again, the host may have patched memory since we last stopped
+    opc = opcode_t(*this, opc.eip);
+    PROFILE(if (!needs_input()) profile.end_wait());
+
+    size_t executed = 0;
+    while (executed < count && !halted && !needs_input()) {
+        trace_record_t* record = nullptr;
+        size_t destination = 0;
+        if constexpr (trace_t::enabled) {
+            instruction_t const& instr = opc.instr;
+            record = &trace.next();
+            record->eip = opc.eip;
+            record->instruction = ram.read(opc.eip); // Modes past the operand count aren't decoded
+            // Records are reused, and operands past the instruction's own were never decoded
+            std::fill(std::copy_n(instr.operands.begin(), instr.length - 1, record->operands), std::end(record->operands), 0);
+            record->result = 0;
+
+            if (instr.code == add || instr.code == multiply || instr.code == less_than || instr.code == equals)
+                destination = opc.get_address(2);
+            else if (instr.code == load_input)
+                destination = opc.get_address(0);
+        }
+
+        std::optional<opcode_t> next_instr = opc.exec(inputs, outputs);
+        ++executed;
+
+        if constexpr (trace_t::enabled) {
+            switch (intcode(record->instruction % 100)) {
+            case add: case multiply: case less_than: case equals: case load_input:
+                record->result = ram.read(destination);
+                break;
+            case write_output:
+                record->result = outputs.back();
+                break;
+            case jump_if_true: case jump_if_false:
+                record->result = next_instr->eip;
+                break;
+            case mod_rel_base:
+                record->result = rel_base;
+                break;
+            case halt:
+                break;
+            }
+
+            trace.commit();
+        }
+
+        if (next_instr)
+            opc = *next_instr;
+    }
+
+    instruction_count += executed;
+    PROFILE(if (needs_input()) profile.begin_wait());
+    return executed;
+}
+
+// Same as run(), tracing every instruction.
+template <typename trace_t>
+void program_t::run(trace_t& trace) {
+    interpret(std::numeric_limits<size_t>::max(), trace);
+    if (!halted)
+        throw std::runtime_error("program is waiting for input");
+}
+
+// trace_ring_t
+
+trace_ring_t::trace_ring_t(const char* path, size_t capacity)
+    : mask(capacity - 1), mapped_size(sizeof(header_t) + capacity * sizeof(trace_record_t)), path(path)
+{
+    if (capacity == 0 || (capacity & mask) != 0)
+        throw std::runtime_error("trace capacity must be a power of two");
+
+#ifdef ENABLE_MAPPED_TRACE
+    int fd = ::open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        throw std::runtime_error("can't open trace file");
+
+    // Fault the whole ring in now rather than one page at a time while tracing
+    int flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+    flags |= MAP_POPULATE;
+#endif
+
+    void* mapping = MAP_FAILED;
+    if (::ftruncate(fd, off_t(mapped_size)) == 0)
+        mapping = ::mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE, flags, fd, 0);
+    ::close(fd);
+
+    if (mapping == MAP_FAILED)
+        throw std::runtime_error("can't map trace file");
+
+    header = static_cast<header_t*>(mapping);
+#else
+    header = static_cast<header_t*>(::operator new(mapped_size));
+#endif
+
+    std::memcpy(header->magic, "ICTRACE1", sizeof(header->magic));
+    header->record_size = sizeof(trace_record_t);
+    header->capacity = capacity;
+    header->count = 0;
+    records = reinterpret_cast<trace_record_t*>(header + 1);
+}
+
+trace_ring_t::~trace_ring_t() {
+#ifdef ENABLE_MAPPED_TRACE
+    ::munmap(header, mapped_size);
+#else
+    std::ofstream(path, std::ios::binary).write(reinterpret_cast<const char*>(header), mapped_size);
+    ::operator delete(header);
+#endif
+}
+
+// Runs until the program halts or needs an input that isn't there yet.
+void program_t::exec() {
+    step(std::numeric_limits<size_t>::max());
+}
+
+// Runs until the program halts, running out of inputs is an error.
+void program_t::run() {
+    exec();
+    if (!halted)
+        throw std::runtime_error("program is waiting for input");
+}
+
+// Labels-as-values are a GCC/Clang extension, everyone else gets a switch.
+#if defined(__GNUC__) || defined(__clang__)
+#define ENABLE_COMPUTED_GOTO
+#endif
+
+// Same semantics as opcode_t::exec, but eip, rel_base and ram stay in locals and
+// every handler jumps straight to the next one instead of going back through
+// program_t::step. Stops like step() does.
+size_t program_t::exec_threaded(size_t count) {
+    if (halted)
+        return 0;
+
+    size_t eip = opc.eip;
+    size_t rel_base = this->rel_base;
+    size_t executed = 0;
+    memory_t const& ram = this->ram;
+    instruction_t const* instr = nullptr;
+    PROFILE(if (!needs_input()) profile.end_wait());
+
+    auto get_address = [&](int32_t index) -> size_t {
+        switch (instr->parameter_mode[index]) {
+        case position:
+            return instr->operands[index];
+        case immediate:
+            return eip + 1 + index;
+        case relative:
+            return rel_base + instr->operands[index];
+        default:
+            throw std::runtime_error("not implemented");
+        }
+    };
+
+    auto get_parameter = [&](int32_t index) -> value_t {
+        if (instr->parameter_mode[index] == immediate)
+            return instr->operands[index];
+
+        size_t address = get_address(index);
+        PROFILE(profile.read(address));
+        return ram.read(address);
+    };
+
+    // Reads a parameter of one of the other records of a fused sequence.
+    auto get_operand = [&](instruction_t const* record, int32_t index) -> value_t {
+        switch (record->parameter_mode[index]) {
+        case position:
+            PROFILE(profile.read(record->operands[index]));
+            return ram.read(record->operands[index]);
+        case immediate:
+            return record->operands[index];
+        case relative:
+            PROFILE(profile.read(rel_base + record->operands[index]));
+            return ram.read(rel_base + record->operands[index]);
+        default:
+            throw std::runtime_error("not implemented");
+        }
+    };
+
+    auto take_jump = [&](instruction_t const* jump, value_t condition) {
+        return jump->code == jump_if_true ? condition != 0 : condition == 0;
+    };
+
+    // Move eip past the instruction before storing: the store may invalidate
+    // the record instr points to.
+    auto store = [&](int32_t index, value_t value) {
+        size_t address = get_address(index);
+        eip += instr->length;
+        PROFILE(profile.write(address));
+        write(address, value);
+    };
+
+    // Takes a jump or falls through past the whole sequence, fused or not
+    auto jump_to = [&](bool taken, size_t target, size_t length) {
+        PROFILE(profile.jump(taken ? target : eip + length, taken));
+        eip = taken ? target : eip + length;
+    };
+
+// An input that stalls isn't counted, the interpreter never gets that far;
+// op_load_input counts its own once there is something to read.
+#define FETCH()             \
+    if (executed == count)  \
+        goto stalled;       \
+    instr = &decode(eip);   \
+    PROFILE(if (instr->code != load_input) profile.count(eip, instr->code)); \
+    ++executed
+
+#define HANDLER() (instr->fusion != unfused ? int(instr->fusion) : int(instr->code))
+
+#ifdef ENABLE_COMPUTED_GOTO
+    void* dispatch_table[rel_base_jump + 1];
+    std::fill(std::begin(dispatch_table), std::end(dispatch_table), &&op_invalid);
+    dispatch_table[add] = &&op_add;
+    dispatch_table[multiply] = &&op_multiply;
+    dispatch_table[load_input] = &&op_load_input;
+    dispatch_table[write_output] = &&op_write_output;
+    dispatch_table[jump_if_true] = &&op_jump_if_true;
+    dispatch_table[jump_if_false] = &&op_jump_if_false;
+    dispatch_table[less_than] = &&op_less_than;
+    dispatch_table[equals] = &&op_equals;
+    dispatch_table[mod_rel_base] = &&op_mod_rel_base;
+    dispatch_table[halt] = &&op_halt;
+    dispatch_table[compare_jump] = &&op_compare_jump;
+    dispatch_table[add_compare_jump] = &&op_add_compare_jump;
+    dispatch_table[rel_base_jump] = &&op_rel_base_jump;
+
+#define OPCODE(code) op_##code:
+#define DISPATCH() FETCH(); goto *dispatch_table[HANDLER()]
+#define OPCODE_INVALID() op_invalid:
+
+    DISPATCH();
+#else
+#define OPCODE(code) case code: op_##code:
+#define DISPATCH() continue
+#define OPCODE_INVALID() default:
+
+    for (;;) {
+        FETCH();
+        switch (HANDLER()) {
+#endif
+        OPCODE(add)
+            store(2, get_parameter(1) + get_parameter(0));
+            DISPATCH();
+        OPCODE(multiply)
+            store(2, get_parameter(1) * get_parameter(0));
+            DISPATCH();
+        OPCODE(load_input)
+        {
+            if (inputs.empty()) {
+                --executed;
+                goto stalled;
+            }
+
+            PROFILE(profile.count(eip, load_input));
+            auto input = inputs.front();
+            inputs.pop_front();
+            store(0, input);
+            DISPATCH();
+        }
+        OPCODE(write_output)
+            outputs.push_back(get_parameter(0));
+            eip += instr->length;
+            DISPATCH();
+        OPCODE(less_than)
+            store(2, get_parameter(0) < get_parameter(1));
+            DISPATCH();
+        OPCODE(equals)
+            store(2, get_parameter(0) == get_parameter(1));
+            DISPATCH();
+        OPCODE(jump_if_true)
+            jump_to(get_parameter(0) != 0, get_parameter(1), instr->length);
+            DISPATCH();
+        OPCODE(jump_if_false)
+            jump_to(get_parameter(0) == 0, get_parameter(1), instr->length);
+            DISPATCH();
+        OPCODE(mod_rel_base)
+            rel_base += get_parameter(0);
+            eip += instr->length;
+            DISPATCH();
+        OPCODE(halt)
+            halted = true;
+            goto stalled;
+        OPCODE(compare_jump)
+        {
+            if (count - executed < 1)
+                goto unfused;
+
+            instruction_t const* jump = &decoded[eip + instr->length];
+            PROFILE(profile.count(eip + instr->length, jump->code));
+            PROFILE(profile.read(instr->operands[2])); // The jump reading the flag back
+            value_t flag = instr->code == less_than
+                ? get_parameter(0) < get_parameter(1)
+                : get_parameter(0) == get_parameter(1);
+            PROFILE(profile.write(instr->operands[2]));
+            write(instr->operands[2], flag);
+
+            bool taken = take_jump(jump, flag);
+            jump_to(taken, taken ? get_operand(jump, 1) : 0, instr->fused_length);
+            executed += 1;
+            DISPATCH();
+        }
+        OPCODE(add_compare_jump)
+        {
+            if (count - executed < 2)
+                goto unfused;
+
+            instruction_t const* compare = &decoded[eip + instr->length];
+            instruction_t const* jump = &decoded[eip + instr->length + compare->length];
+            PROFILE(profile.count(eip + instr->length, compare->code));
+            PROFILE(profile.count(eip + instr->length + compare->length, jump->code));
+            PROFILE(profile.write(instr->operands[2]));
+            write(instr->operands[2], get_parameter(1) + get_parameter(0));
+
+            value_t flag = compare->code == less_than
+                ? get_operand(compare, 0) < get_operand(compare, 1)
+                : get_operand(compare, 0) == get_operand(compare, 1);
+            PROFILE(profile.write(compare->operands[2]));
+            PROFILE(profile.read(compare->operands[2]));
+            write(compare->operands[2], flag);
+
+            bool taken = take_jump(jump, flag);
+            jump_to(taken, taken ? get_operand(jump, 1) : 0, instr->fused_length);
+            executed += 2;
+            DISPATCH();
+        }
+        OPCODE(rel_base_jump)
+        {
+            if (count - executed < 1)
+                goto unfused;
+
+            instruction_t const* jump = &decoded[eip + instr->length];
+            PROFILE(profile.count(eip + instr->length, jump->code));
+            rel_base += get_parameter(0);
+
+            bool taken = take_jump(jump, get_operand(jump, 0));
+            jump_to(taken, taken ? get_operand(jump, 1) : 0, instr->fused_length);
+            executed += 1;
+            DISPATCH();
+        }
+        unfused:
+            // Not enough budget left for the whole sequence, run its first instruction alone
+            switch (instr->code) {
+            case add:
+                goto op_add;
+            case less_than:
+                goto op_less_than;
+            case equals:
+                goto op_equals;
+            case mod_rel_base:
+                goto op_mod_rel_base;
+            default:
+                throw std::runtime_error("not implemented");
+            }
+        OPCODE_INVALID()
+            throw std::runtime_error("not implemented");
+#ifndef ENABLE_COMPUTED_GOTO
+        }
+    }
+#endif
+
+#undef OPCODE_INVALID
+#undef HANDLER
+#undef DISPATCH
+#undef OPCODE
+#undef FETCH
+
+stalled:
+    this->rel_base = rel_base;
+    instruction_count += executed;
+    opc = opcode_t(*this, eip);
+    PROFILE(if (needs_input()) profile.begin_wait());
+    return executed;
+}
+
+#ifdef ENABLE_JIT
+// Just enough of an x86-64 encoder for jit_t.
+struct x64_t {
+    enum reg_t { rax, rcx, rdx, rbx, rsp, rbp, rsi, rdi, r8, r9, r10, r11, r12, r13, r14, r15 };
+    enum cond_t { above_equal = 0x3, equal = 0x4, not_equal = 0x5, less = 0xC };
+
+    std::vector<uint8_t> bytes;
+
+    void emit(uint8_t byte) { bytes.push_back(byte); }
+    void emit32(int32_t value) { for (int i = 0; i < 32; i += 8) emit(uint8_t(uint32_t(value) >> i)); }
+    void emit64(uint64_t value) { for (int i = 0; i < 64; i += 8) emit(uint8_t(value >> i)); }
+
+    void rex(bool wide, int reg, int index, int base) {
+        uint8_t prefix = 0x40 | (wide ? 8 : 0) | (reg & 8 ? 4 : 0) | (index & 8 ? 2 : 0) | (base & 8 ? 1 : 0);
+        if (prefix != 0x40)
+            emit(prefix);
+    }
+
+    // ModRM for reg, [base + disp32]
+    void mem(int reg, int base, int32_t disp) {
+        emit(0x80 | (reg & 7) << 3 | (base & 7));
+        if ((base & 7) == rsp)
+            emit(0x24);
+        emit32(disp);
+    }
+
+    // ModRM + SIB for reg, [base + index * (1 << scale) + disp32]
+    void mem(int reg, int base, int index, int scale, int32_t disp) {
+        emit(0x80 | (reg & 7) << 3 | rsp);
+        emit(scale << 6 | (index & 7) << 3 | (base & 7));
+        emit32(disp);
+    }
+
+    void direct(int reg, int rm) { emit(0xC0 | (reg & 7) << 3 | (rm & 7)); }
+
+    void push(reg_t r) { rex(false, 0, 0, r); emit(0x50 | (r & 7)); }
+    void pop(reg_t r) { rex(false, 0, 0, r); emit(0x58 | (r & 7)); }
+    void ret() { emit(0xC3); }
+    void call(reg_t r) { rex(false, 0, 0, r); emit(0xFF); direct(2, r); }
+
+    void mov(reg_t dst, uint64_t imm) { rex(true, 0, 0, dst); emit(0xB8 | (dst & 7)); emit64(imm); }
+    void mov(reg_t dst, reg_t src) { rex(true, src, 0, dst); emit(0x89); direct(src, dst); }
+    void load(reg_t dst, reg_t base, int32_t disp) { rex(true, dst, 0, base); emit(0x8B); mem(dst, base, disp); }
+    void load(reg_t dst, reg_t base, reg_t index, int32_t disp) { rex(true, dst, index, base); emit(0x8B); mem(dst, base, index, 3, disp); }
+    void store(reg_t base, int32_t disp, reg_t src) { rex(true, src, 0, base); emit(0x89); mem(src, base, disp); }
+    void store(reg_t base, reg_t index, int32_t disp, reg_t src) { rex(true, src, index, base); emit(0x89); mem(src, base, index, 3, disp); }
+    void lea(reg_t dst, reg_t base, int32_t disp) { rex(true, dst, 0, base); emit(0x8D); mem(dst, base, disp); }
+
+    void add(reg_t dst, reg_t src) { rex(true, src, 0, dst); emit(0x01); direct(src, dst); }
+    void and_(reg_t dst, int32_t imm) { rex(true, 0, 0, dst); emit(0x81); direct(4, dst); emit32(imm); }
+    void shr(reg_t dst, uint8_t imm) { rex(true, 0, 0, dst); emit(0xC1); direct(5, dst); emit(imm); }
+    void zero_eax() { emit(0x31); direct(rax, rax); }
+    void imul(reg_t dst, reg_t src) { rex(true, dst, 0, src); emit(0x0F); emit(0xAF); direct(dst, src); }
+    void cmp(reg_t lhs, reg_t rhs) { rex(true, rhs, 0, lhs); emit(0x39); direct(rhs, lhs); }
+    void cmp(reg_t lhs, reg_t base, int32_t disp) { rex(true, lhs, 0, base); emit(0x3B); mem(lhs, base, disp); }
+    void test(reg_t lhs, reg_t rhs) { rex(true, rhs, 0, lhs); emit(0x85); direct(rhs, lhs); }
+    void cmov(cond_t cond, reg_t dst, reg_t src) { rex(true, dst, 0, src); emit(0x0F); emit(0x40 | cond); direct(dst, src); }
+
+    // setcc al; movzx eax, al
+    void set(cond_t cond) { emit(0x0F); emit(0x90 | cond); direct(0, rax); emit(0x0F); emit(0xB6); direct(rax, rax); }
+
+    // Helpers return int, only eax is meaningful
+    void test_eax() { emit(0x85); direct(rax, rax); }
+    void cmp_eax(int8_t imm) { emit(0x83); direct(7, rax); emit(uint8_t(imm)); }
+
+    void add_mem(reg_t base, int32_t disp, int32_t imm) { rex(true, 0, 0, base); emit(0x81); mem(0, base, disp); emit32(imm); }
+    void mov_mem(reg_t base, int32_t disp, int32_t imm) { rex(true, 0, 0, base); emit(0xC7); mem(0, base, disp); emit32(imm); }
+
+    // cmp byte [base + disp32], 0 / cmp byte [base + index + disp32], 0
+    void cmp_byte_zero(reg_t base, int32_t disp) { rex(false, 0, 0, base); emit(0x80); mem(7, base, disp); emit(0); }
+    void cmp_byte_zero(reg_t base, reg_t index, int32_t disp) { rex(false, 0, index, base); emit(0x80); mem(7, base, index, 0, disp); emit(0); }
+
+    // Forward conditional jump, hand the result to bind() once the target is emitted
+    size_t jcc(cond_t cond) { emit(0x0F); emit(0x80 | cond); emit32(0); return bytes.size(); }
+    size_t jmp() { emit(0xE9); emit32(0); return bytes.size(); }
+    void bind(size_t fixup) {
+        int32_t rel = int32_t(bytes.size() - fixup);
+        std::memcpy(&bytes[fixup - 4], &rel, sizeof(rel));
+    }
+};
+
+// Called from translated code. Return values say whether the block must be left.
+
+// Also the slow path of every store: the page may not exist yet, so the page
+// table handed to translated code is refreshed. An address out of range leaves
+// the block with the error in state, exec_jit rethrows it.
+int jit_store(jit_state_t* state, size_t address, value_t value) {
+    program_t* program = state->program;
+    program->compiled->dirty = false;
+    try {
+        program->write(address, value);
+    } catch (...) {
+        state->error = std::current_exception();
+        return 1;
+    }
+
+    state->pages = program->ram.table.data();
+    state->writable = program->ram.writable.data();
+    state->page_count = program->ram.table.size();
+    return program->compiled->dirty;
+}
+
+// 0 if stalled, 1 if the input was stored, 2 if it was stored over translated code
+int jit_input(jit_state_t* state, size_t address) {
+    program_t* program = state->program;
+    if (program->inputs.empty())
+        return 0;
+
+    value_t input = program->inputs.front();
+    program->inputs.pop_front();
+    return 1 + jit_store(state, address, input);
+}
+
+void jit_output(jit_state_t* state, value_t value) {
+    state->program->outputs.push_back(value);
+}
+#endif
+
+jit_t::jit_t() {
+#ifdef ENABLE_JIT
+    void* memory = mmap(nullptr, code_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED)
+        throw std::runtime_error("unable to map code memory");
+
+    code = static_cast<uint8_t*>(memory);
+#endif
+}
+
+jit_t::~jit_t() {
+#ifdef ENABLE_JIT
+    munmap(code, code_size);
+#endif
+}
+
+void jit_t::invalidate(size_t address) {
+    size_t lookback = max_block_length * 4 - 1;
+    for (size_t i = address < lookback ? 0 : address - lookback; i <= address && i < blocks.size(); ++i) {
+        if (blocks[i].entry != nullptr && blocks[i].end > address) {
+            blocks[i].entry = nullptr;
+            dirty = true;
+        }
+    }
+}
+
+#ifdef ENABLE_JIT
+// Translates the straight-line run of instructions starting at eip, up to and
+// including the first jump. Stops early before anything it can't express:
+// halt, invalid words, operands outside of memory. Returns nullptr if not even
+// the first instruction could be translated.
+//
+// Register usage: rbx = jit_state_t*, r12 = page table, r13 = rel_base,
+// r14 = code_words, r15 = page table size. Memory accesses walk the page table
+// inline; stores that would allocate or copy a page or land on decoded code call back
+// into program_t::write() and leave the block if it dropped translated code,
+// the block itself included.
+jit_t::block_t const* jit_t::compile(program_t& program, size_t eip) {
+    using reg_t = x64_t::reg_t;
+
+    constexpr const size_t max_address = memory_t::max_pages * memory_t::page_size;
+    size_t start = eip;
+    size_t count = 0;
+    bool open = true;
+
+    x64_t x;
+    x.push(x64_t::rbx);
+    x.push(x64_t::r12);
+    x.push(x64_t::r13);
+    x.push(x64_t::r14);
+    x.push(x64_t::r15);
+    x.mov(x64_t::rbx, x64_t::rdi);
+    x.load(x64_t::r12, x64_t::rbx, offsetof(jit_state_t, pages));
+    x.load(x64_t::r13, x64_t::rbx, offsetof(jit_state_t, rel_base));
+    x.load(x64_t::r14, x64_t::rbx, offsetof(jit_state_t, code_words));
+    x.load(x64_t::r15, x64_t::rbx, offsetof(jit_state_t, page_count));
+
+    auto leave = [&]() {
+        x.store(x64_t::rbx, offsetof(jit_state_t, rel_base), x64_t::r13);
+        x.pop(x64_t::r15);
+        x.pop(x64_t::r14);
+        x.pop(x64_t::r13);
+        x.pop(x64_t::r12);
+        x.pop(x64_t::rbx);
+        x.ret();
+    };
+
+    auto exit_to = [&](size_t next, size_t executed) {
+        if (executed != 0)
+            x.add_mem(x64_t::rbx, offsetof(jit_state_t, executed), int32_t(executed));
+        x.mov(x64_t::rax, next);
+        leave();
+    };
+
+    // Helpers may have grown the page table
+    auto call = [&](void* helper) {
+        x.mov(x64_t::rdi, x64_t::rbx);
+        x.mov(x64_t::rax, reinterpret_cast<uint64_t>(helper));
+        x.call(x64_t::rax);
+        x.load(x64_t::r12, x64_t::rbx, offsetof(jit_state_t, pages));
+        x.load(x64_t::r15, x64_t::rbx, offsetof(jit_state_t, page_count));
+    };
+
+    auto can_translate = [&](instruction_t const& instr) {
+        if (instr.code == halt)
+            return false;
+
+        for (size_t i = 0; i + 1 < instr.length; ++i) {
+            value_t operand = instr.operands[i];
+            if (instr.parameter_mode[i] == position && (operand < 0 || size_t(operand) >= max_address))
+                return false;
+            if (instr.parameter_mode[i] == relative && (operand < -(1 << 27) || operand >= (1 << 27)))
+                return false;
+        }
+
+        return true;
+    };
+
+    // Leaves the address an operand points to in rsi
+    auto address = [&](instruction_t const& instr, size_t at, int32_t index) {
+        if (instr.parameter_mode[index] == relative)
+            x.lea(x64_t::rsi, x64_t::r13, int32_t(instr.operands[index]));
+        else if (instr.parameter_mode[index] == position)
+            x.mov(x64_t::rsi, uint64_t(instr.operands[index]));
+        else
+            x.mov(x64_t::rsi, at + 1 + index);
+    };
+
+    // Loads a parameter into dst (not rsi or rdi, those are scratch). Pages
+    // that don't exist read as 0. A fixed address on a page the table already
+    // covers skips the bounds check, the table never shrinks.
+    auto load = [&](reg_t dst, instruction_t const& instr, int32_t index) {
+        value_t operand = instr.operands[index];
+        if (instr.parameter_mode[index] == immediate) {
+            x.mov(dst, uint64_t(operand));
+            return;
+        }
+
+        size_t page_index = size_t(operand) >> memory_t::page_bits;
+        if (instr.parameter_mode[index] == position && page_index < program.ram.table.size()) {
+            x.load(x64_t::rdi, x64_t::r12, int32_t(page_index * sizeof(memory_t::page_t*)));
+            x.test(x64_t::rdi, x64_t::rdi);
+            size_t missing = x.jcc(x64_t::equal);
+            x.load(dst, x64_t::rdi, int32_t((size_t(operand) & memory_t::page_mask) * sizeof(value_t)));
+            size_t done = x.jmp();
+            x.bind(missing);
+            x.mov(dst, uint64_t(0));
+            x.bind(done);
+            return;
+        }
+
+        address(instr, 0, index);
+        x.mov(x64_t::rdi, x64_t::rsi);
+        x.shr(x64_t::rdi, memory_t::page_bits);
+        x.cmp(x64_t::rdi, x64_t::r15);
+        size_t outside = x.jcc(x64_t::above_equal);
+        x.load(x64_t::rdi, x64_t::r12, x64_t::rdi, 0);
+        x.test(x64_t::rdi, x64_t::rdi);
+        size_t missing = x.jcc(x64_t::equal);
+        x.and_(x64_t::rsi, memory_t::page_mask);
+        x.load(dst, x64_t::rdi, x64_t::rsi, 0);
+        size_t done = x.jmp();
+        x.bind(outside);
+        x.bind(missing);
+        x.mov(dst, uint64_t(0));
+        x.bind(done);
+    };
+
+    // Stores rax, executed counts this instruction
+    auto store = [&](instruction_t const& instr, size_t at, int32_t index, size_t next, size_t executed) {
+        address(instr, at, index);
+        x.cmp(x64_t::rsi, x64_t::rbx, offsetof(jit_state_t, code_word_count));
+        size_t data = x.jcc(x64_t::above_equal);
+        x.cmp_byte_zero(x64_t::r14, x64_t::rsi, 0);
+        size_t code = x.jcc(x64_t::not_equal);
+
+        x.bind(data);
+        x.mov(x64_t::rdi, x64_t::rsi);
+        x.shr(x64_t::rdi, memory_t::page_bits);
+        x.cmp(x64_t::rdi, x64_t::r15);
+        size_t outside = x.jcc(x64_t::above_equal);
+        x.load(x64_t::rdx, x64_t::rbx, offsetof(jit_state_t, writable));
+        x.load(x64_t::rdi, x64_t::rdx, x64_t::rdi, 0);
+        x.test(x64_t::rdi, x64_t::rdi);
+        size_t missing = x.jcc(x64_t::equal);
+        x.mov(x64_t::rdx, x64_t::rsi);
+        x.and_(x64_t::rdx, memory_t::page_mask);
+        x.store(x64_t::rdi, x64_t::rdx, 0, x64_t::rax);
+        size_t done = x.jmp();
+
+        x.bind(code);
+        x.bind(outside);
+        x.bind(missing);
+        x.mov(x64_t::rdx, x64_t::rax);
+        call(reinterpret_cast<void*>(&jit_store));
+        x.test_eax();
+        size_t unchanged = x.jcc(x64_t::equal);
+        exit_to(next, executed);
+
+        x.bind(done);
+        x.bind(unchanged);
+    };
+
+    while (open && count < max_block_length && is_valid_instruction(program.ram.read(eip))) {
+        instruction_t const instr = program.decode(eip);
+        if (!can_translate(instr))
+            break;
+
+        size_t next = eip + instr.length;
+        switch (instr.code) {
+        case add:
+        case multiply:
+        case less_than:
+        case equals:
+            load(x64_t::rax, instr, 0);
+            load(x64_t::rcx, instr, 1);
+            if (instr.code == add)
+                x.add(x64_t::rax, x64_t::rcx);
+            else if (instr.code == multiply)
+                x.imul(x64_t::rax, x64_t::rcx);
+            else {
+                x.cmp(x64_t::rax, x64_t::rcx);
+                x.set(instr.code == less_than ? x64_t::less : x64_t::equal);
+            }
+            store(instr, eip, 2, next, count + 1);
+            break;
+        case mod_rel_base:
+            load(x64_t::rax, instr, 0);
+            x.add(x64_t::r13, x64_t::rax);
+            break;
+        case write_output:
+            load(x64_t::rax, instr, 0);
+            x.mov(x64_t::rsi, x64_t::rax);
+            call(reinterpret_cast<void*>(&jit_output));
+            break;
+        case load_input:
+        {
+            address(instr, eip, 0);
+            call(reinterpret_cast<void*>(&jit_input));
+            x.test_eax();
+            size_t available = x.jcc(x64_t::not_equal);
+            x.mov_mem(x64_t::rbx, offsetof(jit_state_t, stalled), 1);
+            exit_to(eip, count);
+
+            x.bind(available);
+            x.cmp_eax(1);
+            size_t unchanged = x.jcc(x64_t::equal);
+            exit_to(next, count + 1);
+            x.bind(unchanged);
+            break;
+        }
+        case jump_if_true:
+        case jump_if_false:
+            load(x64_t::rcx, instr, 0);
+            load(x64_t::rdx, instr, 1);
+            x.mov(x64_t::rax, next);
+            x.test(x64_t::rcx, x64_t::rcx);
+            x.cmov(instr.code == jump_if_true ? x64_t::not_equal : x64_t::equal, x64_t::rax, x64_t::rdx);
+            x.add_mem(x64_t::rbx, offsetof(jit_state_t, executed), int32_t(count + 1));
+            leave();
+            open = false;
+            break;
+        default:
+            throw std::runtime_error("not implemented");
+        }
+
+        ++count;
+        eip = next;
+    }
+
+    if (count == 0)
+        return nullptr;
+
+    if (open)
+        exit_to(eip, count);
+
+    if (start >= blocks.size())
+        blocks.resize(start + 1);
+
+    if (code_used + x.bytes.size() > code_size) {
+        std::fill(blocks.begin(), blocks.end(), block_t{});
+        code_used = 0;
+    }
+
+    mprotect(code, code_size, PROT_READ | PROT_WRITE);
+    std::memcpy(code + code_used, x.bytes.data(), x.bytes.size());
+    mprotect(code, code_size, PROT_READ | PROT_EXEC);
+
+    block_t& block = blocks[start];
+    block.entry = reinterpret_cast<entry_t>(code + code_used);
+    block.end = eip;
+    block.instruction_count = count;
+
+    code_used = (code_used + x.bytes.size() + 15) & ~size_t(15);
+    return &block;
+}
+#endif
+
+// Runs translated blocks until the program halts, stalls, or the budget runs
+// out. Whatever has no block (halt, odd operands, budget smaller than the
+// block) goes through the threaded engine one instruction at a time.
+size_t program_t::exec_jit(size_t count) {
+#ifndef ENABLE_JIT
+    return exec_threaded(count);
+#else
+    if (halted)
+        return 0;
+
+    if (!compiled)
+        compiled = std::make_unique<jit_t>();
+
+    size_t eip = opc.eip;
+    size_t executed = 0;
+    size_t translated = 0;
+    jit_state_t state{ this, nullptr, nullptr, 0, nullptr, 0, rel_base, 0, 0 };
+
+    while (executed < count) {
+        jit_t::block_t const* block = nullptr;
+        if (eip < compiled->blocks.size() && compiled->blocks[eip].entry != nullptr)
+            block = &compiled->blocks[eip];
+        else
+            block = compiled->compile(*this, eip);
+
+        if (block == nullptr || block->instruction_count > count - executed) {
+            rel_base = state.rel_base;
+            opc = opcode_t(*this, eip);
+            size_t stepped = exec_threaded(1);
+            state.rel_base = rel_base;
+            eip = opc.eip;
+
+            executed += stepped;
+            if (stepped == 0 || halted)
+                break;
+
+            continue;
+        }
+
+        state.pages = ram.table.data();
+        state.writable = ram.writable.data();
+        state.page_count = ram.table.size();
+        state.code_words = code_words.data();
+        state.code_word_count = code_words.size();
+        state.executed = 0;
+        state.stalled = 0;
+        eip = block->entry(&state);
+
+        executed += state.executed;
+        translated += state.executed;
+        if (state.stalled || state.error)
+            break;
+    }
+
+    rel_base = state.rel_base;
+    instruction_count += translated;
+    if (state.error)
+        std::rethrow_exception(state.error);
+
+    opc = opcode_t(*this, eip);
+    return executed;
+#endif
+}
+
+std::string disassemble(instruction_t const& instr) {
+    const char* names[100] = {};
+    names[add] = "add";
+    names[multiply] = "mul";
+    names[load_input] = "in";
+    names[write_output] = "out";
+    names[jump_if_true] = "jnz";
+    names[jump_if_false] = "jz";
+    names[less_than] = "lt";
+    names[equals] = "eq";
+    names[mod_rel_base] = "arb";
+    names[halt] = "halt";
+
+    std::string text = names[instr.code];
+    for (size_t i = 0; i + 1 < instr.length; ++i) {
+        value_t operand = instr.operands[i];
+        text += i == 0 ? " " : ", ";
+        switch (instr.parameter_mode[i]) {
+        case position:
+            text += "[" + std::to_string(operand) + "]";
+            break;
+        case immediate:
+            text += std::to_string(operand);
+            break;
+        case relative:
+            text += "[rb" + std::string(operand < 0 ? "-" : "+") + std::to_string(operand < 0 ? -operand : operand) + "]";
+            break;
+        }
+    }
+
+    return text;
+}
+
+// Static view of an image: the instructions reachable from 0, the basic blocks
+// they make up and where control can go from each.
+//
+// Jump targets are followed when they are immediate, or read from a word no
+// reachable instruction ever stores to (only trusted if there are no relative
+// stores, those could land anywhere). Anything else is a computed jump, the
+// block just ends there. Return addresses pushed with the usual `add ret, 0, [rb+n]`
+// idiom count as entries so that code after calls is found.
+struct cfg_t {
+    struct block_t {
+        size_t begin;
+        size_t end; // Past the last word of the last instruction
+        std::vector<size_t> instructions; // By eip
+        std::vector<size_t> successors; // Entry eips
+        bool computed_jump = false;
+        bool halts = false;
+    };
+
+    cfg_t(value_t const* image, size_t size);
+
+    std::optional<instruction_t> read_instruction(size_t eip) const;
+    std::optional<size_t> store_address(size_t eip, instruction_t const& instr) const;
+    bool is_code(size_t address) const { return address < code_words.size() && code_words[address]; }
+
+    void disassemble(std::ostream& out) const;
+    void write_dot(std::ostream& out) const;
+
+    std::vector<value_t> image;
+    std::map<size_t, instruction_t> instructions; // Reachable ones, by eip
+    std::map<size_t, block_t> blocks; // By entry eip
+    std::vector<bool> code_words; // Covered by a reachable instruction
+    std::vector<bool> stored; // Some reachable instruction stores to it at a fixed address
+    std::vector<size_t> self_modifying; // Instructions storing to a fixed address that holds code
+    bool relative_stores = false;
+
+private:
+    // Where a jump may go, nullopt if it's computed
+    std::optional<size_t> jump_target(instruction_t const& instr) const;
+    // Code address pushed on the stack ahead of a call, `add ret, 0, [rb+n]`
+    std::optional<size_t> return_address(size_t eip, instruction_t const& instr) const;
+    void discover(std::set<size_t> const& untrusted);
+    void build_blocks();
+
+    std::set<size_t> trusted; // Words jump targets were read from
+};
+
+cfg_t::cfg_t(value_t const* image, size_t size)
+    : image(image, image + size)
+{
+    // Trusting a word can make more code reachable, which can store to a word
+    // already trusted. Start over without it until nothing changes.
+    std::set<size_t> untrusted;
+    for (;;) {
+        discover(untrusted);
+
+        size_t count = untrusted.size();
+        for (size_t address : trusted)
+            if (relative_stores || stored[address])
+                untrusted.insert(address);
+
+        if (untrusted.size() == count)
+            break;
+    }
+
+    for (auto&& [eip, instr] : instructions) {
+        std::optional<size_t> address = store_address(eip, instr);
+        if (address && is_code(*address))
+            self_modifying.push_back(eip);
+    }
+
+    build_blocks();
+}
+
+std::optional<instruction_t> cfg_t::read_instruction(size_t eip) const {
+    if (eip >= image.size() || !is_valid_instruction(image[eip]))
+        return std::nullopt;
+
+    instruction_t instr;
+    value_t eip_instr = image[eip];
+    instr.code = intcode(eip_instr - (eip_instr / 100) * 100);
+
+    size_t parameter_count = get_parameter_count(instr.code);
+    value_t parameter_modes = eip_instr / 100;
+    for (size_t i = 0; i < parameter_count; ++i) {
+        instr.parameter_mode[i] = operation_mode(parameter_modes - (parameter_modes / 10) * 10);
+        instr.operands[i] = eip + 1 + i < image.size() ? image[eip + 1 + i] : 0;
+
+        parameter_modes /= 10;
+    }
+
+    instr.length = parameter_count + 1;
+    return instr;
+}
+
+// Fixed address the instruction stores to, nullopt if it stores nothing or through rel_base
+std::optional<size_t> cfg_t::store_address(size_t eip, instruction_t const& instr) const {
+    size_t index;
+    switch (instr.code) {
+    case add: case multiply: case less_than: case equals:
+        index = 2;
+        break;
+    case load_input:
+        index = 0;
+        break;
+    default:
+        return std::nullopt;
+    }
+
+    switch (instr.parameter_mode[index]) {
+    case position:
+        return size_t(instr.operands[index]);
+    case immediate:
+        return eip + 1 + index;
+    default:
+        return std::nullopt;
+    }
+}
+
+std::optional<size_t> cfg_t::jump_target(instruction_t const& instr) const {
+    value_t operand = instr.operands[1];
+    switch (instr.parameter_mode[1]) {
+    case immediate:
+        return operand >= 0 ? std::optional<size_t>(size_t(operand)) : std::nullopt;
+    case position:
+        if (trusted.count(size_t(operand)) && size_t(operand) < image.size() && image[operand] >= 0)
+            return size_t(image[operand]);
+        return std::nullopt;
+    default:
+        return std::nullopt;
+    }
+}
+
+std::optional<size_t> cfg_t::return_address(size_t eip, instruction_t const& instr) const {
+    bool push = instr.code == add && instr.parameter_mode[0] == immediate && instr.parameter_mode[1] == immediate
+        && instr.operands[1] == 0 && instr.parameter_mode[2] == relative;
+    if (push && instr.operands[0] > value_t(eip) && size_t(instr.operands[0]) < image.size())
+        return size_t(instr.operands[0]);
+    return std::nullopt;
+}
+
+void cfg_t::discover(std::set<size_t> const& untrusted) {
+    instructions.clear();
+    trusted.clear();
+
+    std::vector<size_t> pending{ 0 };
+    while (!pending.empty()) {
+        size_t eip = pending.back();
+        pending.pop_back();
+
+        std::optional<instruction_t> instr = instructions.count(eip) ? std::nullopt : read_instruction(eip);
+        if (!instr)
+            continue;
+
+        instructions[eip] = *instr;
+        if (instr->code == halt)
+            continue;
+
+        if (instr->code == jump_if_true || instr->code == jump_if_false) {
+            if (instr->parameter_mode[1] == position && !untrusted.count(size_t(instr->operands[1])))
+                trusted.insert(size_t(instr->operands[1]));
+
+            if (std::optional<size_t> target = jump_target(*instr))
+                pending.push_back(*target);
+
+            // A constant condition only ever goes one way
+            bool constant = instr->parameter_mode[0] == immediate;
+            bool taken = (instr->operands[0] != 0) == (instr->code == jump_if_true);
+            if (constant && taken)
+                continue;
+        }
+
+        if (std::optional<size_t> entry = return_address(eip, *instr))
+            pending.push_back(*entry);
+
+        pending.push_back(eip + instr->length);
+    }
+
+    code_words.assign(image.size(), false);
+    stored.assign(image.size(), false);
+    relative_stores = false;
+    for (auto&& [eip, instr] : instructions) {
+        for (size_t i = eip; i < eip + instr.length && i < image.size(); ++i)
+            code_words[i] = true;
+
+        std::optional<size_t> address = store_address(eip, instr);
+        if (address && *address < stored.size())
+            stored[*address] = true;
+
+        size_t last = get_parameter_count(instr.code) - 1;
+        bool writes = instr.code == add || instr.code == multiply || instr.code == less_than || instr.code == equals || instr.code == load_input;
+        if (writes && instr.parameter_mode[last] == relative)
+            relative_stores = true;
+    }
+}
+
+void cfg_t::build_blocks() {
+    // Blocks start at 0, every jump target or other entry and after every jump
+    std::set<size_t> leaders{ 0 };
+    for (auto&& [eip, instr] : instructions) {
+        if (instr.code == jump_if_true || instr.code == jump_if_false) {
+            if (std::optional<size_t> target = jump_target(instr))
+                leaders.insert(*target);
+            leaders.insert(eip + instr.length);
+        }
+        else if (std::optional<size_t> entry = return_address(eip, instr)) {
+            leaders.insert(*entry);
+        }
+    }
+
+    for (size_t leader : leaders) {
+        auto it = instructions.find(leader);
+        if (it == instructions.end())
+            continue;
+
+        block_t& block = blocks[leader];
+        block.begin = leader;
+
+        size_t eip = leader;
+        for (;;) {
+            instruction_t const& instr = instructions.at(eip);
+            block.instructions.push_back(eip);
+            block.end = eip + instr.length;
+
+            if (instr.code == halt) {
+                block.halts = true;
+                break;
+            }
+
+            if (instr.code == jump_if_true || instr.code == jump_if_false) {
+                std::optional<size_t> target = jump_target(instr);
+                bool constant = instr.parameter_mode[0] == immediate;
+                bool taken = (instr.operands[0] != 0) == (instr.code == jump_if_true);
+
+                if (!constant || taken) {
+                    if (target)
+                        block.successors.push_back(*target);
+                    else
+                        block.computed_jump = true;
+                }
+
+                if (!constant || !taken)
+                    block.successors.push_back(block.end);
+                break;
+            }
+
+            if (leaders.count(block.end) || !instructions.count(block.end)) {
+                if (instructions.count(block.end))
+                    block.successors.push_back(block.end);
+                break;
+            }
+
+            eip = block.end;
+        }
+    }
+}
+
+void cfg_t::disassemble(std::ostream& out) const {
+    for (auto&& [entry, block] : blocks) {
+        out << "block_" << entry << ":";
+        if (block.computed_jump)
+            out << " (computed jump)";
+        out << std::endl;
+
+        for (size_t eip : block.instructions) {
+            bool patches = std::find(self_modifying.begin(), self_modifying.end(), eip) != self_modifying.end();
+            out << std::setw(8) << eip << "  " << ::disassemble(instructions.at(eip)) << (patches ? "    ; writes code" : "") << std::endl;
+        }
+
+        for (size_t successor : block.successors)
+            out << "    -> block_" << successor << std::endl;
+    }
+}
+
+// Graphviz, blocks holding self-modifying stores are red and computed jumps go to a "?" node.
+void cfg_t::write_dot(std::ostream& out) const {
+    out << "digraph intcode {" << std::endl;
+    out << "    node [shape=box, fontname=\"monospace\"];" << std::endl;
+
+    bool computed = false;
+    for (auto&& [entry, block] : blocks) {
+        bool patches = false;
+        out << "    b" << entry << " [label=\"";
+        for (size_t eip : block.instructions) {
+            out << eip << ": " << ::disassemble(instructions.at(eip)) << "\\l";
+            patches = patches || std::find(self_modifying.begin(), self_modifying.end(), eip) != self_modifying.end();
+        }
+        out << "\"" << (patches ? ", color=red" : "") << "];" << std::endl;
+
+        for (size_t successor : block.successors)
+            out << "    b" << entry << " -> b" << successor << ";" << std::endl;
+
+        if (block.computed_jump) {
+            out << "    b" << entry << " -> computed [style=dashed];" << std::endl;
+            computed = true;
+        }
+    }
+
+    if (computed)
+        out << "    computed [label=\"?\", shape=circle];" << std::endl;
+    out << "}" << std::endl;
+}
+
+// What optimize() did to an image
+struct optimized_t {
+    std::vector<value_t> image;
+    bool applied = false; // Left as it was if the program writes or reads its own code
+    size_t direct_operands = 0; // Position operands replaced by the constant they read
+    size_t folded_jumps = 0; // Jumps whose condition or compare got folded away
+    size_t removed = 0; // Instructions dropped from the blocks
+};
+
+// Operands the instruction reads, they come first, then the one it stores to if any
+size_t get_read_count(intcode code) {
+    switch (code) {
+    case add: case multiply: case less_than: case equals:
+    case jump_if_true: case jump_if_false:
+        return 2;
+    case write_output: case mod_rel_base:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+value_t encode(instruction_t const& instr) {
+    value_t word = instr.code;
+    for (size_t i = 0, scale = 100; i + 1 < instr.length; ++i, scale *= 10)
+        word += value_t(instr.parameter_mode[i]) * scale;
+    return word;
+}
+
+// Rewrites an image into one that does the same thing in fewer instructions on
+// the same interpreter. Per basic block of cfg_t:
+//  - position operands reading a word nothing stores to, or one the block already
+//    stored a known value to, become immediates
+//  - jumps whose condition is then known are dropped or made unconditional, and
+//    `eq x, 0, [t]` followed by a jump on t becomes a jump on x
+//  - stores nothing reads, or that the block overwrites before reading, go away
+//  - the block is packed at its entry, with a jump to where it used to end if
+//    control could fall through it, when that leaves fewer instructions
+//
+// Removing stores and the `eq` fold need every read counted by address, so
+// they're off when the program reads anything through rb or jumps to computed
+// addresses: then any stored word may be read.
+//
+// Only outputs are kept, not what the program leaves in memory. Block entries
+// don't move, computed jumps are assumed to land on entries cfg_t knows about
+// and rb-relative accesses to stay past the image, which is how programs use
+// their stack. Values the block stored are forgotten at every rb-relative store,
+// it may have landed on them. Anything storing to or reading from its own code
+// at a fixed address is left alone.
+optimized_t optimize(value_t const* image, size_t size) {
+    optimized_t result;
+    result.image.assign(image, image + size);
+
+    cfg_t cfg(image, size);
+    if (!cfg.self_modifying.empty())
+        return result;
+
+    size_t end = 0;
+    bool indirect_reads = false; // Through rb or a computed jump, reads can't be counted by address
+    for (auto&& [eip, instr] : cfg.instructions) {
+        if (eip < end)
+            return result; // Overlapping instructions, can't tell code apart
+
+        end = eip + instr.length;
+        for (size_t i = 0; i < get_read_count(instr.code); ++i) {
+            if (instr.parameter_mode[i] == position && cfg.is_code(size_t(instr.operands[i])))
+                return result;
+            if (instr.parameter_mode[i] == relative)
+                indirect_reads = true;
+        }
+    }
+
+    for (auto&& [entry, block] : cfg.blocks)
+        if (block.computed_jump)
+            indirect_reads = true;
+
+    result.applied = true;
+
+    struct slot_t {
+        size_t eip;
+        instruction_t instr;
+        bool removed = false;
+    };
+
+    std::map<size_t, std::vector<slot_t>> bodies;
+    for (auto&& [entry, block] : cfg.blocks) {
+        std::vector<slot_t>& body = bodies[entry];
+        std::unordered_map<size_t, value_t> known; // Stored by this block so far
+
+        for (size_t eip : block.instructions) {
+            slot_t slot{ eip, cfg.instructions.at(eip) };
+            instruction_t& instr = slot.instr;
+            bool constant_condition = instr.parameter_mode[0] == immediate;
+
+            for (size_t i = 0; i < get_read_count(instr.code); ++i) {
+                if (instr.parameter_mode[i] != position)
+                    continue;
+
+                size_t address = size_t(instr.operands[i]);
+                if (auto it = known.find(address); it != known.end())
+                    instr.operands[i] = it->second;
+                else if (address < size && !cfg.stored[address])
+                    instr.operands[i] = image[address];
+                else
+                    continue;
+
+                instr.parameter_mode[i] = immediate;
+                ++result.direct_operands;
+            }
+
+            size_t read_count = get_read_count(instr.code);
+            bool stores = instr.code == add || instr.code == multiply || instr.code == less_than || instr.code == equals || instr.code == load_input;
+            if (stores && instr.parameter_mode[read_count] == relative)
+                known.clear();
+            if (stores && instr.parameter_mode[read_count] == position) {
+                size_t address = size_t(instr.operands[read_count]);
+                value_t a = instr.operands[0], b = instr.operands[1];
+                if (instr.code != load_input && instr.parameter_mode[0] == immediate && instr.parameter_mode[1] == immediate) {
+                    switch (instr.code) {
+                    case add: known[address] = a + b; break;
+                    case multiply: known[address] = a * b; break;
+                    case less_than: known[address] = a < b; break;
+                    default: known[address] = a == b; break;
+                    }
+                }
+                else {
+                    known.erase(address);
+                }
+            }
+
+            if ((instr.code == jump_if_true || instr.code == jump_if_false) && instr.parameter_mode[0] == immediate) {
+                if (!constant_condition)
+                    ++result.folded_jumps;
+
+                bool taken = (instr.operands[0] != 0) == (instr.code == jump_if_true);
+                slot.removed = !taken;
+            }
+
+            body.push_back(slot);
+        }
+    }
+
+    // Dropping a store can leave others with nobody reading them, go until nothing changes
+    for (bool changed = true; changed; ) {
+        changed = false;
+
+        std::unordered_map<size_t, size_t> reads;
+        for (auto&& [entry, body] : bodies)
+            for (slot_t const& slot : body)
+                for (size_t i = 0; !slot.removed && i < get_read_count(slot.instr.code); ++i)
+                    if (slot.instr.parameter_mode[i] == position)
+                        ++reads[size_t(slot.instr.operands[i])];
+
+        for (auto&& [entry, body] : bodies) {
+            // eq x, 0, [t] + jump on [t], when the jump is all that reads t
+            for (size_t i = 0; i + 1 < body.size(); ++i) {
+                instruction_t& compare = body[i].instr;
+                instruction_t& jump = body[i + 1].instr;
+                if (body[i].removed || body[i + 1].removed || compare.code != equals || compare.parameter_mode[2] != position)
+                    continue;
+                if ((jump.code != jump_if_true && jump.code != jump_if_false) || jump.parameter_mode[0] != position || jump.operands[0] != compare.operands[2])
+                    continue;
+                if (indirect_reads || reads[size_t(compare.operands[2])] != 1)
+                    continue;
+
+                size_t zero = compare.parameter_mode[1] == immediate && compare.operands[1] == 0 ? 1 : 0;
+                if (compare.parameter_mode[zero] != immediate || compare.operands[zero] != 0)
+                    continue;
+
+                jump.code = jump.code == jump_if_true ? jump_if_false : jump_if_true;
+                jump.parameter_mode[0] = compare.parameter_mode[1 - zero];
+                jump.operands[0] = compare.operands[1 - zero];
+                body[i].removed = true;
+                ++result.folded_jumps;
+                changed = true;
+            }
+
+            // Backwards, remembering what gets stored again before anything reads it
+            std::set<size_t> overwritten;
+            for (auto slot = body.rbegin(); slot != body.rend(); ++slot) {
+                if (slot->removed)
+                    continue;
+
+                instruction_t const& instr = slot->instr;
+                size_t read_count = get_read_count(instr.code);
+                bool stores = instr.code == add || instr.code == multiply || instr.code == less_than || instr.code == equals || instr.code == load_input;
+                if (stores && instr.parameter_mode[read_count] == position) {
+                    size_t address = size_t(instr.operands[read_count]);
+                    if (instr.code != load_input && !indirect_reads && (overwritten.count(address) || reads[address] == 0)) {
+                        slot->removed = true;
+                        changed = true;
+                        continue;
+                    }
+
+                    overwritten.insert(address);
+                }
+
+                for (size_t i = 0; i < read_count; ++i)
+                    if (instr.parameter_mode[i] == position)
+                        overwritten.erase(size_t(instr.operands[i]));
+            }
+        }
+    }
+
+    for (auto&& [entry, body] : bodies) {
+        cfg_t::block_t const& block = cfg.blocks.at(entry);
+
+        std::vector<value_t> packed;
+        size_t removed = 0;
+        instruction_t const* last = nullptr;
+        for (slot_t const& slot : body) {
+            if (slot.removed) {
+                ++removed;
+                continue;
+            }
+
+            packed.push_back(encode(slot.instr));
+            packed.insert(packed.end(), slot.instr.operands.begin(), slot.instr.operands.begin() + slot.instr.length - 1);
+            last = &slot.instr;
+        }
+
+        // Unless it ends on halt or a jump that's always taken, control carries on at block.end
+        bool ends = last && (last->code == halt
+            || ((last->code == jump_if_true || last->code == jump_if_false) && last->parameter_mode[0] == immediate));
+        if (!ends)
+            packed.insert(packed.end(), { 1105, 1, value_t(block.end) });
+
+        if (removed <= (ends ? 0 : 1) || packed.size() > block.end - block.begin) {
+            // Not worth it, everything stays where it was
+            for (slot_t const& slot : body) {
+                result.image[slot.eip] = encode(slot.instr);
+                std::copy(slot.instr.operands.begin(), slot.instr.operands.begin() + slot.instr.length - 1, result.image.begin() + slot.eip + 1);
+            }
+            continue;
+        }
+
+        std::copy(packed.begin(), packed.end(), result.image.begin() + block.begin);
+        std::fill(result.image.begin() + block.begin + packed.size(), result.image.begin() + block.end, 0);
+        result.removed += removed - (ends ? 0 : 1);
+    }
+
+    return result;
+}
+
+// Comma-separated intcode straight from a stream into memory_t pages, without
+// going through strings. Input is read in large chunks, 16 bytes at a time are
+// classified with SSE2 (or a plain loop elsewhere) to reject stray characters,
+// digit runs are found the same way and converted eight digits at a time with
+// SWAR arithmetic. Like 09_pack, one ',' after the last number is fine, an
+// empty field anywhere else isn't.
+struct csv_loader_t {
+    constexpr const static size_t chunk_size = 1 << 20;
+    constexpr const static size_t padding = 64; // Readable zeros past the data, for the wide loads
+    constexpr const static size_t max_digits = 19;
+
+    explicit csv_loader_t(std::istream& in) : in(in), buffer(chunk_size + padding) { }
+
+    // Returns the number of words written to ram from address 0
+    size_t load(memory_t& ram);
+
+private:
+    [[noreturn]] void fail(size_t pos, const char* what) const {
+        throw std::runtime_error("malformed intcode at byte " + std::to_string(base + pos) + ": " + what);
+    }
+
+    void validate(size_t begin, size_t end) const;
+    size_t digit_run(size_t pos) const;
+    static uint64_t parse_eight(uint64_t digits);
+    uint64_t load_eight(size_t pos) const;
+    uint64_t parse_digits(size_t pos, size_t count) const;
+
+    std::istream& in;
+    std::vector<char> buffer;
+    size_t base = 0; // Stream offset of buffer[0]
+};
+
+// Every byte has to be a digit, '-', ',' or whitespace
+void csv_loader_t::validate(size_t begin, size_t end) const {
+    size_t pos = begin;
+#ifdef __SSE2__
+    const __m128i zero = _mm_set1_epi8('0' - 1), nine = _mm_set1_epi8('9' + 1);
+    const __m128i comma = _mm_set1_epi8(','), minus = _mm_set1_epi8('-'), space = _mm_set1_epi8(' ');
+    const __m128i tab = _mm_set1_epi8('\t'), newline = _mm_set1_epi8('\n'), carriage = _mm_set1_epi8('\r');
+    for (; pos + 16 <= end; pos += 16) {
+        __m128i bytes = _mm_loadu_si128(reinterpret_cast<__m128i const*>(buffer.data() + pos));
+        __m128i valid = _mm_and_si128(_mm_cmpgt_epi8(bytes, zero), _mm_cmplt_epi8(bytes, nine));
+        valid = _mm_or_si128(valid, _mm_or_si128(_mm_cmpeq_epi8(bytes, comma), _mm_cmpeq_epi8(bytes, minus)));
+        valid = _mm_or_si128(valid, _mm_or_si128(_mm_cmpeq_epi8(bytes, space), _mm_cmpeq_epi8(bytes, tab)));
+        valid = _mm_or_si128(valid, _mm_or_si128(_mm_cmpeq_epi8(bytes, newline), _mm_cmpeq_epi8(bytes, carriage)));
+
+        unsigned invalid = ~unsigned(_mm_movemask_epi8(valid)) & 0xffff;
+        if (invalid != 0)
+            fail(pos + __builtin_ctz(invalid), "unexpected character");
+    }
+#endif
+
+    for (; pos < end; ++pos) {
+        char c = buffer[pos];
+        if (!(c >= '0' && c <= '9') && c != ',' && c != '-' && c != ' ' && c != '\t' && c != '\n' && c != '\r')
+            fail(pos, "unexpected character");
+    }
+}
+
+// Length of the run of digits at pos, stops at the zero padding at the latest
+size_t csv_loader_t::digit_run(size_t pos) const {
+    size_t length = 0;
+#ifdef __SSE2__
+    const __m128i zero = _mm_set1_epi8('0' - 1), nine = _mm_set1_epi8('9' + 1);
+    for (;; length += 16) {
+        __m128i bytes = _mm_loadu_si128(reinterpret_cast<__m128i const*>(buffer.data() + pos + length));
+        unsigned digits = unsigned(_mm_movemask_epi8(_mm_and_si128(_mm_cmpgt_epi8(bytes, zero), _mm_cmplt_epi8(bytes, nine))));
+        if (digits != 0xffff)
+            return length + __builtin_ctz(~digits);
+    }
+#else
+    while (buffer[pos + length] >= '0' && buffer[pos + length] <= '9')
+        ++length;
+    return length;
+#endif
+}
+
+// Eight ASCII digits, most significant first, to their value. The first digit
+// is the lowest byte of a little-endian load: pairs, then quads, then the whole
+// thing get combined with one multiply each. Zero bytes count as leading zeros.
+uint64_t csv_loader_t::parse_eight(uint64_t digits) {
+    digits = ((digits & 0x0f0f0f0f0f0f0f0f) * 2561) >> 8;
+    digits = ((digits & 0x00ff00ff00ff00ff) * 6553601) >> 16;
+    return ((digits & 0x0000ffff0000ffff) * 42949672960001) >> 32;
+}
+
+uint64_t csv_loader_t::load_eight(size_t pos) const {
+    uint64_t bytes;
+    std::memcpy(&bytes, buffer.data() + pos, sizeof(bytes));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    bytes = __builtin_bswap64(bytes);
+#endif
+    return bytes;
+}
+
+// count <= max_digits, so it fits in 64 bits unsigned
+uint64_t csv_loader_t::parse_digits(size_t pos, size_t count) const {
+    // The leading count % 8 digits first, shifting whatever follows them out
+    // of the load. The padding keeps the load in bounds.
+    size_t head = count % 8;
+    uint64_t value = head ? parse_eight(load_eight(pos) << (8 * (8 - head))) : 0;
+
+    for (pos += head, count -= head; count != 0; pos += 8, count -= 8)
+        value = value * 100000000 + parse_eight(load_eight(pos));
+
+    return value;
+}
+
+size_t csv_loader_t::load(memory_t& ram) {
+    size_t words = 0;
+    size_t filled = 0; // Bytes in buffer, a partial number carried over from the last chunk first
+    bool need_value = true; // At the start or after a comma
+    bool eof = false;
+
+    while (!eof) {
+        in.read(buffer.data() + filled, std::streamsize(chunk_size - filled));
+        size_t read = size_t(in.gcount());
+        eof = read < chunk_size - filled;
+        validate(filled, filled + read);
+        filled += read;
+        std::fill_n(buffer.begin() + filled, padding, 0);
+
+        // Only go up to the last separator, unless there's nothing more to come
+        size_t limit = filled;
+        if (!eof) {
+            while (limit > 0 && buffer[limit - 1] != ',' && buffer[limit - 1] != ' ' && buffer[limit - 1] != '\t' && buffer[limit - 1] != '\n' && buffer[limit - 1] != '\r')
+                --limit;
+            if (limit == 0)
+                fail(0, "number too long");
+        }
+
+        size_t pos = 0;
+        for (;;) {
+            while (pos < limit && (buffer[pos] == ' ' || buffer[pos] == '\t' || buffer[pos] == '\n' || buffer[pos] == '\r'))
+                ++pos;
+            if (pos >= limit)
+                break;
+
+            if (!need_value) {
+                if (buffer[pos] != ',')
+                    fail(pos, "expected ','");
+                ++pos;
+                need_value = true;
+                continue;
+            }
+
+            bool negative = buffer[pos] == '-';
+            size_t digits = pos + negative;
+            size_t length = digit_run(digits);
+            if (length == 0)
+                fail(pos, "expected a number");
+            if (length > max_digits)
+                fail(pos, "number out of range");
+
+            uint64_t magnitude = parse_digits(digits, length);
+            if (magnitude > uint64_t(std::numeric_limits<value_t>::max()) + negative)
+                fail(pos, "number out of range");
+
+            ram.write(words++, negative ? value_t(0 - magnitude) : value_t(magnitude));
+            pos = digits + length;
+            need_value = false;
+        }
+
+        std::memmove(buffer.data(), buffer.data() + limit, filled - limit);
+        base += limit;
+        filled -= limit;
+    }
+
+    // need_value is left set by a trailing ',', which is fine
+    return words;
+}
+
+// A program straight from comma-separated text, see csv_loader_t
+program_t read_program(std::istream& in) {
+    memory_t ram;
+    size_t size = csv_loader_t(in).load(ram);
+    if (size == 0)
+        throw std::runtime_error("empty program");
+
+    return program_t{ std::move(ram), size };
+}
+
+// Runs many programs on a few worker threads. Each turn a program gets a slice
+// of at most slice instructions, then goes to the back of the queue. Programs
+// waiting on input are parked off the queue until send() gives them some.
+// Whatever they output goes to on_output after every slice, on the worker
+// that ran it, which is where networked programs route packets to each other.
+//
+// All workers share one queue behind a mutex: a slice is tens of microseconds,
+// so taking a lock per slice is noise, and a shared queue balances by itself.
+struct scheduler_t {
+    using output_t = std::function<void(scheduler_t&, size_t id, std::vector<value_t>& outputs)>;
+    using steady_clock = std::chrono::steady_clock;
+
+    explicit scheduler_t(size_t worker_count = std::thread::hardware_concurrency(), size_t slice = 10000)
+        : worker_count(std::max<size_t>(1, worker_count)), slice(slice) { }
+
+    // Not while run() is going. Takes a fork of program, returns its id.
+    size_t add(program_t const& program);
+
+    // Safe from anywhere, on_output included. Wakes the program if it was parked.
+    void send(size_t id, value_t value);
+    void send(size_t id, std::initializer_list<value_t> values);
+
+    // Until every program halted or is parked with nobody left running to
+    // send it anything. Rethrows the first program that failed, once all stopped.
+    void run();
+
+    program_t& program(size_t id) { return vms[id]->program; }
+    void report(std::ostream& out) const;
+
+    output_t on_output; // Outputs stay in the program without one
+
+private:
+    enum state_t { runnable, running, parked, stopped };
+
+    struct vm_t {
+        explicit vm_t(program_t const& program) : program(program.snapshot()) { }
+
+        program_t program;
+        std::mutex mutex; // Guards state and pending, program belongs to whoever runs it
+        state_t state = runnable;
+        std::deque<value_t> pending; // Sent while it was running
+
+        size_t instructions = 0;
+        size_t slices = 0;
+        size_t parks = 0;
+        steady_clock::duration busy{ 0 };
+        std::exception_ptr error;
+    };
+
+    void enqueue(size_t id);
+    void work();
+    void run_slice(size_t id);
+
+    size_t worker_count;
+    size_t slice;
+    std::vector<std::unique_ptr<vm_t>> vms;
+
+    std::mutex queue_mutex;
+    std::condition_variable queue_ready;
+    std::deque<size_t> queue;
+    size_t active = 0; // Slices being run right now
+
+    steady_clock::duration wall{ 0 };
+};
+
+size_t scheduler_t::add(program_t const& program) {
+    vms.push_back(std::make_unique<vm_t>(program));
+    vm_t& vm = *vms.back();
+    if (vm.program.halted)
+        vm.state = stopped;
+    else if (vm.program.needs_input())
+        vm.state = parked;
+    else
+        queue.push_back(vms.size() - 1);
+
+    return vms.size() - 1;
+}
+
+void scheduler_t::send(size_t id, value_t value) {
+    send(id, { value });
+}
+
+void scheduler_t::send(size_t id, std::initializer_list<value_t> values) {
+    vm_t& vm = *vms[id];
+    std::lock_guard<std::mutex> lock(vm.mutex);
+    vm.pending.insert(vm.pending.end(), values);
+    if (vm.state == parked) {
+        vm.state = runnable;
+        enqueue(id);
+    }
+}
+
+void scheduler_t::enqueue(size_t id) {
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        queue.push_back(id);
+    }
+    queue_ready.notify_one();
+}
+
+void scheduler_t::run() {
+    auto start = steady_clock::now();
+
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < worker_count; ++i)
+        workers.emplace_back([this]() { work(); });
+
+    for (auto&& worker : workers)
+        worker.join();
+
+    wall += steady_clock::now() - start;
+
+    for (auto&& vm : vms)
+        if (vm->error)
+            std::rethrow_exception(vm->error);
+}
+
+void scheduler_t::work() {
+    for (;;) {
+        size_t id;
+        {
+            std::unique_lock<std::mutex> lock(queue_mutex);
+            queue_ready.wait(lock, [this]() { return !queue.empty() || active == 0; });
+            if (queue.empty())
+                break; // Nothing queued and nobody running who could queue something
+
+            id = queue.front();
+            queue.pop_front();
+            ++active;
+        }
+
+        run_slice(id);
+
+        bool idle;
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            idle = --active == 0 && queue.empty();
+        }
+
+        if (idle)
+            queue_ready.notify_all();
+    }
+}
+
+void scheduler_t::run_slice(size_t id) {
+    vm_t& vm = *vms[id];
+    {
+        std::lock_guard<std::mutex> lock(vm.mutex);
+        vm.state = running;
+        vm.program.inputs.insert(vm.program.inputs.end(), vm.pending.begin(), vm.pending.end());
+        vm.pending.clear();
+    }
+
+    auto start = steady_clock::now();
+    try {
+        vm.instructions += vm.program.step(slice);
+    }
+    catch (...) {
+        vm.error = std::current_exception();
+    }
+    vm.busy += steady_clock::now() - start;
+    ++vm.slices;
+
+    if (!vm.error && on_output && !vm.program.outputs.empty()) {
+        try {
+            on_output(*this, id, vm.program.outputs);
+        }
+        catch (...) {
+            vm.error = std::current_exception();
+        }
+        vm.program.outputs.clear();
+    }
+
+    std::lock_guard<std::mutex> lock(vm.mutex);
+    vm.program.inputs.insert(vm.program.inputs.end(), vm.pending.begin(), vm.pending.end());
+    vm.pending.clear();
+
+    if (vm.error || vm.program.halted) {
+        vm.state = stopped;
+    }
+    else if (vm.program.needs_input()) {
+        vm.state = parked;
+        ++vm.parks;
+    }
+    else {
+        vm.state = runnable;
+        enqueue(id);
+    }
+}
+
+// Per program, then overall. Per program rates are over the time it actually ran.
+void scheduler_t::report(std::ostream& out) const {
+    auto rate = [](size_t instructions, steady_clock::duration elapsed) {
+        return instructions / std::max(std::chrono::duration<double>(elapsed).count(), 1e-9);
+    };
+
+    const char* states[] = { "runnable", "running", "parked", "stopped" };
+
+    size_t total = 0;
+    for (size_t id = 0; id < vms.size(); ++id) {
+        vm_t const& vm = *vms[id];
+        total += vm.instructions;
+        out << "  vm " << std::setw(4) << id << ": " << std::setw(12) << vm.instructions << " instructions in "
+            << std::setw(6) << vm.slices << " slices, parked " << std::setw(6) << vm.parks << " times, "
+            << std::setw(8) << std::fixed << std::setprecision(2) << rate(vm.instructions, vm.busy) / 1e6 << " M/s, "
+            << (vm.program.halted ? "halted" : states[vm.state]) << std::endl;
+    }
+
+    out << vms.size() << " programs on " << worker_count << " workers: " << total << " instructions in "
+        << std::fixed << std::setprecision(2) << std::chrono::duration<double, std::milli>(wall).count() << " ms, "
+        << rate(total, wall) / 1e6 << " M/s" << std::endl;
+}
+
+program_t make_program(value_t* program, size_t count) {
+    return program_t{ program, count };
+};
+
+template <size_t N>
+program_t make_program(value_t(&program)[N]) {
+    return program_t{ program, N };
+}
+
+program_t make_program(image_t const& image, bool optimized = false) {
+    return program_t{ image.memory(optimized), optimized ? image.optimized_count : image.word_count };
+}
+
+// Synthetic programs for the benchmark suite, each reads its size first.
+namespace corpus {
+    // Outputs how many primes there are below n. The flags live past the image, reached through rb.
+    value_t sieve[] = {
+        3, 88, 1101, 2, 0, 89, 7, 89, 88, 90, 1006, 90, 85, 101, 97, 89, 91, 1002, 92, -1, 93, 1, 91, 93, 94, 9, 94, 1001, 91, 0, 92,
+        1205, 0, 78, 1001, 96, 1, 96, 2, 89, 89, 95, 7, 95, 88, 90, 1006, 90, 78, 101, 97, 95, 91, 1002, 92, -1, 93, 1, 91, 93, 94,
+        9, 94, 1001, 91, 0, 92, 21101, 1, 0, 0, 1, 95, 89, 95, 1105, 1, 42, 1001, 89, 1, 89, 1105, 1, 6, 4, 96, 99,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+    };
+
+    // Insertion sort of 37 * i mod n for i below n (n not a multiple of 37), outputs the sum of i * a[i].
+    value_t sort[] = {
+        3, 202, 1101, 0, 0, 203, 1101, 0, 0, 205, 7, 203, 202, 206, 1006, 206, 68, 101, 215, 203, 207, 1002, 208, -1, 209, 1, 207,
+        209, 211, 9, 211, 1001, 207, 0, 208, 21001, 205, 0, 0, 1001, 205, 37, 205, 7, 205, 202, 206, 1005, 206, 61, 1002, 202, -1,
+        210, 1, 205, 210, 205, 1105, 1, 43, 1001, 203, 1, 203, 1105, 1, 10, 1101, 1, 0, 203, 7, 203, 202, 206, 1006, 206, 151, 101,
+        215, 203, 207, 1001, 207, -1, 207, 1002, 208, -1, 209, 1, 207, 209, 211, 9, 211, 1001, 207, 0, 208, 1201, 1, 0, 212, 1001,
+        203, -1, 204, 1007, 204, 0, 206, 1005, 206, 140, 2007, 212, 0, 206, 1006, 206, 140, 21201, 0, 0, 1, 1001, 204, -1, 204, 109,
+        -1, 1001, 208, -1, 208, 1105, 1, 109, 21001, 212, 0, 1, 1001, 203, 1, 203, 1105, 1, 72, 1101, 0, 0, 203, 1101, 0, 0, 214, 7,
+        203, 202, 206, 1006, 206, 199, 101, 215, 203, 207, 1002, 208, -1, 209, 1, 207, 209, 211, 9, 211, 1001, 207, 0, 208, 2002,
+        203, 0, 213, 1, 214, 213, 214, 1001, 203, 1, 203, 1105, 1, 159, 4, 214, 99,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+    };
+
+    // Outputs the sum of i * j + k for i, j and k below n.
+    value_t nested[] = {
+        3, 71, 1101, 0, 0, 72, 7, 72, 71, 75, 1006, 75, 68, 1101, 0, 0, 73, 7, 73, 71, 75, 1006, 75, 61, 2, 72, 73, 76, 1101, 0, 0,
+        74, 7, 74, 71, 75, 1006, 75, 54, 1, 77, 76, 77, 1, 77, 74, 77, 1001, 74, 1, 74, 1105, 1, 32, 1001, 73, 1, 73, 1105, 1, 17,
+        1001, 72, 1, 72, 1105, 1, 6, 4, 77, 99,
+        0, 0, 0, 0, 0, 0, 0
+    };
+
+    // Outputs every input plus one until it reads 0. Five instructions per input, so feeding it one
+    // value at a time is nearly all host round trips.
+    value_t echo[] = { 3, 15, 1006, 15, 14, 1001, 15, 1, 15, 4, 15, 1105, 1, 0, 99, 0 };
+
+    // Stores 7 at 50, then outputs it read back through rb. optimize() used to drop the store.
+    value_t rb_readback[] = { 1101, 7, 0, 50, 109, 50, 204, 0, 99 };
+}
+
+// One entry in the benchmark suite.
+struct workload_t {
+    std::string name;
+    std::function<program_t()> load;
+    std::vector<value_t> inputs;
+    bool interactive = false; // Also timed with the inputs handed over one at a time, each once the program blocks
+};
+
+// One workload on one engine, see run_benchmarks.
+struct measurement_t {
+    std::string workload;
+    engine_t engine;
+    size_t runs;
+    size_t instructions; // Per run
+    double best_ns;
+    double median_ns;
+    size_t peak_rss_kb;
+    size_t stalls; // Times an interactive run blocked on input, per run
+    double stall_ns; // What each of those cost over having the input queued, median of both
+};
+
+// Peak resident set size of the process. Where /proc/self/clear_refs takes "5"
+// (Linux 4.0 on) the peak can be reset, so each measurement gets its own;
+// elsewhere it only ever grows.
+void reset_peak_rss() {
+    std::ofstream clear_refs("/proc/self/clear_refs");
+    if (clear_refs)
+        clear_refs << "5" << std::flush;
+}
+
+size_t peak_rss_kb() {
+    std::ifstream status("/proc/self/status");
+    for (std::string line; std::getline(status, line);)
+        if (line.compare(0, 6, "VmHWM:") == 0)
+            return std::stoull(line.substr(6));
+
+#if defined(__unix__) || defined(__APPLE__)
+    rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+#ifdef __APPLE__
+        return size_t(usage.ru_maxrss) / 1024; // In bytes there
+#else
+        return size_t(usage.ru_maxrss);
+#endif
+#endif
+    return 0;
+}
+
+// Runs every workload on every engine and checks they all agree on the outputs.
+// Times are for whole runs, loading included. Each workload gets one untimed run
+// per engine first, then runs timed ones.
+std::vector<measurement_t> run_benchmarks(std::vector<workload_t> const& workloads, size_t runs = 5) {
+    using steady_clock = std::chrono::steady_clock;
+
+    auto median = [](std::vector<double> times) {
+        std::sort(times.begin(), times.end());
+        return times[times.size() / 2];
+    };
+
+    // Batch has every input queued up front
+    auto run_once = [](workload_t const& workload, engine_t engine, bool interactive, size_t& stalls) {
+        program_t program = workload.load();
+        program.engine = engine;
+        stalls = 0;
+
+        auto start = steady_clock::now();
+        if (interactive) {
+            for (value_t input : workload.inputs) {
+                program.exec();
+                if (program.halted)
+                    break;
+                program.inputs.push_back(input);
+                ++stalls;
+            }
+        }
+        else {
+            program.inputs.assign(workload.inputs.begin(), workload.inputs.end());
+        }
+        program.run();
+        double elapsed = std::chrono::duration<double, std::nano>(steady_clock::now() - start).count();
+
+        return std::make_tuple(elapsed, program.instruction_count, std::move(program.outputs));
+    };
+
+    const char* engine_names[] = { "interpreter", "threaded", "jit" };
+
+    std::vector<measurement_t> measurements;
+    for (workload_t const& workload : workloads) {
+        std::optional<std::vector<value_t>> expected;
+
+        for (engine_t engine : { interpreter, threaded, jit }) {
+            measurement_t measurement{ workload.name, engine, runs, 0, 0, 0, 0, 0, 0 };
+            size_t stalls;
+
+            reset_peak_rss();
+            auto [warmup, instructions, outputs] = run_once(workload, engine, false, stalls);
+            if (!expected)
+                expected = outputs;
+            else if (outputs != *expected)
+                throw std::runtime_error(workload.name + ": " + engine_names[engine] + " outputs differ from " + engine_names[interpreter]);
+            measurement.instructions = instructions;
+
+            std::vector<double> batch, interactive;
+            for (size_t i = 0; i < runs; ++i) {
+                batch.push_back(std::get<0>(run_once(workload, engine, false, stalls)));
+                if (workload.interactive) {
+                    interactive.push_back(std::get<0>(run_once(workload, engine, true, stalls)));
+                    measurement.stalls = stalls;
+                }
+            }
+
+            measurement.best_ns = *std::min_element(batch.begin(), batch.end());
+            measurement.median_ns = median(batch);
+            if (measurement.stalls != 0)
+                measurement.stall_ns = (median(interactive) - measurement.median_ns) / measurement.stalls;
+            measurement.peak_rss_kb = peak_rss_kb();
+            measurements.push_back(measurement);
+        }
+    }
+
+    return measurements;
+}
+
+// One line per measurement under a header, for diffing or loading into a
+// spreadsheet. Rates are from the median run.
+void write_benchmarks(std::ostream& out, std::vector<measurement_t> const& measurements) {
+    const char* engine_names[] = { "interpreter", "threaded", "jit" };
+
+    out << "workload,engine,runs,instructions,best_ms,median_ms,ns_per_instruction,minstructions_per_s,peak_rss_kb,stalls,stall_ns" << std::endl;
+    for (measurement_t const& m : measurements) {
+        out << m.workload << "," << engine_names[m.engine] << "," << m.runs << "," << m.instructions << ","
+            << std::fixed << std::setprecision(3) << m.best_ns / 1e6 << "," << m.median_ns / 1e6 << ","
+            << m.median_ns / std::max<size_t>(m.instructions, 1) << ","
+            << m.instructions / std::max(m.median_ns, 1.0) * 1e3 << ","
+            << m.peak_rss_kb << "," << m.stalls << "," << std::setprecision(1) << m.stall_ns << std::endl;
+    }
+}
+
+// The synthetic programs, sized to run around 10M instructions each, the
+// echo loop with 100000 inputs, then whatever else is passed in.
+std::vector<workload_t> benchmark_corpus(std::vector<workload_t> extra = {}) {
+    std::vector<value_t> echo_inputs;
+    for (value_t i = 1; i <= 100000; ++i)
+        echo_inputs.push_back(i);
+    echo_inputs.push_back(0);
+
+    std::vector<workload_t> workloads = {
+        { "sieve", [] { return make_program(corpus::sieve); }, { 400000 } },
+        { "sort", [] { return make_program(corpus::sort); }, { 2000 } },
+        { "nested", [] { return make_program(corpus::nested); }, { 120 } },
+        { "echo", [] { return make_program(corpus::echo); }, echo_inputs, true },
+    };
+
+    for (workload_t& workload : extra)
+        workloads.push_back(std::move(workload));
+    return workloads;
+}
+
+// Runs the corpus, small, as is and through optimize(), throws unless both give the same outputs.
+void check_optimize() {
+    struct case_t {
+        const char* name;
+        value_t const* image;
+        size_t size;
+        std::vector<value_t> inputs;
+    };
+
+    const case_t cases[] = {
+        { "sieve", corpus::sieve, std::size(corpus::sieve), { 1000 } },
+        { "sort", corpus::sort, std::size(corpus::sort), { 200 } },
+        { "nested", corpus::nested, std::size(corpus::nested), { 20 } },
+        { "echo", corpus::echo, std::size(corpus::echo), { 5, 6, 0 } },
+        { "rb_readback", corpus::rb_readback, std::size(corpus::rb_readback), {} },
+    };
+
+    for (case_t const& c : cases) {
+        optimized_t optimized = optimize(c.image, c.size);
+        program_t plain{ memory_t(c.image, c.size), c.size };
+        program_t rewritten = make_program(optimized.image.data(), optimized.image.size());
+        for (program_t* program : { &plain, &rewritten }) {
+            program->inputs.assign(c.inputs.begin(), c.inputs.end());
+            program->run();
+        }
+
+        if (plain.outputs != rewritten.outputs)
+            throw std::runtime_error(std::string("optimize() changed what ") + c.name + " outputs");
+    }
+}
+
+value_t state[] = {
+    // Copy intcode here
+};
+
+// Runs the benchmark suite (benchmark_corpus, then this program with inputs 1
+// and 2) on every engine and writes the results to stdout as CSV
+// #define ENABLE_BENCHMARK
+
+// Reads the program as comma-separated text from stdin instead of state
+// #define ENABLE_STDIN
+
+// Runs 256 copies of the program on a scheduler_t and reports how fast they went
+// #define ENABLE_SCHEDULER
+
+// Runs the image as rewritten by optimize()
+// #define ENABLE_OPTIMIZER
+
+// Loads the program from intcode.img (see 09_pack.cpp) instead of state. With
+// ENABLE_OPTIMIZER too, the optimized form gets cached in there the first time.
+// #define ENABLE_IMAGE
+
+// Prints the disassembly by basic block and writes the control flow graph to intcode.dot
+// #define ENABLE_DUMP_CFG
+
+// Keeps the last 65536 instructions in intcode.trace, see 09_trace.cpp to read it.
+// #define ENABLE_TRACE
+
+int main() {
+#ifdef ENABLE_DUMP_CFG
+    cfg_t cfg(state, sizeof(state) / sizeof(state[0]));
+    cfg.disassemble(std::cout);
+    std::ofstream dot("intcode.dot");
+    cfg.write_dot(dot);
+    return 0;
+#endif
+
+#ifdef ENABLE_OPTIMIZER
+    auto report = [](optimized_t const& optimized) {
+        std::cerr << (optimized.applied ? "optimized: " : "not optimized, it touches its own code: ")
+            << optimized.direct_operands << " direct operands, "
+            << optimized.folded_jumps << " folded jumps, "
+            << optimized.removed << " instructions removed" << std::endl;
+    };
+    check_optimize();
+#endif
+
+#if defined(ENABLE_IMAGE)
+    image_t image = image_t::load("intcode.img");
+#ifdef ENABLE_OPTIMIZER
+    if (image.optimized_count == 0) {
+        optimized_t optimized = optimize(image.words, image.word_count);
+        report(optimized);
+        image_t::save("intcode.img", image.words, image.word_count, optimized.image.data(), optimized.image.size());
+        image = image_t::load("intcode.img");
+    }
+    auto load_program = [&] { return make_program(image, true); };
+#else
+    auto load_program = [&] { return make_program(image); };
+#endif
+#elif defined(ENABLE_STDIN)
+    program_t loaded = read_program(std::cin);
+    auto load_program = [&] { return loaded.fork(); };
+#elif defined(ENABLE_OPTIMIZER)
+    optimized_t optimized = optimize(state, sizeof(state) / sizeof(state[0]));
+    report(optimized);
+    auto load_program = [&] { return make_program(optimized.image.data(), optimized.image.size()); };
+#else
+    auto load_program = [] { return make_program(state); };
+#endif
+
+#ifdef ENABLE_SCHEDULER
+    {
+        scheduler_t scheduler;
+        program_t boot = load_program();
+        boot.inputs.push_back(STEP);
+        for (size_t i = 0; i < 256; ++i)
+            scheduler.add(boot);
+
+        scheduler.run();
+        scheduler.report(std::cout);
+        for (auto&& output : scheduler.program(0).outputs)
+            std::cout << output << std::endl;
+    }
+
+    return 0;
+#endif
+
+#ifdef ENABLE_BENCHMARK
+    write_benchmarks(std::cout, run_benchmarks(benchmark_corpus({
+        { "day09_1", load_program, { 1 } },
+        { "day09_2", load_program, { 2 } },
+    })));
+    return 0;
+#endif
+
+    auto program = load_program();
+    program.inputs.push_back(STEP);
+    {
+        PROFILE(profile_t::scope_t scope("main"));
+#ifdef ENABLE_TRACE
+        trace_ring_t trace("intcode.trace", 1 << 16);
+        program.run(trace);
+#else
+        program.run();
+#endif
+    }
+
+    for (auto&& output : program.outputs)
+        std::cout << output << std::endl;
+
+#ifdef ENABLE_PROFILER
+    program.profile.report(std::cerr);
+    std::ofstream folded("intcode.folded");
+    program.profile.write_folded(folded);
+#endif
     return 0;
 }
@@ -0,0 +1,440 @@
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <deque>
+#include <set>
+#include <array>
+#include <algorithm>
+
+// Ahead-of-time intcode translator.
+//
+//   09_aot <image.txt> [output.cpp]      writes a C++ translation unit (stdout by default)
+//   09_aot <image.txt> -o <binary>       same, then runs $CXX (c++ by default) on it
+//
+// The generated program takes its inputs on the command line and prints outputs one per line.
+
+using size_t = std::size_t;
+
+enum intcode
+{
+    add = 1,
+    multiply = 2,
+    load_input = 3,
+    write_output = 4,
+    jump_if_true = 5,
+    jump_if_false = 6,
+    less_than = 7,
+    equals = 8,
+    mod_rel_base = 9,
+    halt = 99,
+};
+
+enum operation_mode {
+    position = 0,
+    immediate = 1,
+    relative = 2
+};
+
+using value_t = int64_t;
+
+size_t get_parameter_count(intcode code) {
+    switch (code) {
+    case add:
+    case multiply:
+    case less_than:
+    case equals:
+        return 3;
+    case load_input:
+    case write_output:
+        return 1;
+    case jump_if_false:
+    case jump_if_true:
+        return 2;
+    case mod_rel_base:
+        return 1;
+    case halt:
+        return 0;
+    }
+
+    throw std::runtime_error("not implemented");
+}
+
+bool is_valid_instruction(value_t word) {
+    if (word <= 0)
+        return false;
+
+    intcode code = intcode(word - (word / 100) * 100);
+    switch (code) {
+    case add:
+    case multiply:
+    case load_input:
+    case write_output:
+    case jump_if_true:
+    case jump_if_false:
+    case less_than:
+    case equals:
+    case mod_rel_base:
+    case halt:
+        break;
+    default:
+        return false;
+    }
+
+    value_t parameter_modes = word / 100;
+    for (size_t i = 0; i < get_parameter_count(code); ++i) {
+        if (parameter_modes - (parameter_modes / 10) * 10 > relative)
+            return false;
+
+        parameter_modes /= 10;
+    }
+
+    return parameter_modes == 0;
+}
+
+struct instruction_t {
+    intcode code;
+    std::array<operation_mode, 3> parameter_mode;
+    std::array<value_t, 3> operands;
+    size_t length = 0;
+};
+
+// Where the translated code lives at runtime, must match the runtime below.
+constexpr const static size_t min_memory_size = 0x8000;
+
+// Everything the generated program needs besides the image and the translated
+// code: memory, I/O, and an interpreter for whatever wasn't translated or was patched.
+const char* runtime_prelude = R"(#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+#include <deque>
+
+using value_t = int64_t;
+using size_t = std::size_t;
+)";
+
+const char* runtime_source = R"(constexpr const static size_t halted = ~size_t(0);
+
+struct vm_t {
+    std::vector<value_t> ram;
+    std::deque<value_t> inputs;
+    size_t rel_base = 0;
+    bool patched = false; // Set once translated code was overwritten, everything is interpreted from then on
+    size_t instruction_count = 0;
+
+    value_t& at(size_t address) {
+        if (address >= ram.size())
+            ram.resize(address + address / 2 + 1);
+        return ram[address];
+    }
+
+    void write(size_t address, value_t value) {
+        value_t& word = at(address);
+        if (word != value && address < sizeof(code_words) && code_words[address])
+            patched = true;
+        word = value;
+    }
+
+    value_t input() {
+        if (inputs.empty())
+            throw std::runtime_error("program is waiting for input");
+
+        value_t value = inputs.front();
+        inputs.pop_front();
+        return value;
+    }
+
+    void output(value_t value) {
+        std::cout << value << std::endl;
+    }
+
+    size_t address(size_t eip, value_t modes, size_t index) {
+        for (size_t i = 0; i < index; ++i)
+            modes /= 10;
+
+        switch (modes % 10) {
+        case 0: return size_t(at(eip + 1 + index));
+        case 1: return eip + 1 + index;
+        case 2: return rel_base + at(eip + 1 + index);
+        }
+
+        throw std::runtime_error("not implemented");
+    }
+
+    // Runs the instruction at eip, returns the next one.
+    size_t interpret(size_t eip) {
+        value_t word = at(eip);
+        value_t modes = word / 100;
+        auto parameter = [&](size_t index) { return at(address(eip, modes, index)); };
+
+        ++instruction_count;
+        switch (word % 100) {
+        case 1: write(address(eip, modes, 2), parameter(0) + parameter(1)); return eip + 4;
+        case 2: write(address(eip, modes, 2), parameter(0) * parameter(1)); return eip + 4;
+        case 3: write(address(eip, modes, 0), input()); return eip + 2;
+        case 4: output(parameter(0)); return eip + 2;
+        case 5: return parameter(0) != 0 ? size_t(parameter(1)) : eip + 3;
+        case 6: return parameter(0) == 0 ? size_t(parameter(1)) : eip + 3;
+        case 7: write(address(eip, modes, 2), parameter(0) < parameter(1)); return eip + 4;
+        case 8: write(address(eip, modes, 2), parameter(0) == parameter(1)); return eip + 4;
+        case 9: rel_base += parameter(0); return eip + 2;
+        case 99: return halted;
+        }
+
+        throw std::runtime_error("not implemented");
+    }
+};
+)";
+
+struct translator_t {
+    translator_t(std::vector<value_t> image) : image(std::move(image)) { }
+
+    bool decode(size_t eip, instruction_t& instr) const {
+        if (eip >= image.size() || !is_valid_instruction(image[eip]))
+            return false;
+
+        instr.code = intcode(image[eip] % 100);
+        instr.length = get_parameter_count(instr.code) + 1;
+        if (eip + instr.length > image.size())
+            return false;
+
+        value_t modes = image[eip] / 100;
+        for (size_t i = 0; i + 1 < instr.length; ++i) {
+            instr.parameter_mode[i] = operation_mode(modes % 10);
+            instr.operands[i] = image[eip + 1 + i];
+            modes /= 10;
+        }
+
+        return true;
+    }
+
+    // Walks everything reachable from 0 through fallthrough and immediate jump
+    // targets. Return addresses pushed by the usual `add <imm>, 0` idiom are
+    // followed too, so call/return heavy code stays translated.
+    void discover() {
+        std::vector<size_t> pending{ 0 };
+        auto enqueue = [&](value_t target) {
+            if (target >= 0 && size_t(target) < image.size() && !entries.count(size_t(target)))
+                pending.push_back(size_t(target));
+        };
+
+        while (!pending.empty()) {
+            size_t eip = pending.back();
+            pending.pop_back();
+
+            instruction_t instr;
+            if (entries.count(eip) || !decode(eip, instr))
+                continue;
+
+            entries.insert(eip);
+            if (instr.code == halt)
+                continue;
+
+            enqueue(eip + instr.length);
+            if ((instr.code == jump_if_true || instr.code == jump_if_false) && instr.parameter_mode[1] == immediate)
+                enqueue(instr.operands[1]);
+
+            if (instr.code == add && instr.parameter_mode[0] == immediate && instr.parameter_mode[1] == immediate && instr.operands[1] == 0)
+                enqueue(instr.operands[0]);
+        }
+
+        code_words.assign(image.size(), false);
+        for (size_t eip : entries) {
+            instruction_t instr;
+            decode(eip, instr);
+            for (size_t i = 0; i < instr.length; ++i)
+                code_words[eip + i] = true;
+        }
+    }
+
+    std::string read(instruction_t const& instr, size_t index) const {
+        value_t operand = instr.operands[index];
+        switch (instr.parameter_mode[index]) {
+        case position:
+            if (operand >= 0 && size_t(operand) < memory_size())
+                return "vm.ram[" + std::to_string(operand) + "]";
+            return "vm.at(" + std::to_string(operand) + ")";
+        case immediate:
+            return "value_t(" + std::to_string(operand) + "ll)";
+        case relative:
+            return "vm.at(vm.rel_base + " + std::to_string(operand) + ")";
+        }
+
+        throw std::runtime_error("not implemented");
+    }
+
+    // Stores that provably miss translated code skip the patch check.
+    std::string write(instruction_t const& instr, size_t eip, size_t index, std::string const& value) const {
+        value_t operand = instr.operands[index];
+        switch (instr.parameter_mode[index]) {
+        case position:
+            if (operand >= 0 && size_t(operand) < memory_size() && (size_t(operand) >= code_words.size() || !code_words[operand]))
+                return "vm.ram[" + std::to_string(operand) + "] = " + value + ";";
+            return "vm.write(" + std::to_string(operand) + ", " + value + ");";
+        case immediate:
+            return "vm.write(" + std::to_string(eip + 1 + index) + ", " + value + ");";
+        case relative:
+            return "vm.write(vm.rel_base + " + std::to_string(operand) + ", " + value + ");";
+        }
+
+        throw std::runtime_error("not implemented");
+    }
+
+    std::string jump(size_t target) const {
+        if (entries.count(target))
+            return "goto L" + std::to_string(target) + ";";
+        return "{ eip = " + std::to_string(target) + "; goto dispatch; }";
+    }
+
+    size_t memory_size() const { return std::max(image.size(), min_memory_size); }
+
+    void emit(std::ostream& out) const {
+        out << "// Generated by 09_aot, do not edit.\n";
+        out << runtime_prelude << "\n";
+        out << "static const bool code_words[] = {";
+        for (size_t i = 0; i < code_words.size(); ++i)
+            out << (i % 32 == 0 ? "\n    " : "") << (code_words[i] ? "1," : "0,");
+        out << "\n};\n\n";
+
+        out << "static const value_t image[] = {";
+        for (size_t i = 0; i < image.size(); ++i)
+            out << (i % 16 == 0 ? "\n    " : "") << image[i] << "ll,";
+        out << "\n};\n\n";
+
+        out << runtime_source << "\n";
+
+        out << "void run(vm_t& vm) {\n";
+        out << "    size_t eip = 0;\n";
+        out << "    value_t lhs, rhs;\n";
+        out << "dispatch:\n";
+        out << "    if (vm.patched)\n";
+        out << "        goto interpret;\n\n";
+        out << "    switch (eip) {\n";
+
+        for (size_t eip : entries) {
+            instruction_t instr;
+            decode(eip, instr);
+            size_t next = eip + instr.length;
+
+            out << "    case " << eip << ": L" << eip << ":\n";
+            out << "        ++vm.instruction_count;\n";
+
+            // Leave right away if this instruction wrote over translated code
+            std::string check = "if (vm.patched) { eip = " + std::to_string(next) + "; goto dispatch; }";
+
+            switch (instr.code) {
+            case add:
+            case multiply:
+            case less_than:
+            case equals:
+            {
+                const char* op = instr.code == add ? " + " : instr.code == multiply ? " * " : instr.code == less_than ? " < " : " == ";
+                std::string store = write(instr, eip, 2, std::string("value_t(lhs") + op + "rhs)");
+                out << "        lhs = " << read(instr, 0) << ";\n";
+                out << "        rhs = " << read(instr, 1) << ";\n";
+                out << "        " << store << "\n";
+                if (store.rfind("vm.write", 0) == 0)
+                    out << "        " << check << "\n";
+                break;
+            }
+            case load_input:
+                out << "        " << write(instr, eip, 0, "vm.input()") << "\n";
+                out << "        " << check << "\n";
+                break;
+            case write_output:
+                out << "        vm.output(" << read(instr, 0) << ");\n";
+                break;
+            case jump_if_true:
+            case jump_if_false:
+                out << "        if (" << read(instr, 0) << (instr.code == jump_if_true ? " != 0" : " == 0") << ") ";
+                if (instr.parameter_mode[1] == immediate)
+                    out << jump(size_t(instr.operands[1])) << "\n";
+                else
+                    out << "{ eip = size_t(" << read(instr, 1) << "); goto dispatch; }\n";
+                break;
+            case mod_rel_base:
+                out << "        vm.rel_base += " << read(instr, 0) << ";\n";
+                break;
+            case halt:
+                out << "        return;\n";
+                break;
+            }
+
+            if (instr.code != halt && !entries.count(next))
+                out << "        " << jump(next) << "\n";
+        }
+
+        out << "    }\n\n";
+        out << "interpret:\n";
+        out << "    eip = vm.interpret(eip);\n";
+        out << "    if (eip == halted)\n";
+        out << "        return;\n";
+        out << "    goto dispatch;\n";
+        out << "}\n\n";
+
+        out << "int main(int argc, char** argv) {\n";
+        out << "    vm_t vm;\n";
+        out << "    vm.ram.assign(image, image + sizeof(image) / sizeof(value_t));\n";
+        out << "    vm.ram.resize(" << memory_size() << ");\n";
+        out << "    for (int i = 1; i < argc; ++i)\n";
+        out << "        vm.inputs.push_back(std::strtoll(argv[i], nullptr, 10));\n\n";
+        out << "    run(vm);\n";
+        out << "    return 0;\n";
+        out << "}\n";
+    }
+
+    std::vector<value_t> image;
+    std::set<size_t> entries;
+    std::vector<bool> code_words;
+};
+
+std::vector<value_t> load_image(std::istream& in) {
+    std::vector<value_t> image;
+    std::string word;
+    while (std::getline(in, word, ','))
+        image.push_back(std::stoll(word));
+    return image;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        std::cerr << "usage: " << argv[0] << " <image.txt> [output.cpp | -o binary]" << std::endl;
+        return 1;
+    }
+
+    std::ifstream in(argv[1]);
+    if (!in) {
+        std::cerr << "unable to open " << argv[1] << std::endl;
+        return 1;
+    }
+
+    translator_t translator(load_image(in));
+    translator.discover();
+
+    std::string mode = argc > 2 ? argv[2] : "";
+    if (mode == "-o" && argc > 3) {
+        std::string source = std::string(argv[3]) + ".cpp";
+        std::ofstream out(source);
+        translator.emit(out);
+        out.close();
+
+        const char* cxx = std::getenv("CXX");
+        std::string command = std::string(cxx ? cxx : "c++") + " -std=c++17 -O2 -o " + argv[3] + " " + source;
+        return std::system(command.c_str()) == 0 ? 0 : 1;
+    }
+
+    if (!mode.empty()) {
+        std::ofstream out(mode);
+        translator.emit(out);
+    } else {
+        translator.emit(std::cout);
+    }
+
+    return 0;
+}
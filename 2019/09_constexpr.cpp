@@ -0,0 +1,219 @@
+#include <cstdint>
+#include <array>
+#include <iostream>
+#include <stdexcept>
+
+// Intcode at compile time: the interpreter is a plain loop in a constexpr
+// function, so a whole run is one constant expression and the answers end up
+// as constants in the binary. Needs C++20 for std::to_array.
+//
+// Compilers cap how much work a constant expression may do, and an instruction
+// costs a few hundred of GCC's operations. Days 2 and 5 fit in the defaults,
+// day 9 step 2 doesn't:
+//
+//   g++ -std=c++20 -fconstexpr-ops-limit=1000000000 -fconstexpr-loop-limit=10000000
+//   clang++ -std=c++20 -fconstexpr-steps=1000000000
+//
+// Anything the program can't do (bad opcode, address past Memory, running out
+// of inputs or output room) throws, which is a compile error once it happens.
+
+using size_t = std::size_t;
+using value_t = int64_t;
+
+enum intcode
+{
+    add = 1,
+    multiply = 2,
+    load_input = 3,
+    write_output = 4,
+    jump_if_true = 5,
+    jump_if_false = 6,
+    less_than = 7,
+    equals = 8,
+    mod_rel_base = 9,
+    halt = 99,
+};
+
+enum operation_mode {
+    position = 0,
+    immediate = 1,
+    relative = 2
+};
+
+// Memory is the whole address space in words, the image goes at 0 and the rest starts as zeros.
+template <size_t Memory, size_t MaxOutputs>
+struct machine_t {
+    value_t memory[Memory]{}; // Not a std::array, each operator[] call counts against the limits
+    std::array<value_t, MaxOutputs> outputs{};
+    size_t output_count = 0;
+    size_t instruction_count = 0;
+
+    constexpr value_t& at(size_t address) {
+        if (address >= Memory)
+            throw std::out_of_range("address past the end of memory");
+
+        return memory[address];
+    }
+
+    constexpr value_t last_output() const {
+        if (output_count == 0)
+            throw std::logic_error("no output");
+
+        return outputs[output_count - 1];
+    }
+
+    template <size_t I>
+    constexpr void run(std::array<value_t, I> const& inputs) {
+        size_t eip = 0;
+        size_t rel_base = 0;
+        size_t next_input = 0;
+
+        for (;; ++instruction_count) {
+            value_t word = at(eip);
+
+            auto address = [&](size_t index) -> size_t {
+                value_t modes = word / 100;
+                for (size_t i = 0; i < index; ++i)
+                    modes /= 10;
+
+                switch (operation_mode(modes % 10)) {
+                case position:
+                    return size_t(at(eip + 1 + index));
+                case immediate:
+                    return eip + 1 + index;
+                case relative:
+                    return size_t(value_t(rel_base) + at(eip + 1 + index));
+                }
+
+                throw std::logic_error("bad parameter mode");
+            };
+
+            auto read = [&](size_t index) { return at(address(index)); };
+
+            switch (intcode(word % 100)) {
+            case add:
+                at(address(2)) = read(0) + read(1);
+                eip += 4;
+                break;
+            case multiply:
+                at(address(2)) = read(0) * read(1);
+                eip += 4;
+                break;
+            case load_input:
+                if (next_input == I)
+                    throw std::logic_error("program wants more input than given");
+
+                at(address(0)) = inputs[next_input++];
+                eip += 2;
+                break;
+            case write_output:
+                if (output_count == MaxOutputs)
+                    throw std::logic_error("program outputs more than MaxOutputs");
+
+                outputs[output_count++] = read(0);
+                eip += 2;
+                break;
+            case jump_if_true:
+                eip = read(0) != 0 ? size_t(read(1)) : eip + 3;
+                break;
+            case jump_if_false:
+                eip = read(0) == 0 ? size_t(read(1)) : eip + 3;
+                break;
+            case less_than:
+                at(address(2)) = read(0) < read(1);
+                eip += 4;
+                break;
+            case equals:
+                at(address(2)) = read(0) == read(1);
+                eip += 4;
+                break;
+            case mod_rel_base:
+                rel_base = size_t(value_t(rel_base) + read(0));
+                eip += 2;
+                break;
+            case halt:
+                ++instruction_count;
+                return;
+            default:
+                throw std::logic_error("not an instruction");
+            }
+        }
+    }
+};
+
+template <size_t Memory = 4096, size_t MaxOutputs = 64, size_t N, size_t I = 0>
+constexpr machine_t<Memory, MaxOutputs> run(std::array<value_t, N> const& image, std::array<value_t, I> const& inputs = {}) {
+    static_assert(N <= Memory, "image doesn't fit in Memory");
+
+    machine_t<Memory, MaxOutputs> machine;
+    for (size_t i = 0; i < N; ++i)
+        machine.memory[i] = image[i];
+
+    machine.run(inputs);
+    return machine;
+}
+
+// Day 2: memory[0] after patching the noun and verb in. Only needs room for
+// the image, or for whatever noun and verb point at.
+template <size_t N>
+constexpr value_t gravity_assist(std::array<value_t, N> image, value_t noun, value_t verb) {
+    image[1] = noun;
+    image[2] = verb;
+    return run<(N > 100 ? N : 100)>(image).memory[0];
+}
+
+template <size_t N>
+constexpr value_t find_noun_verb(std::array<value_t, N> const& image, value_t target) {
+    for (value_t noun = 0; noun < 100; ++noun)
+        for (value_t verb = 0; verb < 100; ++verb)
+            if (gravity_assist(image, noun, verb) == target)
+                return 100 * noun + verb;
+
+    throw std::logic_error("no noun and verb give that");
+}
+
+// Examples from the puzzle statements, run while compiling
+namespace examples {
+    constexpr auto quine = std::to_array<value_t>({ 109, 1, 204, -1, 1001, 100, 1, 100, 1008, 100, 16, 101, 1006, 101, 0, 99 });
+    constexpr auto quine_run = run(quine);
+    static_assert(quine_run.output_count == quine.size());
+    static_assert([] {
+        for (size_t i = 0; i < quine.size(); ++i)
+            if (quine_run.outputs[i] != quine[i])
+                return false;
+        return true;
+    }());
+
+    static_assert(run(std::to_array<value_t>({ 104, 1125899906842624, 99 })).last_output() == 1125899906842624);
+    static_assert(run(std::to_array<value_t>({ 1102, 34915192, 34915192, 7, 4, 7, 99, 0 })).last_output() == 1219070632396864);
+
+    // Day 5, 999 below 8, 1000 at 8, 1001 above
+    constexpr auto compare_to_8 = std::to_array<value_t>({
+        3, 21, 1008, 21, 8, 20, 1005, 20, 22, 107, 8, 21, 20, 1006, 20, 31, 1106, 0, 36, 98, 0, 0,
+        1002, 21, 125, 20, 4, 20, 1105, 1, 46, 104, 999, 1105, 1, 46, 1101, 1000, 1, 20, 4, 20, 1105, 1, 46, 98, 99 });
+    static_assert(run(compare_to_8, std::array<value_t, 1>{ 7 }).last_output() == 999);
+    static_assert(run(compare_to_8, std::array<value_t, 1>{ 8 }).last_output() == 1000);
+    static_assert(run(compare_to_8, std::array<value_t, 1>{ 9 }).last_output() == 1001);
+
+    static_assert(run(std::to_array<value_t>({ 1, 9, 10, 3, 2, 3, 11, 0, 99, 30, 40, 50 })).memory[0] == 3500);
+}
+
+// Copy the inputs in here
+constexpr std::array<value_t, 5> rocket = { 1, 0, 0, 0, 99 }; // Day 2
+constexpr std::array<value_t, 3> diagnostics = { 104, 0, 99 }; // Day 5
+constexpr std::array<value_t, 3> boost = { 104, 0, 99 }; // Day 9
+
+int main() {
+    constexpr value_t day02_1 = gravity_assist(rocket, 12, 2);
+    std::cout << day02_1 << std::endl;
+    // constexpr value_t day02_2 = find_noun_verb(rocket, 19690720); // Needs the real input
+    // std::cout << day02_2 << std::endl;
+
+    constexpr value_t day05_1 = run(diagnostics, std::array<value_t, 1>{ 1 }).last_output();
+    constexpr value_t day05_2 = run(diagnostics, std::array<value_t, 1>{ 5 }).last_output();
+    std::cout << day05_1 << std::endl << day05_2 << std::endl;
+
+    constexpr value_t day09_1 = run(boost, std::array<value_t, 1>{ 1 }).last_output();
+    constexpr value_t day09_2 = run(boost, std::array<value_t, 1>{ 2 }).last_output();
+    std::cout << day09_1 << std::endl << day09_2 << std::endl;
+}
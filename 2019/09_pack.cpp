@@ -0,0 +1,151 @@
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <iostream>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Converts intcode programs between the comma-separated text everyone pastes
+// around and the binary images 09 loads with image_t::load (define ENABLE_IMAGE there).
+//
+//   09_pack <program.txt> <program.img>     packs a program
+//   09_pack -d <program.img>                prints the program back as text
+//
+// Packed images have no optimized form, 09 adds it the first time it runs one
+// with ENABLE_OPTIMIZER.
+
+using size_t = std::size_t;
+using value_t = int64_t;
+
+// Same layout as image_t::header_t in 09.cpp
+struct header_t {
+    char magic[8];
+    uint64_t word_count;
+    uint64_t optimized_count;
+    uint64_t checksum;
+};
+
+constexpr const size_t alignment = 4096;
+
+size_t padded(size_t bytes) {
+    return (bytes + alignment - 1) / alignment * alignment;
+}
+
+uint64_t read_le(uint8_t const* bytes) {
+    uint64_t value = 0;
+    for (size_t i = 0; i < 8; ++i)
+        value |= uint64_t(bytes[i]) << (i * 8);
+    return value;
+}
+
+void write_le(uint8_t* bytes, uint64_t value) {
+    for (size_t i = 0; i < 8; ++i)
+        bytes[i] = uint8_t(value >> (i * 8));
+}
+
+// FNV-1a over the little-endian bytes of every word
+uint64_t checksum(std::vector<value_t> const& words) {
+    uint64_t hash = 14695981039346656037ull;
+    for (value_t word : words)
+        for (size_t byte = 0; byte < 8; ++byte)
+            hash = (hash ^ ((uint64_t(word) >> (byte * 8)) & 0xff)) * 1099511628211ull;
+    return hash;
+}
+
+int pack(const char* input, const char* output) {
+    std::ifstream in(input);
+    if (!in) {
+        std::cerr << "unable to open " << input << std::endl;
+        return 1;
+    }
+
+    std::vector<value_t> words;
+    std::string field;
+    while (std::getline(in, field, ',')) {
+        std::istringstream text(field);
+        value_t word;
+        if (!(text >> word)) {
+            if (in.eof() && words.size() > 0 && field.find_first_not_of(" \t\r\n") == std::string::npos)
+                continue; // Trailing comma, empty fields anywhere else are an error like in 09's csv_loader_t
+            std::cerr << input << ": not a number after word " << words.size() << ": " << field << std::endl;
+            return 1;
+        }
+        words.push_back(word);
+    }
+
+    std::vector<uint8_t> bytes(alignment + padded(words.size() * sizeof(value_t)));
+    std::memcpy(bytes.data(), "ICIMAGE1", 8);
+    write_le(bytes.data() + offsetof(header_t, word_count), words.size());
+    write_le(bytes.data() + offsetof(header_t, optimized_count), 0);
+    write_le(bytes.data() + offsetof(header_t, checksum), checksum(words));
+    for (size_t i = 0; i < words.size(); ++i)
+        write_le(bytes.data() + alignment + i * sizeof(value_t), uint64_t(words[i]));
+
+    std::ofstream out(output, std::ios::binary | std::ios::trunc);
+    if (!out.write(reinterpret_cast<const char*>(bytes.data()), std::streamsize(bytes.size()))) {
+        std::cerr << "unable to write " << output << std::endl;
+        return 1;
+    }
+
+    std::cerr << words.size() << " words" << std::endl;
+    return 0;
+}
+
+int unpack(const char* input) {
+    std::ifstream in(input, std::ios::binary);
+    std::vector<uint8_t> bytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    if (!in && !in.eof()) {
+        std::cerr << "unable to open " << input << std::endl;
+        return 1;
+    }
+
+    if (bytes.size() < sizeof(header_t) || std::memcmp(bytes.data(), "ICIMAGE1", 8) != 0) {
+        std::cerr << input << " is not an intcode image" << std::endl;
+        return 1;
+    }
+
+    uint64_t word_count = read_le(bytes.data() + offsetof(header_t, word_count));
+    if (word_count > bytes.size() / sizeof(value_t) || alignment + word_count * sizeof(value_t) > bytes.size()) {
+        std::cerr << input << " is truncated" << std::endl;
+        return 1;
+    }
+
+    std::vector<value_t> words(word_count);
+    for (size_t i = 0; i < word_count; ++i)
+        words[i] = value_t(read_le(bytes.data() + alignment + i * sizeof(value_t)));
+
+    // The checksum covers the optimized form too, when there is one
+    uint64_t optimized_count = read_le(bytes.data() + offsetof(header_t, optimized_count));
+    size_t optimized_offset = alignment + padded(word_count * sizeof(value_t));
+    std::vector<value_t> all = words;
+    for (size_t i = 0; i < optimized_count && optimized_offset + (i + 1) * sizeof(value_t) <= bytes.size(); ++i)
+        all.push_back(value_t(read_le(bytes.data() + optimized_offset + i * sizeof(value_t))));
+
+    if (all.size() != word_count + optimized_count || checksum(all) != read_le(bytes.data() + offsetof(header_t, checksum))) {
+        std::cerr << input << " is corrupted" << std::endl;
+        return 1;
+    }
+
+    for (size_t i = 0; i < words.size(); ++i)
+        std::cout << (i == 0 ? "" : ",") << words[i];
+    std::cout << std::endl;
+
+    if (optimized_count != 0)
+        std::cerr << "with an optimized form of " << optimized_count << " words" << std::endl;
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    if (argc == 3 && std::strcmp(argv[1], "-d") == 0)
+        return unpack(argv[2]);
+
+    if (argc == 3)
+        return pack(argv[1], argv[2]);
+
+    std::cerr << "usage: " << argv[0] << " <program.txt> <program.img>" << std::endl;
+    std::cerr << "       " << argv[0] << " -d <program.img>" << std::endl;
+    return 1;
+}
@@ -0,0 +1,182 @@
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Decoder for the binary traces written by 09's trace_ring_t (define ENABLE_TRACE there).
+//
+//   09_trace <intcode.trace> [count]     disassembles the last count records (all of them by default)
+//
+// One line per executed instruction, oldest first: sequence number, eip,
+// disassembly and what the instruction did.
+
+using size_t = std::size_t;
+
+enum intcode
+{
+    add = 1,
+    multiply = 2,
+    load_input = 3,
+    write_output = 4,
+    jump_if_true = 5,
+    jump_if_false = 6,
+    less_than = 7,
+    equals = 8,
+    mod_rel_base = 9,
+    halt = 99,
+};
+
+enum operation_mode {
+    position = 0,
+    immediate = 1,
+    relative = 2
+};
+
+using value_t = int64_t;
+
+// Same layout as 09.cpp
+struct trace_record_t {
+    uint64_t eip;
+    int64_t instruction;
+    int64_t operands[3];
+    int64_t result;
+};
+
+struct header_t {
+    char magic[8];
+    uint64_t record_size;
+    uint64_t capacity;
+    uint64_t count;
+};
+
+size_t get_parameter_count(intcode code) {
+    switch (code) {
+    case add:
+    case multiply:
+    case less_than:
+    case equals:
+        return 3;
+    case load_input:
+    case write_output:
+        return 1;
+    case jump_if_false:
+    case jump_if_true:
+        return 2;
+    case mod_rel_base:
+        return 1;
+    case halt:
+        return 0;
+    }
+
+    return 0;
+}
+
+const char* get_name(intcode code) {
+    switch (code) {
+    case add: return "add";
+    case multiply: return "mul";
+    case load_input: return "in";
+    case write_output: return "out";
+    case jump_if_true: return "jnz";
+    case jump_if_false: return "jz";
+    case less_than: return "lt";
+    case equals: return "eq";
+    case mod_rel_base: return "arb";
+    case halt: return "halt";
+    }
+
+    return nullptr;
+}
+
+std::string format_operand(operation_mode mode, value_t operand) {
+    switch (mode) {
+    case position:
+        return "[" + std::to_string(operand) + "]";
+    case immediate:
+        return std::to_string(operand);
+    case relative:
+        return "[rb" + std::string(operand < 0 ? "-" : "+") + std::to_string(operand < 0 ? -operand : operand) + "]";
+    }
+
+    return "?" + std::to_string(operand);
+}
+
+std::string disassemble(trace_record_t const& record) {
+    intcode code = intcode(record.instruction % 100);
+    const char* name = get_name(code);
+    if (name == nullptr)
+        return "??? " + std::to_string(record.instruction);
+
+    std::ostringstream text;
+    text << name;
+
+    value_t modes = record.instruction / 100;
+    for (size_t i = 0; i < get_parameter_count(code); ++i, modes /= 10)
+        text << (i == 0 ? " " : ", ") << format_operand(operation_mode(modes % 10), record.operands[i]);
+
+    std::string line = text.str();
+    line.resize(std::max<size_t>(line.size(), 40), ' ');
+
+    switch (code) {
+    case add: case multiply: case less_than: case equals: case load_input:
+        return line + "; = " + std::to_string(record.result);
+    case write_output:
+        return line + "; << " + std::to_string(record.result);
+    case jump_if_true: case jump_if_false:
+        return line + "; -> " + std::to_string(record.result);
+    case mod_rel_base:
+        return line + "; rb = " + std::to_string(record.result);
+    case halt:
+        break;
+    }
+
+    return text.str();
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        std::cerr << "usage: " << argv[0] << " <intcode.trace> [count]" << std::endl;
+        return 1;
+    }
+
+    std::ifstream in(argv[1], std::ios::binary);
+    if (!in) {
+        std::cerr << "unable to open " << argv[1] << std::endl;
+        return 1;
+    }
+
+    header_t header;
+    if (!in.read(reinterpret_cast<char*>(&header), sizeof(header)) || std::memcmp(header.magic, "ICTRACE1", sizeof(header.magic)) != 0) {
+        std::cerr << argv[1] << " is not an intcode trace" << std::endl;
+        return 1;
+    }
+
+    if (header.record_size != sizeof(trace_record_t) || header.capacity == 0) {
+        std::cerr << argv[1] << " was written by an incompatible version" << std::endl;
+        return 1;
+    }
+
+    std::vector<trace_record_t> records(header.capacity);
+    if (!in.read(reinterpret_cast<char*>(records.data()), records.size() * sizeof(trace_record_t))) {
+        std::cerr << argv[1] << " is truncated" << std::endl;
+        return 1;
+    }
+
+    // Only the last capacity records survive, oldest at count % capacity once it wrapped
+    uint64_t kept = std::min(header.count, header.capacity);
+    if (argc > 2)
+        kept = std::min<uint64_t>(kept, std::strtoull(argv[2], nullptr, 10));
+
+    for (uint64_t sequence = header.count - kept; sequence < header.count; ++sequence) {
+        trace_record_t const& record = records[sequence % header.capacity];
+        std::cout << std::setw(10) << sequence << "  " << std::setw(8) << record.eip << "  " << disassemble(record) << "\n";
+    }
+
+    return 0;
+}
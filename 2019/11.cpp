@@ -10,6 +10,15 @@
 #include <deque>
 #include <algorithm>
 #include <optional>
+#include <limits>
+#include <array>
+#include <memory>
+#include <coroutine>
+#include <exception>
+#include <utility>
+#include <chrono>
+#include <fstream>
+#include <string>
 
 using size_t = std::size_t;
 
@@ -39,15 +48,134 @@ namespace computer {
     struct program_t;
     struct opcode_t;
 
+    size_t get_parameter_count(intcode code) {
+        switch (code) {
+        case add:
+        case multiply:
+        case less_than:
+        case equals:
+            return 3;
+        case load_input:
+        case write_output:
+            return 1;
+        case jump_if_false:
+        case jump_if_true:
+            return 2;
+        case mod_rel_base:
+            return 1;
+        case halt:
+            return 0;
+        }
+
+        throw std::runtime_error("not implemented");
+    }
+
+    // An instruction as decoded from the program image. Decoded once per address
+    // and cached by program_t until a write lands on one of its words.
+    struct instruction_t {
+        intcode code;
+        std::array<operation_mode, 3> parameter_mode;
+        std::array<value_t, 3> operands;
+        size_t length = 0; // 0 if not decoded
+    };
+
+    // Program memory as a page table over 4 KiB pages. A page is allocated by the
+    // first write that lands on it, reads of anything never written return 0, so a
+    // program only costs the memory it touches.
+    //
+    // Copies share every page. Both sides lose write access to them, and the first
+    // write to a page that is still shared copies it.
+    struct memory_t {
+        constexpr const static size_t page_bits = 9;
+        constexpr const static size_t page_size = size_t(1) << page_bits; // In words
+        constexpr const static size_t page_mask = page_size - 1;
+        constexpr const static size_t max_pages = size_t(1) << 20; // 4 GiB worth of words
+
+        using page_t = std::array<value_t, page_size>;
+
+        memory_t() = default;
+        memory_t(value_t const* image, size_t size);
+
+        memory_t(memory_t const& other) { *this = other; }
+        memory_t& operator = (memory_t const& other);
+        memory_t(memory_t&&) = default;
+        memory_t& operator = (memory_t&&) = default;
+
+        value_t read(size_t address) const {
+            size_t index = address >> page_bits;
+            if (index >= table.size() || table[index] == nullptr)
+                return 0;
+
+            return (*table[index])[address & page_mask];
+        }
+
+        void write(size_t address, value_t value) {
+            size_t index = address >> page_bits;
+            page_t* page = index < writable.size() ? writable[index] : nullptr;
+            if (page == nullptr)
+                page = &make_writable(index);
+
+            (*page)[address & page_mask] = value;
+        }
+
+        page_t& make_writable(size_t index);
+
+        std::vector<page_t*> table; // By page index, nullptr if never written
+        mutable std::vector<page_t*> writable; // Same, but only pages nobody else shares
+        std::vector<std::shared_ptr<page_t>> pages;
+    };
+
+    memory_t::memory_t(value_t const* image, size_t size) {
+        for (size_t address = 0; address < size; address += page_size) {
+            page_t& page = make_writable(address >> page_bits);
+            std::copy(image + address, image + std::min(size, address + page_size), page.begin());
+        }
+    }
+
+    memory_t& memory_t::operator = (memory_t const& other) {
+        if (this != &other) {
+            table = other.table;
+            pages = other.pages;
+            writable.assign(table.size(), nullptr);
+            std::fill(other.writable.begin(), other.writable.end(), nullptr);
+        }
+
+        return *this;
+    }
+
+    memory_t::page_t& memory_t::make_writable(size_t index) {
+        if (index >= max_pages)
+            throw std::runtime_error("address out of range");
+
+        if (index >= table.size()) {
+            table.resize(index + 1);
+            writable.resize(index + 1);
+            pages.resize(index + 1);
+        }
+
+        std::shared_ptr<page_t>& page = pages[index];
+        if (page == nullptr) {
+            page = std::make_shared<page_t>();
+            page->fill(0);
+        }
+        else if (page.use_count() > 1) {
+            page = std::make_shared<page_t>(*page);
+        }
+
+        table[index] = writable[index] = page.get();
+        return *page;
+    }
+
     struct opcode_t {
         opcode_t(program_t& program, size_t eip);
         std::optional<opcode_t> exec(std::deque<value_t>& inputs, std::vector<value_t>& outputs);
-        value_t& get_parameter(int32_t index);
+        value_t get_parameter(int32_t index);
+        void set_parameter(int32_t index, value_t value);
+        size_t get_address(int32_t index);
         size_t get_parameter_count();
 
         void swap(opcode_t& other) {
-            parameter_mode.swap(other.parameter_mode);
-            code = other.code;
+            std::swap(instr, other.instr);
             eip = other.eip;
             std::swap(program, other.program);
         }
@@ -59,85 +187,214 @@ namespace computer {
 
         std::reference_wrapper<program_t> program;
 
-        std::unordered_map<size_t, operation_mode> parameter_mode;
-        intcode code;
+        instruction_t instr;
+        size_t eip;
+    };
+
+    // Coroutine view of a program_t, see program_t::session. The program co_yields
+    // every output and co_awaits every input, suspending is a couple of stores and
+    // a return, so one thread can juggle as many sessions as it wants.
+    struct session_t {
+        enum event_t {
+            has_output,
+            needs_input,
+            finished
+        };
+
+        struct input_t { };
+
+        struct promise_type {
+            value_t output = 0;
+            std::optional<value_t> input; // Sent by the host, taken by the next load_input
+            bool waiting = false;
+            std::exception_ptr error;
+
+            session_t get_return_object() { return session_t{ std::coroutine_handle<promise_type>::from_promise(*this) }; }
+            std::suspend_always initial_suspend() noexcept { return {}; }
+            std::suspend_always final_suspend() noexcept { return {}; }
+            std::suspend_always yield_value(value_t value) { output = value; return {}; }
+            void return_void() { }
+            void unhandled_exception() { error = std::current_exception(); }
+
+            // co_await input_t{} only suspends if the host hasn't sent anything yet
+            auto await_transform(input_t) {
+                struct awaiter {
+                    promise_type& promise;
+
+                    bool await_ready() const { return promise.input.has_value(); }
+                    void await_suspend(std::coroutine_handle<promise_type>) { promise.waiting = true; }
+                    value_t await_resume() {
+                        promise.waiting = false;
+                        value_t value = *promise.input;
+                        promise.input.reset();
+                        return value;
+                    }
+                };
+
+                return awaiter{ *this };
+            }
+        };
+
+        explicit session_t(std::coroutine_handle<promise_type> handle) : handle(handle) { }
+        session_t(session_t&& other) noexcept : handle(std::exchange(other.handle, nullptr)) { }
+        session_t& operator = (session_t&& other) noexcept {
+            std::swap(handle, other.handle);
+            return *this;
+        }
+        ~session_t() {
+            if (handle)
+                handle.destroy();
+        }
+
+        // Runs the program until it outputs something, halts, or needs an input
+        // that wasn't sent yet.
+        event_t resume() {
+            promise_type& promise = handle.promise();
+            if (!handle.done() && !(promise.waiting && !promise.input))
+                handle.resume();
+
+            if (promise.error)
+                std::rethrow_exception(std::exchange(promise.error, nullptr));
+
+            if (handle.done())
+                return finished;
+
+            return promise.waiting && !promise.input ? needs_input : has_output;
+        }
+
+        value_t output() const { return handle.promise().output; }
+        void send(value_t value) { handle.promise().input = value; }
+        bool done() const { return handle.done(); }
+
+        // Next output, in the middle of a sequence the program must not stop for input
+        value_t read() {
+            if (resume() != has_output)
+                throw std::runtime_error("program stopped mid-sequence");
+
+            return output();
+        }
+
+        // Next output, answering every input request with on_input(). Nothing once the program halted.
+        template <typename F>
+        std::optional<value_t> next(F&& on_input) {
+            for (;;) {
+                switch (resume()) {
+                case has_output:
+                    return output();
+                case needs_input:
+                    send(on_input());
+                    break;
+                case finished:
+                    return std::nullopt;
+                }
+            }
+        }
+
+        std::coroutine_handle<promise_type> handle;
+    };
+
+    // Every value that went in or out of a program and the instruction count it
+    // happened at, see program_t::recording and replay().
+    struct recording_t {
+        struct event_t {
+            size_t instruction_count;
+            value_t value;
+            bool output;
+
+            bool operator == (event_t const&) const = default;
+        };
+
+        void input(size_t instruction_count, value_t value) { events.push_back({ instruction_count, value, false }); }
+        void output(size_t instruction_count, value_t value) { events.push_back({ instruction_count, value, true }); }
+
+        void save(const char* path) const;
+        static recording_t load(const char* path);
+
+        std::vector<event_t> events;
+    };
+
+    // Everything needed to bring a program_t back to where it was, see program_t::snapshot.
+    struct snapshot_t {
+        std::deque<value_t> inputs;
+        std::vector<value_t> outputs;
+        memory_t ram;
+        std::vector<instruction_t> decoded;
+        size_t rel_base;
         size_t eip;
+        size_t instruction_count;
+        bool halted;
     };
 
     struct program_t {
         program_t(const value_t* program, size_t program_size);
+        program_t(snapshot_t snapshot);
+        snapshot_t snapshot() const;
+        void restore(snapshot_t const& snapshot);
+        program_t fork() const;
+        session_t session();
+        size_t step(size_t count);
         void exec();
+        void run();
+        bool needs_input() const;
+
+        instruction_t const& decode(size_t eip);
+        void write(size_t address, value_t value);
 
         std::deque<value_t> inputs;
         std::vector<value_t> outputs;
-        std::vector<value_t> ram;
+        memory_t ram; // Writes must go through write() to keep the decoded cache coherent
+        std::vector<instruction_t> decoded;
         size_t rel_base = 0;
+        size_t instruction_count = 0;
+        recording_t* recording = nullptr; // Not owned, logs every input and output while set
 
         opcode_t opc;
         bool halted = false;
     };
 
     opcode_t::opcode_t(program_t& program, size_t eip)
-        : eip(eip), program(program)
+        : program(program), instr(program.decode(eip)), eip(eip)
     {
-        value_t eip_instr = program.ram[eip];
-        code = intcode(eip_instr - (eip_instr / 100) * 100);
-
-        value_t parameter_modes = eip_instr / 100;
-        for (int32_t i = 0; i < get_parameter_count(); ++i) {
-            parameter_mode[i] = operation_mode(parameter_modes - (parameter_modes / 10) * 10);
-
-            parameter_modes /= 10;
-        }
     }
 
     size_t opcode_t::get_parameter_count() {
-        switch (code) {
-        case add:
-        case multiply:
-        case less_than:
-        case equals:
-            return 3;
-        case load_input:
-        case write_output:
-            return 1;
-        case jump_if_false:
-        case jump_if_true:
-            return 2;
-        case mod_rel_base:
-            return 1;
-        case halt:
-            return 0;
-        }
-
-        throw std::runtime_error("not implemented");
+        return instr.length - 1;
     }
 
-    value_t& opcode_t::get_parameter(int32_t index) {
-        switch (parameter_mode[index]) {
+    size_t opcode_t::get_address(int32_t index) {
+        switch (instr.parameter_mode[index]) {
         case position:
-            return program.get().ram[program.get().ram[eip + 1 + index]];
+            return instr.operands[index];
         case immediate:
-            return program.get().ram[eip + 1 + index];
-            break;
+            return eip + 1 + index;
         case relative:
-            return program.get().ram[program.get().rel_base + program.get().ram[eip + 1 + index]];
-            break;
+            return program.get().rel_base + instr.operands[index];
         default:
             throw std::runtime_error("not implemented");
         }
     }
 
+    value_t opcode_t::get_parameter(int32_t index) {
+        if (instr.parameter_mode[index] == immediate)
+            return instr.operands[index];
+
+        return program.get().ram.read(get_address(index));
+    }
+
+    void opcode_t::set_parameter(int32_t index, value_t value) {
+        program.get().write(get_address(index), value);
+    }
+
     std::optional<opcode_t> opcode_t::exec(std::deque<value_t>& inputs, std::vector<value_t>& outputs) {
 
-        switch (code) {
+        switch (instr.code) {
         case add:
             //std::cout << "Executing opcode add " << eip << " { @" << get_parameter(2) << " = " << get_parameter(1) << " + " << get_parameter(0) << "}" << std::endl;
-            get_parameter(2) = get_parameter(1) + get_parameter(0);
+            set_parameter(2, get_parameter(1) + get_parameter(0));
             break;
         case multiply:
             //std::cout << "Executing opcode multiply " << eip << " { @" << get_parameter(2) << " = " << get_parameter(1) << " + " << get_parameter(0) << "}" << std::endl;
-            get_parameter(2) = get_parameter(1) * get_parameter(0);
+            set_parameter(2, get_parameter(1) * get_parameter(0));
             break;
         case load_input:
         {
@@ -147,30 +404,34 @@ namespace computer {
             //std::cout << "Executing opcode load_input " << eip << " { @" << get_parameter(0) << " = " << inputs.front() << "}" << std::endl;
             auto input = inputs.front();
             inputs.pop_front();
-            get_parameter(0) = input;
+            set_parameter(0, input);
+            if (program.get().recording)
+                program.get().recording->input(program.get().instruction_count, input);
             break;
         }
         case write_output:
             //std::cout << "Executing opcode write_output " << eip << " { " << get_parameter(0) << "}" << std::endl;
             outputs.push_back(get_parameter(0));
+            if (program.get().recording)
+                program.get().recording->output(program.get().instruction_count, outputs.back());
             break;
         case less_than:
             //std::cout << "Executing opcode less_than " << eip << " { @" << get_parameter(2) << " = " << get_parameter(1) << " < " << get_parameter(0) << "}" << std::endl;
-            get_parameter(2) = get_parameter(0) < get_parameter(1);
+            set_parameter(2, get_parameter(0) < get_parameter(1));
             break;
         case equals:
             //std::cout << "Executing opcode equals " << eip << " { @" << get_parameter(2) << " = " << get_parameter(1) << " == " << get_parameter(0) << "}" << std::endl;
-            get_parameter(2) = get_parameter(0) == get_parameter(1);
+            set_parameter(2, get_parameter(0) == get_parameter(1));
             break;
         case jump_if_true:
             //std::cout << "Executing opcode jump_if_true " << eip << " { " << get_parameter(0) << "; @" << get_parameter(1) << "}" << std::endl;
             if (get_parameter(0) != 0)
-                return jump_to(get_parameter(1)).exec(inputs, outputs);
+                return jump_to(get_parameter(1));
             break;
         case jump_if_false:
             //std::cout << "Executing opcode jump_if_false " << eip << " { " << get_parameter(0) << "; @" << get_parameter(1) << "}" << std::endl;
             if (get_parameter(0) == 0)
-                return jump_to(get_parameter(1)).exec(inputs, outputs);
+                return jump_to(get_parameter(1));
             break;
         case mod_rel_base:
             //std::cout << "Executing opcode mod_rel_base " << eip << " { " << get_parameter(0) << "}" << std::endl;
@@ -185,7 +446,7 @@ namespace computer {
     }
 
     opcode_t opcode_t::next() {
-        return opcode_t{ program, eip + 1 + get_parameter_count() };
+        return opcode_t{ program, eip + instr.length };
     }
 
     opcode_t opcode_t::jump_to(size_t abs_ofs) {
@@ -195,27 +456,152 @@ namespace computer {
     // program_t
 
     program_t::program_t(const value_t* program, size_t program_size)
-        : opc(*this, 0), ram(program, program + program_size)
+        : ram(program, program_size), decoded(program_size), opc(*this, 0)
     {
-        ram.resize(std::max<size_t>(ram.size(), 0x8000u));
     }
 
+    instruction_t const& program_t::decode(size_t eip) {
+        // A jump to -1 or far past memory must not wrap or blow up the cache
+        if (eip >= memory_t::max_pages * memory_t::page_size)
+            throw std::runtime_error("address out of range");
+
+        if (eip >= decoded.size())
+            decoded.resize(eip + 1);
+
+        instruction_t& instr = decoded[eip];
+        if (instr.length != 0)
+            return instr;
+
+        value_t eip_instr = ram.read(eip);
+        instr.code = intcode(eip_instr - (eip_instr / 100) * 100);
+
+        size_t parameter_count = get_parameter_count(instr.code);
+        value_t parameter_modes = eip_instr / 100;
+        for (size_t i = 0; i < parameter_count; ++i) {
+            instr.parameter_mode[i] = operation_mode(parameter_modes - (parameter_modes / 10) * 10);
+            instr.operands[i] = ram.read(eip + 1 + i);
+
+            parameter_modes /= 10;
+        }
+
+        instr.length = parameter_count + 1;
+        return instr;
+    }
+
+    void program_t::write(size_t address, value_t value) {
+        ram.write(address, value);
+
+        // Self-modifying code: drop every cached instruction that covers this address.
+        for (size_t i = address < 3 ? 0 : address - 3; i <= address && i < decoded.size(); ++i)
+            if (decoded[i].length != 0 && i + decoded[i].length > address)
+                decoded[i].length = 0;
+    }
+
+    program_t::program_t(snapshot_t snapshot)
+        : inputs(std::move(snapshot.inputs)),
+        outputs(std::move(snapshot.outputs)),
+        ram(std::move(snapshot.ram)),
+        decoded(std::move(snapshot.decoded)),
+        rel_base(snapshot.rel_base),
+        instruction_count(snapshot.instruction_count),
+        opc(*this, snapshot.eip),
+        halted(snapshot.halted)
+    {
+    }
+
+    // Captures the program as it stands. Memory pages are shared with the snapshot
+    // until one side writes to them, so this costs the decode cache plus a pointer per page.
+    snapshot_t program_t::snapshot() const {
+        return snapshot_t{ inputs, outputs, ram, decoded, rel_base, opc.eip, instruction_count, halted };
+    }
+
+    void program_t::restore(snapshot_t const& snapshot) {
+        inputs = snapshot.inputs;
+        outputs = snapshot.outputs;
+        ram = snapshot.ram;
+        decoded = snapshot.decoded;
+        rel_base = snapshot.rel_base;
+        instruction_count = snapshot.instruction_count;
+        halted = snapshot.halted;
+        opc = opcode_t(*this, snapshot.eip);
+    }
+
+    // A second program that carries on independently from this one's current state.
+    program_t program_t::fork() const {
+        return program_t{ snapshot() };
+    }
+
+    bool program_t::needs_input() const {
+        return !halted && opc.instr.code == load_input && inputs.empty();
+    }
+
+    // Executes at most count instructions, stopping early if the program halts or
+    // blocks on an empty input queue. Returns the number of instructions executed.
+    size_t program_t::step(size_t count) {
+        // Decode again, the host may have patched memory since we last stopped
+        opc = opcode_t(*this, opc.eip);
+
+        size_t executed = 0;
+        while (executed < count && !halted && !needs_input()) {
+            std::optional<opcode_t> next_instr = opc.exec(inputs, outputs);
+            ++executed;
+            ++instruction_count;
+
+            if (next_instr)
+                opc = *next_instr;
+        }
+
+        return executed;
+    }
+
+    // Runs until the program halts or needs an input that isn't there yet.
     void program_t::exec() {
-        opcode_t curr_instr = opc;
+        step(std::numeric_limits<size_t>::max());
+    }
 
-        std::optional<opcode_t> next_instr = curr_instr.exec(inputs, outputs);
-        while (next_instr) {
-            // Stalled for an input read, break out
-            if (curr_instr == *next_instr)
+    // The program as a coroutine that yields at every output and awaits every input,
+    // instead of stalling on an empty queue and being called again. The session
+    // must not outlive the program.
+    session_t program_t::session() {
+        opc = opcode_t(*this, opc.eip);
+
+        while (!halted) {
+            switch (opc.instr.code) {
+            case write_output:
+            {
+                // Move past the instruction first so the program is consistent while suspended
+                value_t value = opc.get_parameter(0);
+                opc = opc.next();
+                if (recording)
+                    recording->output(instruction_count, value);
+                ++instruction_count;
+                co_yield value;
                 break;
-
-            curr_instr = *next_instr;
-            next_instr = curr_instr.exec(inputs, outputs);
+            }
+            case load_input:
+            {
+                value_t value = co_await session_t::input_t{};
+                opc.set_parameter(0, value);
+                opc = opc.next();
+                if (recording)
+                    recording->input(instruction_count, value);
+                ++instruction_count;
+                break;
+            }
+            default:
+                if (std::optional<opcode_t> next_instr = opc.exec(inputs, outputs))
+                    opc = *next_instr;
+                ++instruction_count;
+                break;
+            }
         }
+    }
 
-        // Not halted, set eip correctly
+    // Runs until the program halts, running out of inputs is an error.
+    void program_t::run() {
+        exec();
         if (!halted)
-            opc = curr_instr;
+            throw std::runtime_error("program is waiting for input");
     }
 
     program_t make_program(value_t* program, size_t count) {
@@ -226,6 +612,82 @@ namespace computer {
     program_t make_program(value_t(&program)[N]) {
         return program_t{ program, N };
     }
+
+    // "ICREC001", then two varints per event: the instruction count since the last
+    // event shifted left once with the low bit set for outputs, and the zigzagged value.
+    void recording_t::save(const char* path) const {
+        std::ofstream out(path, std::ios::binary);
+        if (!out)
+            throw std::runtime_error("can't write recording");
+
+        auto put = [&](uint64_t word) {
+            for (; word >= 0x80; word >>= 7)
+                out.put(char(word | 0x80));
+            out.put(char(word));
+        };
+
+        out.write("ICREC001", 8);
+
+        size_t previous = 0;
+        for (auto&& event : events) {
+            put(uint64_t(event.instruction_count - previous) << 1 | uint64_t(event.output));
+            put(uint64_t(event.value) << 1 ^ uint64_t(event.value >> 63));
+            previous = event.instruction_count;
+        }
+    }
+
+    recording_t recording_t::load(const char* path) {
+        std::ifstream in(path, std::ios::binary);
+        char magic[8];
+        if (!in.read(magic, sizeof(magic)) || std::string(magic, sizeof(magic)) != "ICREC001")
+            throw std::runtime_error("not a recording");
+
+        // False on a clean end of file, throws if it ends mid-word
+        auto get = [&](uint64_t& word, bool first) {
+            word = 0;
+            for (size_t shift = 0; shift < 64; shift += 7) {
+                char c;
+                if (!in.get(c)) {
+                    if (first && shift == 0)
+                        return false;
+                    throw std::runtime_error("truncated recording");
+                }
+
+                word |= uint64_t(c & 0x7f) << shift;
+                if ((c & 0x80) == 0)
+                    return true;
+            }
+
+            throw std::runtime_error("corrupt recording");
+        };
+
+        recording_t recording;
+        size_t instruction_count = 0;
+        for (uint64_t head, value; get(head, true); ) {
+            get(value, false);
+            instruction_count += head >> 1;
+            recording.events.push_back({ instruction_count, value_t(value >> 1) ^ -value_t(value & 1), (head & 1) != 0 });
+        }
+
+        return recording;
+    }
+
+    // Feeds a recording's inputs back to a program that is where it was when the
+    // recording started, no host involved. Returns what the program did this time,
+    // anything but the same events means it went somewhere else.
+    recording_t replay(program_t& program, recording_t const& recording) {
+        recording_t replayed;
+        replayed.events.reserve(recording.events.size());
+
+        for (auto&& event : recording.events)
+            if (!event.output)
+                program.inputs.push_back(event.value);
+
+        program.recording = &replayed;
+        program.exec();
+        program.recording = nullptr;
+        return replayed;
+    }
 }
 
 
@@ -280,12 +742,13 @@ struct roombat_t {
     };
 
     computer::program_t brain;
+    computer::session_t session;
     coordinate position;
     facing_t facing;
     hull_t hull;
 
     template <size_t N>
-    roombat_t(computer::value_t const (&p)[N]) : brain(p, N), position(0, 0), facing(north) { }
+    roombat_t(computer::value_t const (&p)[N]) : brain(p, N), session(brain.session()), position(0, 0), facing(north) { }
 
     hull_t::panel_t::color_t get_current_color() {
         return hull.get_color(position.x, position.y);
@@ -296,14 +759,18 @@ struct roombat_t {
         position.y += yd;
     }
 
+    // Paints one panel and moves on, returns true once the brain halted.
     bool step_once() {
-        brain.inputs.clear();
-        brain.inputs.push_back(get_current_color() == hull_t::panel_t::color_t::black ? 0 : 1);
-        brain.outputs.clear();
-        brain.exec();
+        auto camera = [this]() -> computer::value_t {
+            return get_current_color() == hull_t::panel_t::color_t::black ? 0 : 1;
+        };
 
-        auto new_color = hull_t::panel_t::color_t(brain.outputs.front());
-        auto direction = direction_t(brain.outputs.back());
+        std::optional<computer::value_t> color = session.next(camera);
+        if (!color)
+            return true;
+
+        auto new_color = hull_t::panel_t::color_t(*color);
+        auto direction = direction_t(session.read());
 
         hull.set_color(position.x, position.y, new_color);
         switch (facing) {
@@ -327,7 +794,7 @@ struct roombat_t {
                 throw std::runtime_error("out of range");
         }
 
-        return brain.halted;
+        return false;
     }
 
     size_t painted_panel_count() const {
@@ -341,13 +808,37 @@ computer::value_t state[] = {
 
 #define STEP 2
 
+// #define ENABLE_RECORD // Saves everything the brain read and wrote to roombat.rec
+// #define ENABLE_REPLAY // Plays roombat.rec back to the brain alone and times it
+
 int main() {
-#if STEP == 1
+#ifdef ENABLE_REPLAY
+    computer::program_t brain(state, sizeof(state) / sizeof(state[0]));
+    computer::recording_t recording = computer::recording_t::load("roombat.rec");
+
+    auto start = std::chrono::steady_clock::now();
+    computer::recording_t replayed = computer::replay(brain, recording);
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+
+    if (replayed.events != recording.events) {
+        std::cout << "Replay diverged" << std::endl;
+        return 1;
+    }
+
+    std::cout << "Replayed " << brain.instruction_count << " instructions in " << elapsed.count() << " ms" << std::endl;
+    return 0;
+#endif
+
     roombat_t roombat(state);
+#ifdef ENABLE_RECORD
+    computer::recording_t recording;
+    roombat.brain.recording = &recording;
+#endif
+
+#if STEP == 1
     while (!roombat.step_once());
     std::cout << roombat.painted_panel_count();
 #elif STEP == 2
-    roombat_t roombat(state);
     roombat.hull.set_color(roombat.position.x, roombat.position.y, hull_t::panel_t::color_t::white);
     while (!roombat.step_once());
 
@@ -379,5 +870,8 @@ int main() {
     }
 #endif
 
+#ifdef ENABLE_RECORD
+    recording.save("roombat.rec");
+#endif
     return 0;
 }
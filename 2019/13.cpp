@@ -9,6 +9,25 @@
 #include <deque>
 #include <algorithm>
 #include <optional>
+#include <limits>
+#include <array>
+#include <memory>
+#include <coroutine>
+#include <exception>
+#include <utility>
+#include <tuple>
+#include <chrono>
+#include <fstream>
+#include <string>
+
+// Counts instructions per opcode, guest block and eip under the host scope
+// they ran in, and time spent waiting on input into program_t::profile, see
+// profile_t. Compiles to nothing when left undefined.
+// #define ENABLE_PROFILER
+
+#ifdef ENABLE_PROFILER
+#include <map>
+#endif
 
 using size_t = std::size_t;
 
@@ -118,15 +137,306 @@ using value_t = int64_t;
 struct program_t;
 struct opcode_t;
 
+size_t get_parameter_count(intcode code) {
+    switch (code) {
+    case add:
+    case multiply:
+    case less_than:
+    case equals:
+        return 3;
+    case load_input:
+    case write_output:
+        return 1;
+    case jump_if_false:
+    case jump_if_true:
+        return 2;
+    case mod_rel_base:
+        return 1;
+    case halt:
+        return 0;
+    }
+
+    throw std::runtime_error("not implemented");
+}
+
+// An instruction as decoded from the program image. Decoded once per address
+// and cached by program_t until a write lands on one of its words.
+struct instruction_t {
+    intcode code;
+    std::array<operation_mode, 3> parameter_mode;
+    std::array<value_t, 3> operands;
+    size_t length = 0; // 0 if not decoded
+};
+
+// Program memory as a page table over 4 KiB pages. A page is allocated by the
+// first write that lands on it, reads of anything never written return 0, so a
+// program only costs the memory it touches.
+//
+// Copies share every page. Both sides lose write access to them, and the first
+// write to a page that is still shared copies it.
+struct memory_t {
+    constexpr const static size_t page_bits = 9;
+    constexpr const static size_t page_size = size_t(1) << page_bits; // In words
+    constexpr const static size_t page_mask = page_size - 1;
+    constexpr const static size_t max_pages = size_t(1) << 20; // 4 GiB worth of words
+
+    using page_t = std::array<value_t, page_size>;
+
+    memory_t() = default;
+    memory_t(value_t const* image, size_t size);
+
+    memory_t(memory_t const& other) { *this = other; }
+    memory_t& operator = (memory_t const& other);
+    memory_t(memory_t&&) = default;
+    memory_t& operator = (memory_t&&) = default;
+
+    value_t read(size_t address) const {
+        size_t index = address >> page_bits;
+        if (index >= table.size() || table[index] == nullptr)
+            return 0;
+
+        return (*table[index])[address & page_mask];
+    }
+
+    void write(size_t address, value_t value) {
+        size_t index = address >> page_bits;
+        page_t* page = index < writable.size() ? writable[index] : nullptr;
+        if (page == nullptr)
+            page = &make_writable(index);
+
+        (*page)[address & page_mask] = value;
+    }
+
+    page_t& make_writable(size_t index);
+
+    std::vector<page_t*> table; // By page index, nullptr if never written
+    mutable std::vector<page_t*> writable; // Same, but only pages nobody else shares
+    std::vector<std::shared_ptr<page_t>> pages;
+};
+
+memory_t::memory_t(value_t const* image, size_t size) {
+    for (size_t address = 0; address < size; address += page_size) {
+        page_t& page = make_writable(address >> page_bits);
+        std::copy(image + address, image + std::min(size, address + page_size), page.begin());
+    }
+}
+
+memory_t& memory_t::operator = (memory_t const& other) {
+    if (this != &other) {
+        table = other.table;
+        pages = other.pages;
+        writable.assign(table.size(), nullptr);
+        std::fill(other.writable.begin(), other.writable.end(), nullptr);
+    }
+
+    return *this;
+}
+
+memory_t::page_t& memory_t::make_writable(size_t index) {
+    if (index >= max_pages)
+        throw std::runtime_error("address out of range");
+
+    if (index >= table.size()) {
+        table.resize(index + 1);
+        writable.resize(index + 1);
+        pages.resize(index + 1);
+    }
+
+    std::shared_ptr<page_t>& page = pages[index];
+    if (page == nullptr) {
+        page = std::make_shared<page_t>();
+        page->fill(0);
+    }
+    else if (page.use_count() > 1) {
+        page = std::make_shared<page_t>(*page);
+    }
+
+    table[index] = writable[index] = page.get();
+    return *page;
+}
+
+#ifdef ENABLE_PROFILER
+// Where the game spent its instructions, by host scope and guest block, for
+// the report and flame graphs. See program_t::profile.
+struct profile_t {
+    using steady_clock = std::chrono::steady_clock;
+
+    // Names a stretch of host code, e.g. a game loop. Guest instructions run
+    // while it is alive are filed under it in the folded stacks, and the time
+    // spent in it shows up in the report. Scopes nest.
+    struct scope_t {
+        explicit scope_t(const char* name) : parent(current), start(steady_clock::now()) {
+            current = host().intern(parent, name);
+        }
+
+        ~scope_t() {
+            host().add_time(current, steady_clock::now() - start);
+            current = parent;
+        }
+
+        size_t parent;
+        steady_clock::time_point start;
+    };
+
+    // One instruction, where it ran from
+    struct frame_t {
+        size_t scope; // Host scope stack, 0 for none
+        size_t block; // Where the guest last jumped to, or fell through a jump
+        size_t eip;
+
+        bool operator == (frame_t const& o) const { return scope == o.scope && block == o.block && eip == o.eip; }
+    };
+
+    struct frame_hash {
+        size_t operator () (frame_t const& frame) const {
+            return std::hash<size_t>()(frame.eip) ^ (std::hash<size_t>()(frame.block) << 1) ^ (std::hash<size_t>()(frame.scope) << 2);
+        }
+    };
+
+    void count(size_t eip, intcode code) {
+        ++opcodes[code];
+        ++frames[{ current, block, eip }];
+    }
+
+    // Any jump ends the block, taken or not
+    void jump(size_t next) { block = next; }
+
+    void begin_wait() {
+        if (!waiting) {
+            waiting = true;
+            wait_start = steady_clock::now();
+        }
+    }
+
+    void end_wait() {
+        if (waiting) {
+            waiting = false;
+            input_wait += steady_clock::now() - wait_start;
+            ++waits;
+        }
+    }
+
+    void report(std::ostream& out, size_t top = 10) const;
+    void write_folded(std::ostream& out) const;
+
+    std::array<size_t, 100> opcodes{}; // By intcode
+    std::unordered_map<frame_t, size_t, frame_hash> frames;
+    steady_clock::duration input_wait{ 0 };
+    size_t waits = 0;
+
+    size_t block = 0;
+    bool waiting = false;
+    steady_clock::time_point wait_start;
+
+private:
+    // Scope stacks are interned so a frame only carries an index
+    struct host_t {
+        size_t intern(size_t parent, const char* name) {
+            auto [it, added] = ids.try_emplace({ parent, name }, names.size());
+            if (added) {
+                names.push_back(parent == 0 ? name : names[parent] + ";" + name);
+                time.emplace_back(0);
+            }
+            return it->second;
+        }
+
+        void add_time(size_t scope, steady_clock::duration elapsed) {
+            time[scope] += elapsed;
+        }
+
+        std::map<std::pair<size_t, std::string>, size_t> ids;
+        std::vector<std::string> names{ "" };
+        std::vector<steady_clock::duration> time{ steady_clock::duration(0) };
+    };
+
+    static host_t& host() {
+        static host_t instance;
+        return instance;
+    }
+
+    static inline size_t current = 0;
+};
+
+void profile_t::report(std::ostream& out, size_t top) const {
+    const char* names[100] = {};
+    names[add] = "add";
+    names[multiply] = "multiply";
+    names[load_input] = "load_input";
+    names[write_output] = "write_output";
+    names[jump_if_true] = "jump_if_true";
+    names[jump_if_false] = "jump_if_false";
+    names[less_than] = "less_than";
+    names[equals] = "equals";
+    names[mod_rel_base] = "mod_rel_base";
+    names[halt] = "halt";
+
+    auto sorted = [](auto const& counts) {
+        std::vector<std::pair<size_t, size_t>> entries(counts.begin(), counts.end());
+        std::sort(entries.begin(), entries.end(), [](auto const& l, auto const& r) {
+            return l.second != r.second ? l.second > r.second : l.first < r.first;
+        });
+        return entries;
+    };
+
+    size_t total = 0;
+    std::unordered_map<size_t, size_t> eips;
+    for (auto&& [frame, count] : frames) {
+        eips[frame.eip] += count;
+        total += count;
+    }
+
+    auto print = [&](const char* title, std::vector<std::pair<size_t, size_t>> const& entries, auto label) {
+        out << title << std::endl;
+        for (size_t i = 0; i < entries.size() && i < top; ++i)
+            out << "  " << std::setw(14) << label(entries[i].first) << std::setw(14) << entries[i].second
+                << std::setw(8) << std::fixed << std::setprecision(2) << 100.0 * entries[i].second / std::max<size_t>(total, 1) << "%" << std::endl;
+    };
+
+    std::unordered_map<size_t, size_t> by_opcode;
+    for (size_t i = 0; i < opcodes.size(); ++i)
+        if (opcodes[i] != 0)
+            by_opcode[i] = opcodes[i];
+
+    out << total << " instructions" << std::endl;
+    print("By opcode:", sorted(by_opcode), [&](size_t code) { return std::string(names[code] ? names[code] : "?"); });
+    print("Hottest eips:", sorted(eips), [](size_t eip) { return std::to_string(eip); });
+    out << "Waited on input " << waits << " times, "
+        << std::chrono::duration<double, std::milli>(input_wait).count() << " ms" << std::endl;
+
+    host_t const& scopes = host();
+    if (scopes.names.size() > 1) {
+        out << "Host scopes:" << std::endl;
+        for (size_t i = 1; i < scopes.names.size(); ++i)
+            out << "  " << scopes.names[i] << ": " << std::chrono::duration<double, std::milli>(scopes.time[i]).count() << " ms" << std::endl;
+    }
+}
+
+// One "frame;frame;... count" line per frame, as read by flamegraph.pl and speedscope.
+// Stacks are the host scopes, then the guest block, then the instruction.
+void profile_t::write_folded(std::ostream& out) const {
+    host_t const& scopes = host();
+    for (auto&& [frame, count] : frames) {
+        if (frame.scope != 0)
+            out << scopes.names[frame.scope] << ";";
+        out << "block_" << frame.block << ";eip_" << frame.eip << " " << count << "\n";
+    }
+}
+
+#define PROFILE(...) __VA_ARGS__
+#else
+#define PROFILE(...)
+#endif
+
 struct opcode_t {
     opcode_t(program_t& program, size_t eip);
     std::optional<opcode_t> exec(std::deque<value_t>& inputs, std::vector<value_t>& outputs);
-    value_t& get_parameter(int32_t index);
+    value_t get_parameter(int32_t index);
+    void set_parameter(int32_t index, value_t value);
+    size_t get_address(int32_t index);
     size_t get_parameter_count();
 
     void swap(opcode_t& other) {
-        parameter_mode.swap(other.parameter_mode);
-        code = other.code;
+        std::swap(instr, other.instr);
         eip = other.eip;
         std::swap(program, other.program);
     }
@@ -138,92 +448,242 @@ struct opcode_t {
 
     std::reference_wrapper<program_t> program;
 
-    std::unordered_map<size_t, operation_mode> parameter_mode;
-    intcode code;
+    instruction_t instr;
     size_t eip;
 };
 
+// Coroutine view of a program_t, see program_t::session. The program co_yields
+// every output and co_awaits every input, suspending is a couple of stores and
+// a return, so one thread can juggle as many sessions as it wants.
+struct session_t {
+    enum event_t {
+        has_output,
+        needs_input,
+        finished
+    };
+
+    struct input_t { };
+
+    struct promise_type {
+        value_t output = 0;
+        std::optional<value_t> input; // Sent by the host, taken by the next load_input
+        bool waiting = false;
+        std::exception_ptr error;
+
+        session_t get_return_object() { return session_t{ std::coroutine_handle<promise_type>::from_promise(*this) }; }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        std::suspend_always yield_value(value_t value) { output = value; return {}; }
+        void return_void() { }
+        void unhandled_exception() { error = std::current_exception(); }
+
+        // co_await input_t{} only suspends if the host hasn't sent anything yet
+        auto await_transform(input_t) {
+            struct awaiter {
+                promise_type& promise;
+
+                bool await_ready() const { return promise.input.has_value(); }
+                void await_suspend(std::coroutine_handle<promise_type>) { promise.waiting = true; }
+                value_t await_resume() {
+                    promise.waiting = false;
+                    value_t value = *promise.input;
+                    promise.input.reset();
+                    return value;
+                }
+            };
+
+            return awaiter{ *this };
+        }
+    };
+
+    explicit session_t(std::coroutine_handle<promise_type> handle) : handle(handle) { }
+    session_t(session_t&& other) noexcept : handle(std::exchange(other.handle, nullptr)) { }
+    session_t& operator = (session_t&& other) noexcept {
+        std::swap(handle, other.handle);
+        return *this;
+    }
+    ~session_t() {
+        if (handle)
+            handle.destroy();
+    }
+
+    // Runs the program until it outputs something, halts, or needs an input
+    // that wasn't sent yet.
+    event_t resume() {
+        promise_type& promise = handle.promise();
+        if (!handle.done() && !(promise.waiting && !promise.input))
+            handle.resume();
+
+        if (promise.error)
+            std::rethrow_exception(std::exchange(promise.error, nullptr));
+
+        if (handle.done())
+            return finished;
+
+        return promise.waiting && !promise.input ? needs_input : has_output;
+    }
+
+    value_t output() const { return handle.promise().output; }
+    void send(value_t value) { handle.promise().input = value; }
+    bool done() const { return handle.done(); }
+
+    // Next output, in the middle of a sequence the program must not stop for input
+    value_t read() {
+        if (resume() != has_output)
+            throw std::runtime_error("program stopped mid-sequence");
+
+        return output();
+    }
+
+    // Hands the outputs to on_tuple N at a time as N arguments, e.g. (x, y, tile),
+    // until the program asks for an input that wasn't sent or halts. Nothing is
+    // queued on the way. The program must not stop for input mid-tuple.
+    template <size_t N, typename F>
+    event_t forward(F&& on_tuple) {
+        std::array<value_t, N> tuple;
+        event_t event;
+        while ((event = resume()) == has_output) {
+            tuple[0] = output();
+            for (size_t i = 1; i < N; ++i)
+                tuple[i] = read();
+            std::apply(on_tuple, tuple);
+        }
+
+        return event;
+    }
+
+    // Next output, answering every input request with on_input(). Nothing once the program halted.
+    template <typename F>
+    std::optional<value_t> next(F&& on_input) {
+        for (;;) {
+            switch (resume()) {
+            case has_output:
+                return output();
+            case needs_input:
+                send(on_input());
+                break;
+            case finished:
+                return std::nullopt;
+            }
+        }
+    }
+
+    std::coroutine_handle<promise_type> handle;
+};
+
+// Every value that went in or out of a program and the instruction count it
+// happened at, see program_t::recording and replay().
+struct recording_t {
+    struct event_t {
+        size_t instruction_count;
+        value_t value;
+        bool output;
+
+        bool operator == (event_t const&) const = default;
+    };
+
+    void input(size_t instruction_count, value_t value) { events.push_back({ instruction_count, value, false }); }
+    void output(size_t instruction_count, value_t value) { events.push_back({ instruction_count, value, true }); }
+
+    void save(const char* path) const;
+    static recording_t load(const char* path);
+
+    std::vector<event_t> events;
+};
+
+// Everything needed to bring a program_t back to where it was, see program_t::snapshot.
+struct snapshot_t {
+    std::deque<value_t> inputs;
+    std::vector<value_t> outputs;
+    memory_t ram;
+    std::vector<instruction_t> decoded;
+    size_t rel_base;
+    size_t eip;
+    size_t instruction_count;
+    bool halted;
+};
+
 struct program_t {
     program_t(value_t const* program, size_t program_size);
+    program_t(snapshot_t snapshot);
+    snapshot_t snapshot() const;
+    void restore(snapshot_t const& snapshot);
+    program_t fork() const;
+    session_t session();
 
     
 private:// Horrible hack to properly initialize stuff
     program_t& load_ram(value_t const* program, size_t program_size);
 public:
 
+    size_t step(size_t count);
     void exec();
-    void reset();
+    void run();
+    bool needs_input() const;
+
+    instruction_t const& decode(size_t eip);
+    void write(size_t address, value_t value);
 
     std::deque<value_t> inputs;
     std::vector<value_t> outputs;
-    std::unordered_map<size_t, value_t> ram;
+    memory_t ram; // Writes must go through write() to keep the decoded cache coherent
+    std::vector<instruction_t> decoded;
     size_t rel_base = 0;
+    size_t instruction_count = 0;
+    recording_t* recording = nullptr; // Not owned, logs every input and output while set
 
     opcode_t opc;
     bool halted = false;
+
+#ifdef ENABLE_PROFILER
+    profile_t profile; // Not part of snapshots, keeps adding up across restore()
+#endif
 };
 
 opcode_t::opcode_t(program_t& program, size_t eip)
-    : eip(eip), program(program)
+    : program(program), instr(program.decode(eip)), eip(eip)
 {
-    value_t eip_instr = program.ram[eip];
-    code = intcode(eip_instr - (eip_instr / 100) * 100);
-
-    value_t parameter_modes = eip_instr / 100;
-    for (int32_t i = 0; i < get_parameter_count(); ++i) {
-        parameter_mode[i] = operation_mode(parameter_modes - (parameter_modes / 10) * 10);
-
-        parameter_modes /= 10;
-    }
 }
 
 size_t opcode_t::get_parameter_count() {
-    switch (code) {
-    case add:
-    case multiply:
-    case less_than:
-    case equals:
-        return 3;
-    case load_input:
-    case write_output:
-        return 1;
-    case jump_if_false:
-    case jump_if_true:
-        return 2;
-    case mod_rel_base:
-        return 1;
-    case halt:
-        return 0;
-    }
-
-    throw std::runtime_error("not implemented");
+    return instr.length - 1;
 }
 
-value_t& opcode_t::get_parameter(int32_t index) {
-    switch (parameter_mode[index]) {
+size_t opcode_t::get_address(int32_t index) {
+    switch (instr.parameter_mode[index]) {
     case position:
-        return program.get().ram[program.get().ram[eip + 1 + index]];
+        return instr.operands[index];
     case immediate:
-        return program.get().ram[eip + 1 + index];
-        break;
+        return eip + 1 + index;
     case relative:
-        return program.get().ram[program.get().rel_base + program.get().ram[eip + 1 + index]];
-        break;
+        return program.get().rel_base + instr.operands[index];
     default:
         throw std::runtime_error("not implemented");
     }
 }
 
+value_t opcode_t::get_parameter(int32_t index) {
+    if (instr.parameter_mode[index] == immediate)
+        return instr.operands[index];
+
+    return program.get().ram.read(get_address(index));
+}
+
+void opcode_t::set_parameter(int32_t index, value_t value) {
+    program.get().write(get_address(index), value);
+}
+
 std::optional<opcode_t> opcode_t::exec(std::deque<value_t>& inputs, std::vector<value_t>& outputs) {
+    PROFILE(program.get().profile.count(eip, instr.code));
 
-    switch (code) {
+    switch (instr.code) {
     case add:
         //std::cout << "Executing opcode add " << eip << " { @" << get_parameter(2) << " = " << get_parameter(1) << " + " << get_parameter(0) << "}" << std::endl;
-        get_parameter(2) = get_parameter(1) + get_parameter(0);
+        set_parameter(2, get_parameter(1) + get_parameter(0));
         break;
     case multiply:
         //std::cout << "Executing opcode multiply " << eip << " { @" << get_parameter(2) << " = " << get_parameter(1) << " + " << get_parameter(0) << "}" << std::endl;
-        get_parameter(2) = get_parameter(1) * get_parameter(0);
+        set_parameter(2, get_parameter(1) * get_parameter(0));
         break;
     case load_input:
     {
@@ -233,30 +693,40 @@ std::optional<opcode_t> opcode_t::exec(std::deque<value_t>& inputs, std::vector<
         //std::cout << "Executing opcode load_input " << eip << " { @" << get_parameter(0) << " = " << inputs.front() << "}" << std::endl;
         auto input = inputs.front();
         inputs.pop_front();
-        get_parameter(0) = input;
+        set_parameter(0, input);
+        if (program.get().recording)
+            program.get().recording->input(program.get().instruction_count, input);
         break;
     }
     case write_output:
         //std::cout << "Executing opcode write_output " << eip << " { " << get_parameter(0) << "}" << std::endl;
         outputs.push_back(get_parameter(0));
+        if (program.get().recording)
+            program.get().recording->output(program.get().instruction_count, outputs.back());
         break;
     case less_than:
         //std::cout << "Executing opcode less_than " << eip << " { @" << get_parameter(2) << " = " << get_parameter(1) << " < " << get_parameter(0) << "}" << std::endl;
-        get_parameter(2) = get_parameter(0) < get_parameter(1);
+        set_parameter(2, get_parameter(0) < get_parameter(1));
         break;
     case equals:
         //std::cout << "Executing opcode equals " << eip << " { @" << get_parameter(2) << " = " << get_parameter(1) << " == " << get_parameter(0) << "}" << std::endl;
-        get_parameter(2) = get_parameter(0) == get_parameter(1);
+        set_parameter(2, get_parameter(0) == get_parameter(1));
         break;
     case jump_if_true:
         //std::cout << "Executing opcode jump_if_true " << eip << " { " << get_parameter(0) << "; @" << get_parameter(1) << "}" << std::endl;
-        if (get_parameter(0) != 0)
-            return jump_to(get_parameter(1)).exec(inputs, outputs);
+        if (get_parameter(0) != 0) {
+            PROFILE(program.get().profile.jump(get_parameter(1)));
+            return jump_to(get_parameter(1));
+        }
+        PROFILE(program.get().profile.jump(eip + instr.length));
         break;
     case jump_if_false:
         //std::cout << "Executing opcode jump_if_false " << eip << " { " << get_parameter(0) << "; @" << get_parameter(1) << "}" << std::endl;
-        if (get_parameter(0) == 0)
-            return jump_to(get_parameter(1)).exec(inputs, outputs);
+        if (get_parameter(0) == 0) {
+            PROFILE(program.get().profile.jump(get_parameter(1)));
+            return jump_to(get_parameter(1));
+        }
+        PROFILE(program.get().profile.jump(eip + instr.length));
         break;
     case mod_rel_base:
         //std::cout << "Executing opcode mod_rel_base " << eip << " { " << get_parameter(0) << "}" << std::endl;
@@ -271,7 +741,7 @@ std::optional<opcode_t> opcode_t::exec(std::deque<value_t>& inputs, std::vector<
 }
 
 opcode_t opcode_t::next() {
-    return opcode_t{ program, eip + 1 + get_parameter_count() };
+    return opcode_t{ program, eip + instr.length };
 }
 
 opcode_t opcode_t::jump_to(size_t abs_ofs) {
@@ -282,39 +752,163 @@ opcode_t opcode_t::jump_to(size_t abs_ofs) {
 
 program_t::program_t(value_t const* program, size_t program_size) : opc(load_ram(program, program_size), 0)
 {
-    reset();
 }
 
 program_t& program_t::load_ram(value_t const* program, size_t program_size) {
-    for (size_t i = 0; i < program_size; ++i)
-        ram[i] = program[i];
+    ram = memory_t(program, program_size);
 
+    decoded.resize(program_size);
     return *this;
 }
 
-void program_t::reset() {
-    opc = opcode_t(*this, 0);
-    inputs.clear();
-    outputs.clear();
-    halted = false;
+instruction_t const& program_t::decode(size_t eip) {
+    // A jump to -1 or far past memory must not wrap or blow up the cache
+    if (eip >= memory_t::max_pages * memory_t::page_size)
+        throw std::runtime_error("address out of range");
+
+    if (eip >= decoded.size())
+        decoded.resize(eip + 1);
+
+    instruction_t& instr = decoded[eip];
+    if (instr.length != 0)
+        return instr;
+
+    value_t eip_instr = ram.read(eip);
+    instr.code = intcode(eip_instr - (eip_instr / 100) * 100);
+
+    size_t parameter_count = get_parameter_count(instr.code);
+    value_t parameter_modes = eip_instr / 100;
+    for (size_t i = 0; i < parameter_count; ++i) {
+        instr.parameter_mode[i] = operation_mode(parameter_modes - (parameter_modes / 10) * 10);
+        instr.operands[i] = ram.read(eip + 1 + i);
+
+        parameter_modes /= 10;
+    }
+
+    instr.length = parameter_count + 1;
+    return instr;
+}
+
+void program_t::write(size_t address, value_t value) {
+    ram.write(address, value);
+
+    // Self-modifying code: drop every cached instruction that covers this address.
+    for (size_t i = address < 3 ? 0 : address - 3; i <= address && i < decoded.size(); ++i)
+        if (decoded[i].length != 0 && i + decoded[i].length > address)
+            decoded[i].length = 0;
+}
+
+program_t::program_t(snapshot_t snapshot)
+    : inputs(std::move(snapshot.inputs)),
+    outputs(std::move(snapshot.outputs)),
+    ram(std::move(snapshot.ram)),
+    decoded(std::move(snapshot.decoded)),
+    rel_base(snapshot.rel_base),
+    instruction_count(snapshot.instruction_count),
+    opc(*this, snapshot.eip),
+    halted(snapshot.halted)
+{
+}
+
+// Captures the program as it stands. Memory pages are shared with the snapshot
+// until one side writes to them, so this costs the decode cache plus a pointer per page.
+snapshot_t program_t::snapshot() const {
+    return snapshot_t{ inputs, outputs, ram, decoded, rel_base, opc.eip, instruction_count, halted };
+}
+
+void program_t::restore(snapshot_t const& snapshot) {
+    inputs = snapshot.inputs;
+    outputs = snapshot.outputs;
+    ram = snapshot.ram;
+    decoded = snapshot.decoded;
+    rel_base = snapshot.rel_base;
+    instruction_count = snapshot.instruction_count;
+    halted = snapshot.halted;
+    opc = opcode_t(*this, snapshot.eip);
+}
+
+// A second program that carries on independently from this one's current state.
+program_t program_t::fork() const {
+    return program_t{ snapshot() };
+}
+
+bool program_t::needs_input() const {
+    return !halted && opc.instr.code == load_input && inputs.empty();
+}
+
+// Executes at most count instructions, stopping early if the program halts or
+// blocks on an empty input queue. Returns the number of instructions executed.
+size_t program_t::step(size_t count) {
+    // Decode again, the host may have patched memory since we last stopped
+    opc = opcode_t(*this, opc.eip);
+    PROFILE(if (!needs_input()) profile.end_wait());
+
+    size_t executed = 0;
+    while (executed < count && !halted && !needs_input()) {
+        std::optional<opcode_t> next_instr = opc.exec(inputs, outputs);
+        ++executed;
+        ++instruction_count;
+
+        if (next_instr)
+            opc = *next_instr;
+    }
+
+    PROFILE(if (needs_input()) profile.begin_wait());
+    return executed;
 }
 
+// Runs until the program halts or needs an input that isn't there yet.
 void program_t::exec() {
-    opcode_t curr_instr = opc;
+    step(std::numeric_limits<size_t>::max());
+}
 
-    std::optional<opcode_t> next_instr = curr_instr.exec(inputs, outputs);
-    while (next_instr) {
-        // Stalled for an input read, break out
-        if (curr_instr == *next_instr)
+// The program as a coroutine that yields at every output and awaits every input,
+// instead of stalling on an empty queue and being called again. The session
+// must not outlive the program.
+session_t program_t::session() {
+    opc = opcode_t(*this, opc.eip);
+
+    while (!halted) {
+        switch (opc.instr.code) {
+        case write_output:
+        {
+            // Move past the instruction first so the program is consistent while suspended
+            PROFILE(profile.count(opc.eip, write_output));
+            value_t value = opc.get_parameter(0);
+            opc = opc.next();
+            if (recording)
+                recording->output(instruction_count, value);
+            ++instruction_count;
+            co_yield value;
             break;
-
-        curr_instr = *next_instr;
-        next_instr = curr_instr.exec(inputs, outputs);
+        }
+        case load_input:
+        {
+            PROFILE(profile.count(opc.eip, load_input));
+            PROFILE(profile.begin_wait());
+            value_t value = co_await session_t::input_t{};
+            PROFILE(profile.end_wait());
+            opc.set_parameter(0, value);
+            opc = opc.next();
+            if (recording)
+                recording->input(instruction_count, value);
+            ++instruction_count;
+            break;
+        }
+        default:
+            if (std::optional<opcode_t> next_instr = opc.exec(inputs, outputs))
+                opc = *next_instr;
+            ++instruction_count;
+            break;
+        }
     }
+}
 
-    // Not halted, set eip correctly
+// Runs until the program halts, running out of inputs is an error.
+void program_t::run() {
+    exec();
     if (!halted)
-        opc = curr_instr;
+        throw std::runtime_error("program is waiting for input");
 }
 
 program_t make_program(value_t* program, size_t count) {
@@ -326,11 +920,87 @@ program_t make_program(value_t(&program)[N]) {
     return program_t{ program, N };
 }
 
+// "ICREC001", then two varints per event: the instruction count since the last
+// event shifted left once with the low bit set for outputs, and the zigzagged value.
+void recording_t::save(const char* path) const {
+    std::ofstream out(path, std::ios::binary);
+    if (!out)
+        throw std::runtime_error("can't write recording");
+
+    auto put = [&](uint64_t word) {
+        for (; word >= 0x80; word >>= 7)
+            out.put(char(word | 0x80));
+        out.put(char(word));
+    };
+
+    out.write("ICREC001", 8);
+
+    size_t previous = 0;
+    for (auto&& event : events) {
+        put(uint64_t(event.instruction_count - previous) << 1 | uint64_t(event.output));
+        put(uint64_t(event.value) << 1 ^ uint64_t(event.value >> 63));
+        previous = event.instruction_count;
+    }
+}
+
+recording_t recording_t::load(const char* path) {
+    std::ifstream in(path, std::ios::binary);
+    char magic[8];
+    if (!in.read(magic, sizeof(magic)) || std::string(magic, sizeof(magic)) != "ICREC001")
+        throw std::runtime_error("not a recording");
+
+    // False on a clean end of file, throws if it ends mid-word
+    auto get = [&](uint64_t& word, bool first) {
+        word = 0;
+        for (size_t shift = 0; shift < 64; shift += 7) {
+            char c;
+            if (!in.get(c)) {
+                if (first && shift == 0)
+                    return false;
+                throw std::runtime_error("truncated recording");
+            }
+
+            word |= uint64_t(c & 0x7f) << shift;
+            if ((c & 0x80) == 0)
+                return true;
+        }
+
+        throw std::runtime_error("corrupt recording");
+    };
+
+    recording_t recording;
+    size_t instruction_count = 0;
+    for (uint64_t head, value; get(head, true); ) {
+        get(value, false);
+        instruction_count += head >> 1;
+        recording.events.push_back({ instruction_count, value_t(value >> 1) ^ -value_t(value & 1), (head & 1) != 0 });
+    }
+
+    return recording;
+}
+
+// Feeds a recording's inputs back to a program that is where it was when the
+// recording started, no host involved. Returns what the program did this time,
+// anything but the same events means it went somewhere else.
+recording_t replay(program_t& program, recording_t const& recording) {
+    recording_t replayed;
+    replayed.events.reserve(recording.events.size());
+
+    for (auto&& event : recording.events)
+        if (!event.output)
+            program.inputs.push_back(event.value);
+
+    program.recording = &replayed;
+    program.exec();
+    program.recording = nullptr;
+    return replayed;
+}
+
 value_t state[] = {
    /* copy your intcode here */
 };
 
-enum block_type_t {
+enum block_type_t : uint8_t {
     air = 0,
     wall = 1,
     block = 2,
@@ -338,10 +1008,89 @@ enum block_type_t {
     ball = 4,
 };
 
+// The screen as the game draws it, one byte per tile, row after row. It grows
+// to take in whatever the game draws outside the current bounds: more rows are
+// appended (or shifted in at the top), wider rows mean laying everything out
+// again, which the game only makes happen while it draws its first row.
+// Rows remember whether they changed since the last clean(), so redrawing
+// only touches those.
+struct framebuffer_t {
+    block_type_t get(int32_t x, int32_t y) const {
+        if (x < minx || y < miny || x >= minx + width || y >= miny + height)
+            return air;
+
+        return tiles[size_t(y - miny) * width + (x - minx)];
+    }
+
+    // Returns what the tile was before
+    block_type_t set(int32_t x, int32_t y, block_type_t tile) {
+        grow(x, y);
+
+        block_type_t& slot = tiles[size_t(y - miny) * width + (x - minx)];
+        block_type_t previous = slot;
+        if (previous != tile) {
+            slot = tile;
+            dirty[y - miny] = true;
+        }
+        return previous;
+    }
+
+    void grow(int32_t x, int32_t y) {
+        if (width == 0) {
+            minx = x;
+            miny = y;
+            width = height = 1;
+            tiles.assign(1, air);
+            dirty.assign(1, true);
+            resized = true;
+            return;
+        }
+
+        int32_t left = std::min(minx, x);
+        int32_t right = std::max(minx + width, x + 1);
+        int32_t top = std::min(miny, y);
+        int32_t bottom = std::max(miny + height, y + 1);
+        if (left == minx && right == minx + width && top == miny && bottom == miny + height)
+            return;
+
+        if (left == minx && right == minx + width && top == miny) {
+            tiles.resize(size_t(bottom - top) * width, air);
+        }
+        else {
+            std::vector<block_type_t> moved(size_t(bottom - top) * (right - left), air);
+            for (int32_t row = 0; row < height; ++row)
+                std::copy_n(&tiles[size_t(row) * width], width, &moved[size_t(row + miny - top) * (right - left) + (minx - left)]);
+            tiles = std::move(moved);
+        }
+
+        minx = left;
+        miny = top;
+        width = right - left;
+        height = bottom - top;
+        dirty.assign(height, true);
+        resized = true;
+    }
+
+    void clean() {
+        std::fill(dirty.begin(), dirty.end(), false);
+        resized = false;
+    }
+
+    int32_t minx = 0;
+    int32_t miny = 0;
+    int32_t width = 0;
+    int32_t height = 0;
+    std::vector<block_type_t> tiles;
+    std::vector<uint8_t> dirty; // By row
+    bool resized = false; // Every row moved, not just the dirty ones
+};
+
 // #define ENABLE_DUMP_BOARD
 
 struct arcade_t {
     program_t program;
+    snapshot_t boot; // Program as loaded, before the first frame
+    session_t game;
 
     int32_t score = 0;
     int32_t block_count = 0;
@@ -349,63 +1098,54 @@ struct arcade_t {
     vec2i paddle;
     vec2i ball;
 
-#ifdef ENABLE_DUMP_BOARD
-    int32_t minx;
-    int32_t maxx;
-    int32_t miny;
-    int32_t maxy;
-    std::unordered_map<vec2i, block_type_t> board;
-#endif
+    // The game only redraws the tiles that change, this keeps the rest
+    framebuffer_t board;
 
     template <size_t N>
-    arcade_t(value_t const (&value)[N]) : program(value, N), paddle(0), ball(0) {
-        program.exec();
-
-#ifdef ENABLE_DUMP_BOARD
-        minx = std::numeric_limits<int32_t>::max();
-        miny = std::numeric_limits<int32_t>::max();
-        maxx = std::numeric_limits<int32_t>::min();
-        maxy = std::numeric_limits<int32_t>::min();
-#endif
-        for (size_t i = 0; i < program.outputs.size(); i += 3) {
-            int32_t x = program.outputs[i + 0];
-            int32_t y = program.outputs[i + 1];
-            block_type_t tile = block_type_t(program.outputs[i + 2]);
+    arcade_t(value_t const (&value)[N]) : program(value, N), boot(program.snapshot()), game(program.session()), paddle(0), ball(0) {
+        draw();
+    }
 
-            if (x == -1 && y == 0) {
-                score = program.outputs[i + 2];
-            }
-            else {
-#ifdef ENABLE_DUMP_BOARD
-                minx = std::min(minx, x);
-                maxx = std::max(maxx, x);
+    // One tile from the game, or the score at (-1, 0). Everything else is
+    // kept up to date from what the tile was before, so a frame costs what
+    // the game redrew.
+    void on_tile(value_t x, value_t y, value_t tile) {
+        if (x == -1 && y == 0) {
+            score = tile;
+            return;
+        }
 
-                miny = std::min(miny, y);
-                maxy = std::max(maxy, y);
-#endif
+        block_type_t previous = board.set(x, y, block_type_t(tile));
+        if (previous == block_type_t::block)
+            --block_count;
 
-                if (tile == block_type_t::block)
-                    ++block_count;
-                else if (tile == block_type_t::ball)
-                    ball = { x, y };
-                else if (tile == block_type_t::paddle)
-                    paddle = { x, y };
+        if (tile == block_type_t::paddle)
+            paddle = { int32_t(x), int32_t(y) };
+        else if (tile == block_type_t::block)
+            ++block_count;
+        else if (tile == block_type_t::ball)
+            ball = { int32_t(x), int32_t(y) };
+    }
 
-#ifdef ENABLE_DUMP_BOARD
-                board[{x, y}] = tile;
-#endif
-            }
-        }
+    // Takes tiles from the game until it asks for the joystick or ends
+    void draw() {
+        game.forward<3>([this](value_t x, value_t y, value_t tile) { on_tile(x, y, tile); });
     }
 
+    // Clears the console and prints everything the first time and whenever the
+    // board grew, after that only rewrites the rows that changed. All ANSI escapes.
     void dump() {
 #ifdef ENABLE_DUMP_BOARD
-        std::cout.flush();
-        system("cls");
+        if (board.resized)
+            std::cout << "\x1b[2J\x1b[H";
 
-        for (int32_t y = miny; y <= maxy; ++y) {
-            for (int32_t x = minx; x <= maxx; ++x) {
-                switch (board[{x, y}]) {
+        for (int32_t row = 0; row < board.height; ++row) {
+            if (!board.dirty[row])
+                continue;
+
+            std::cout << "\x1b[" << row + 1 << ";1H";
+            for (int32_t x = board.minx; x < board.minx + board.width; ++x) {
+                switch (board.get(x, board.miny + row)) {
                 case block_type_t::air:
                     std::cout << ' ';
                     break;
@@ -423,16 +1163,20 @@ struct arcade_t {
                     break;
                 }
             }
-            std::cout << std::endl;
         }
+
+        std::cout << "\x1b[" << board.height + 1 << ";1H" << std::flush;
+        board.clean();
 #endif
     }
 
     void reset() {
-        program.reset();
+        program.restore(boot);
+        game = program.session();
     }
 
     void step() {
+        PROFILE(profile_t::scope_t scope("arcade_t::step"));
         auto signof = [](int32_t v) {
             if (v > 0) return +1;
             if (v < 0) return -1;
@@ -440,69 +1184,72 @@ struct arcade_t {
         };
 
         int32_t input = signof(ball.x - paddle.x);
-        program.reset();
-        program.inputs.push_back(input);
-        program.exec();
+        game.send(input);
 
         size_t prev_blocks = block_count;
-        block_count = 0;
-
-        for (size_t i = 0; i < program.outputs.size(); i += 3) {
-            int32_t x = program.outputs[i + 0];
-            int32_t y = program.outputs[i + 1];
-
-            if (x == -1 && y == 0) {
-                score = program.outputs[i + 2];
-            }
-            else {
-                block_type_t tile = block_type_t(program.outputs[i + 2]);
-#ifdef ENABLE_DUMP_BOARD
-                minx = std::min(minx, x);
-                maxx = std::max(maxx, x);
-
-                miny = std::min(miny, y);
-                maxy = std::max(maxy, y);
-
-                board[{x, y}] = tile;
-#endif
-
-                if (tile == block_type_t::paddle)
-                    paddle = { x, y };
-                else if (tile == block_type_t::block)
-                    ++block_count;
-                else if (tile == block_type_t::ball)
-                    ball = { x, y };
-            }
-
-        }
+        draw();
 
 #ifdef ENABLE_DUMP_BOARD
         dump();
 #endif
 
         // std::cout << "Ball at " << ball.x << ", paddle at " << paddle.x << ", moving " << (input == -1 ? "left" : (input == 1 ? "right" : "not")) << std::endl;
-        if (block_count != prev_blocks) {
+        if (block_count != prev_blocks)
             std::cout << "Score: " << score << ", " << block_count << " blocks remaining.\r\n";
-            prev_blocks = block_count;
-        }
-        program.outputs.clear();
     }
 };
 
+// #define ENABLE_RECORD // Saves everything the game read and wrote during free play to arcade.rec
+// #define ENABLE_REPLAY // Plays arcade.rec back to the game alone and times it
+
 int main() {
+#ifdef ENABLE_REPLAY
+    program_t program(state, sizeof(state) / sizeof(state[0]));
+    program.write(0, 2); // Same free play the recording started from
+    recording_t recording = recording_t::load("arcade.rec");
+
+    auto start = std::chrono::steady_clock::now();
+    recording_t replayed = replay(program, recording);
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+
+    if (replayed.events != recording.events) {
+        std::cout << "Replay diverged" << std::endl;
+        return 1;
+    }
+
+    std::cout << "Replayed " << program.instruction_count << " instructions in " << elapsed.count() << " ms" << std::endl;
+    return 0;
+#endif
+
     arcade_t arcade(state);
     arcade.dump();
     std::cout << "Blocks to break: " << arcade.block_count << std::endl;
 
     arcade.reset();
-    arcade.program.ram[0] = 2; // Free play, wheeeee!
+    arcade.program.write(0, 2); // Free play, wheeeee!
+
+#ifdef ENABLE_RECORD
+    recording_t recording;
+    arcade.program.recording = &recording;
+#endif
 
-    while (arcade.block_count > 0 && !arcade.program.halted) {
+    while (arcade.block_count > 0 && !arcade.game.done()) {
         arcade.step();
         // arcade.dump();
     }
 
     std::cout << "Final score: " << arcade.score;
 
+#ifdef ENABLE_RECORD
+    arcade.program.recording = nullptr;
+    recording.save("arcade.rec");
+#endif
+
+#ifdef ENABLE_PROFILER
+    arcade.program.profile.report(std::cerr);
+    std::ofstream folded("intcode.folded");
+    arcade.program.profile.write_folded(folded);
+#endif
+
     return 0;
 }